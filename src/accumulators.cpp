@@ -16,6 +16,7 @@ using namespace libzerocoin;
 
 std::map<uint32_t, CBigNum> mapAccumulatorValues;
 std::list<uint256> listAccCheckpointsNoDB;
+CAccumulatorChecksumIndex accumulatorChecksumIndex;
 
 uint32_t ParseChecksum(uint256 nChecksum, CoinDenomination denomination)
 {
@@ -34,30 +35,84 @@ uint32_t GetChecksum(const CBigNum &bnValue)
     return hash.Get32();
 }
 
-// Find the first occurance of a certain accumulator checksum. Return 0 if not found.
-int GetChecksumHeight(uint32_t nChecksum, CoinDenomination denomination)
+//Checkpoints only change every 10 blocks, so once past the first multiple of 10 after the zerocoin
+//start height only every 10th block is looked at. This keeps the heights found identical to the former chain scan.
+static bool IsChecksumIndexHeight(int nHeight)
 {
-    CBlockIndex* pindex = chainActive[Params().Zerocoin_StartHeight()];
-    if (!pindex)
-        return 0;
+    int nHeightStart = Params().Zerocoin_StartHeight();
+    if (nHeight < nHeightStart)
+        return false;
 
-    //Search through blocks to find the checksum
-    while (pindex) {
-        if (ParseChecksum(pindex->nAccumulatorCheckpoint, denomination) == nChecksum)
-            return pindex->nHeight;
-
-        //Skip forward in groups of 10 blocks since checkpoints only change every 10 blocks
-        if (pindex->nHeight % 10 == 0) {
-            if (pindex->nHeight + 10 > chainActive.Height())
-                return 0;
-            pindex = chainActive[pindex->nHeight + 10];
-            continue;
-        }
+    return nHeight % 10 == 0 || nHeight < (nHeightStart + 9) / 10 * 10;
+}
 
-        pindex = chainActive.Next(pindex);
+void CAccumulatorChecksumIndex::ConnectBlock(const CBlockIndex* pindex)
+{
+    if (!IsChecksumIndexHeight(pindex->nHeight))
+        return;
+
+    //only the first occurrence is kept, later blocks carrying the same checksum are ignored
+    for (auto denom : zerocoinDenomList)
+        mapChecksumHeight[denom].emplace(ParseChecksum(pindex->nAccumulatorCheckpoint, denom), pindex->nHeight);
+}
+
+void CAccumulatorChecksumIndex::DisconnectBlock(const CBlockIndex* pindex)
+{
+    if (!IsChecksumIndexHeight(pindex->nHeight))
+        return;
+
+    for (auto denom : zerocoinDenomList) {
+        auto& mapHeights = mapChecksumHeight[denom];
+        auto it = mapHeights.find(ParseChecksum(pindex->nAccumulatorCheckpoint, denom));
+        if (it != mapHeights.end() && it->second == pindex->nHeight)
+            mapHeights.erase(it);
     }
+}
+
+void CAccumulatorChecksumIndex::SetTip(const CBlockIndex* pindexNew)
+{
+    LOCK(cs);
+    if (pindexNew && pindexNew->pprev == pindexTip) {
+        ConnectBlock(pindexNew);
+    } else if (pindexTip && pindexTip->pprev == pindexNew) {
+        DisconnectBlock(pindexTip);
+    } else if (pindexNew != pindexTip) {
+        mapChecksumHeight.clear();
+        if (pindexNew) {
+            std::vector<const CBlockIndex*> vChain;
+            for (const CBlockIndex* pindex = pindexNew; pindex; pindex = pindex->pprev)
+                vChain.emplace_back(pindex);
+            for (auto it = vChain.rbegin(); it != vChain.rend(); ++it)
+                ConnectBlock(*it);
+        }
+    }
+    pindexTip = pindexNew;
+}
+
+int CAccumulatorChecksumIndex::GetHeight(uint32_t nChecksum, CoinDenomination denom) const
+{
+    LOCK(cs);
+    auto itDenom = mapChecksumHeight.find(denom);
+    if (itDenom == mapChecksumHeight.end())
+        return 0;
+
+    auto it = itDenom->second.find(nChecksum);
+    return it == itDenom->second.end() ? 0 : it->second;
+}
+
+size_t CAccumulatorChecksumIndex::Size() const
+{
+    LOCK(cs);
+    size_t nSize = 0;
+    for (const auto& denomHeights : mapChecksumHeight)
+        nSize += denomHeights.second.size();
+    return nSize;
+}
 
-    return 0;
+// Find the first occurance of a certain accumulator checksum. Return 0 if not found.
+int GetChecksumHeight(uint32_t nChecksum, CoinDenomination denomination)
+{
+    return accumulatorChecksumIndex.GetHeight(nChecksum, denomination);
 }
 
 bool GetAccumulatorValueFromChecksum(uint32_t nChecksum, bool fMemoryOnly, CBigNum& bnAccValue)
@@ -267,12 +322,8 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, Accumulat
         }
 
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk", __func__);
-
         std::list<PublicCoin> listPubcoins;
-        if (!BlockToPubcoinList(block, listPubcoins, fFilterInvalid))
+        if (!GetBlockPubcoinList(pindex, listPubcoins, fFilterInvalid))
             return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
 
         nTotalMintsFound += listPubcoins.size();
@@ -362,20 +413,13 @@ int AddBlockMintsToAccumulator(const libzerocoin::PublicCoin& coin, const int nH
     // if this block contains mints of the denomination that is being spent, then add them to the witness
     int nMintsAdded = 0;
     if (pindex->MintedDenomination(coin.getDenomination())) {
-        //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk while adding pubcoins to witness", __func__);
-
+        //grab mints of this denomination from this block
         list<PublicCoin> listPubcoins;
-        if(!BlockToPubcoinList(block, listPubcoins, true))
-            return error("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
+        if(!GetBlockPubcoinList(pindex, listPubcoins, true, coin.getDenomination()))
+            return error("%s: failed to get zerocoin mintlist from block %d\n", __func__, pindex->nHeight);
 
         //add the mints to the witness
         for (const PublicCoin& pubcoin : listPubcoins) {
-            if (pubcoin.getDenomination() != coin.getDenomination())
-                continue;
-
             if (isWitness && pindex->nHeight == nHeightMintAdded && pubcoin.getValue() == coin.getValue())
                 continue;
 
@@ -413,22 +457,9 @@ bool GetAccumulatorValue(int& nHeight, const libzerocoin::CoinDenomination denom
     return true;
 }
 
-bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator, AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, string& strError, CBlockIndex* pindexCheckpoint)
+//Find where the mint was added to the chain and set up the witness walk from the checkpoint before it
+bool InitAccumulatorWitness(const PublicCoin& coin, CoinWitnessData& data)
 {
-    LogPrint("zero", "%s: generating\n", __func__);
-    int nLockAttempts = 0;
-    while (nLockAttempts < 100) {
-        TRY_LOCK(cs_main, lockMain);
-        if(!lockMain) {
-            MilliSleep(50);
-            nLockAttempts++;
-            continue;
-        }
-        break;
-    }
-    if (nLockAttempts == 100)
-        return error("%s: could not get lock on cs_main", __func__);
-    LogPrint("zero", "%s: after lock\n", __func__);
     uint256 txid;
     if (!zerocoinDB->ReadCoinMint(coin.getValue(), txid))
         return error("%s failed to read mint from db", __func__);
@@ -442,82 +473,155 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
     if (!IsTransactionInChain(txid, nHeightTest))
         return error("%s: mint tx %s is not in chain", __func__, txid.GetHex());
 
-    int nHeightMintAdded = mapBlockIndex[hashBlock]->nHeight;
+    data.SetNull();
+    data.denom = coin.getDenomination();
+    data.bnPubcoin = coin.getValue();
+    data.nHeightMintAdded = mapBlockIndex[hashBlock]->nHeight;
 
     //get the checkpoint added at the next multiple of 10
-    int nHeightCheckpoint = nHeightMintAdded + (10 - (nHeightMintAdded % 10));
+    int nHeightCheckpoint = data.nHeightMintAdded + (10 - (data.nHeightMintAdded % 10));
 
     //the height to start accumulating coins to add to witness
-    int nAccStartHeight = nHeightMintAdded - (nHeightMintAdded % 10);
+    data.nHeightAccStart = data.nHeightMintAdded - (data.nHeightMintAdded % 10);
 
     //Get the accumulator that is right before the cluster of blocks containing our mint was added to the accumulator
     CBigNum bnAccValue = 0;
-    if (GetAccumulatorValue(nHeightCheckpoint, coin.getDenomination(), bnAccValue)) {
-            accumulator.setValue(bnAccValue);
-            witness.resetValue(accumulator, coin);
-    }
+    if (GetAccumulatorValue(nHeightCheckpoint, coin.getDenomination(), bnAccValue))
+        data.bnWitness = bnAccValue;
 
     //add the pubcoins from the blockchain up to the next checksum starting from the block
-    CBlockIndex* pindex = chainActive[nHeightCheckpoint - 10];
-    int nChainHeight = chainActive.Height();
-    int nHeightStop = nChainHeight % 10;
-    nHeightStop = nChainHeight - nHeightStop - 20; // at least two checkpoints deep
+    data.nHeightNext = nHeightCheckpoint - 10;
 
-    //If looking for a specific checkpoint
-    if (pindexCheckpoint)
-        nHeightStop = pindexCheckpoint->nHeight - 10;
+    return true;
+}
 
-    //Iterate through the chain and calculate the witness
-    int nCheckpointsAdded = 0;
-    nMintsAdded = 0;
-    RandomizeSecurityLevel(nSecurityLevel); //make security level not always the same and predictable
-    libzerocoin::Accumulator witnessAccumulator = accumulator;
+//A stored witness can only be resumed if every block it has accumulated is still in the active chain
+bool IsAccumulatorWitnessInChain(const CoinWitnessData& data)
+{
+    if (data.IsNull())
+        return false;
+
+    if (data.hashLastBlock == 0)
+        return true;
+
+    BlockMap::const_iterator mi = mapBlockIndex.find(data.hashLastBlock);
+    return mi != mapBlockIndex.end() && chainActive.Contains(mi->second);
+}
+
+//Add pubcoins to the witness block by block until the stop height is reached or the security level is satisfied.
+//nHeightSpend is set to the height the walk stopped at, the data is left ready to resume from that height.
+bool AdvanceAccumulatorWitness(CoinWitnessData& data, int nHeightStop, int nSecurityLevel, int& nHeightSpend)
+{
+    nHeightSpend = -1;
+    CBlockIndex* pindex = chainActive[data.nHeightNext];
+    libzerocoin::PublicCoin coin(Params().Zerocoin_Params(false), data.bnPubcoin, data.denom);
+    libzerocoin::Accumulator witnessAccumulator(Params().Zerocoin_Params(false), data.denom, data.bnWitness);
 
-    bool fDoubleCounted = false;
     while (pindex) {
-        if (pindex->nHeight != nAccStartHeight && pindex->pprev->nAccumulatorCheckpoint != pindex->nAccumulatorCheckpoint)
+        int nCheckpointsAdded = data.nCheckpointsAdded;
+        if (pindex->nHeight != data.nHeightAccStart && pindex->pprev->nAccumulatorCheckpoint != pindex->nAccumulatorCheckpoint)
             ++nCheckpointsAdded;
 
-        //If the security level is satisfied, or the stop height is reached, then initialize the accumulator from here
+        //If the security level is satisfied, or the stop height is reached, then the spend uses the checkpoint from here.
+        //If this height is within the invalid range (when fraudulent coins were being minted), then continue past this range
         bool fSecurityLevelSatisfied = (nSecurityLevel != 100 && nCheckpointsAdded >= nSecurityLevel);
-        if (pindex->nHeight >= nHeightStop || fSecurityLevelSatisfied) {
-            //If this height is within the invalid range (when fraudulent coins were being minted), then continue past this range
-            if(InvalidCheckpointRange(pindex->nHeight))
-                continue;
-
-            bnAccValue = 0;
-            uint256 nCheckpointSpend = chainActive[pindex->nHeight + 10]->nAccumulatorCheckpoint;
-            if (!GetAccumulatorValueFromDB(nCheckpointSpend, coin.getDenomination(), bnAccValue) || bnAccValue == 0)
-                return error("%s : failed to find checksum in database for accumulator", __func__);
-
-            accumulator.setValue(bnAccValue);
+        if ((pindex->nHeight >= nHeightStop || fSecurityLevelSatisfied) && !InvalidCheckpointRange(pindex->nHeight)) {
+            nHeightSpend = pindex->nHeight;
             break;
         }
 
-        nMintsAdded += AddBlockMintsToAccumulator(coin, nHeightMintAdded, pindex, &witnessAccumulator, true);
+        data.nMintsAdded += AddBlockMintsToAccumulator(coin, data.nHeightMintAdded, pindex, &witnessAccumulator, true);
+        data.nCheckpointsAdded = nCheckpointsAdded;
+        data.hashLastBlock = pindex->GetBlockHash();
 
         // 10 blocks were accumulated twice when zBIT v2 was activated
-        if (pindex->nHeight == 1050010 && !fDoubleCounted) {
+        if (pindex->nHeight == 1050010 && !data.fDoubleCounted) {
             pindex = chainActive[1050000];
-            fDoubleCounted = true;
+            data.fDoubleCounted = true;
+        } else {
+            pindex = chainActive.Next(pindex);
+        }
+        data.nHeightNext = pindex ? pindex->nHeight : data.nHeightNext + 1;
+    }
+
+    data.bnWitness = witnessAccumulator.getValue();
+    return true;
+}
+
+bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator, AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, string& strError, CBlockIndex* pindexCheckpoint, const CoinWitnessData* pWitnessData)
+{
+    LogPrint("zero", "%s: generating\n", __func__);
+    int nLockAttempts = 0;
+    while (nLockAttempts < 100) {
+        TRY_LOCK(cs_main, lockMain);
+        if(!lockMain) {
+            MilliSleep(50);
+            nLockAttempts++;
             continue;
         }
+        break;
+    }
+    if (nLockAttempts == 100)
+        return error("%s: could not get lock on cs_main", __func__);
+    LogPrint("zero", "%s: after lock\n", __func__);
 
-        pindex = chainActive.Next(pindex);
+    int nChainHeight = chainActive.Height();
+    int nHeightStop = nChainHeight % 10;
+    nHeightStop = nChainHeight - nHeightStop - 20; // at least two checkpoints deep
+
+    //If looking for a specific checkpoint
+    if (pindexCheckpoint)
+        nHeightStop = pindexCheckpoint->nHeight - 10;
+
+    RandomizeSecurityLevel(nSecurityLevel); //make security level not always the same and predictable
+
+    //Resume from a precomputed witness if none of the blocks it covers are past where this spend stops.
+    //A witness that already holds more checkpoints than the security level asks for is still usable,
+    //AdvanceAccumulatorWitness then spends against the checkpoint right where it left off.
+    CoinWitnessData data;
+    bool fResume = false;
+    if (pWitnessData && pWitnessData->bnPubcoin == coin.getValue() && IsAccumulatorWitnessInChain(*pWitnessData)) {
+        int nHeightLastAdded = pWitnessData->nHeightNext - 1;
+        if (pWitnessData->fDoubleCounted)
+            nHeightLastAdded = std::max(nHeightLastAdded, 1050010);
+        fResume = nHeightLastAdded < nHeightStop;
+    }
+
+    if (fResume) {
+        data = *pWitnessData;
+        LogPrint("zero", "%s: resuming precomputed witness at height %d\n", __func__, data.nHeightNext);
+    } else if (!InitAccumulatorWitness(coin, data)) {
+        return false;
     }
 
+    //Iterate through the chain and calculate the witness
+    int nHeightSpend;
+    if (!AdvanceAccumulatorWitness(data, nHeightStop, nSecurityLevel, nHeightSpend))
+        return error("%s: failed to add pubcoins to witness", __func__);
+
+    if (nHeightSpend < 0 || !chainActive[nHeightSpend + 10])
+        return error("%s : no checkpoint available to spend against", __func__);
+
+    CBigNum bnAccValue = 0;
+    uint256 nCheckpointSpend = chainActive[nHeightSpend + 10]->nAccumulatorCheckpoint;
+    if (!GetAccumulatorValueFromDB(nCheckpointSpend, coin.getDenomination(), bnAccValue) || bnAccValue == 0)
+        return error("%s : failed to find checksum in database for accumulator", __func__);
+    accumulator.setValue(bnAccValue);
+
+    libzerocoin::Accumulator witnessAccumulator(Params().Zerocoin_Params(false), coin.getDenomination(), data.bnWitness);
     witness.resetValue(witnessAccumulator, coin);
     if (!witness.VerifyWitness(accumulator, coin))
         return error("%s: failed to verify witness", __func__);
 
     // A certain amount of accumulated coins are required
+    nMintsAdded = data.nMintsAdded;
     if (nMintsAdded < Params().Zerocoin_RequiredAccumulation()) {
         strError = _(strprintf("Less than %d mints added, unable to create spend", Params().Zerocoin_RequiredAccumulation()).c_str());
         return error("%s : %s", __func__, strError);
     }
 
     // calculate how many mints of this denomination existed in the accumulator we initialized
-    nMintsAdded += ComputeAccumulatedCoins(nAccStartHeight, coin.getDenomination());
+    nMintsAdded += ComputeAccumulatedCoins(data.nHeightAccStart, coin.getDenomination());
     LogPrint("zero", "%s : %d mints added to witness\n", __func__, nMintsAdded);
 
     return true;
@@ -11,12 +11,94 @@
 #include "primitives/zerocoin.h"
 #include "accumulatormap.h"
 #include "chain.h"
+#include "serialize.h"
+#include "sync.h"
 #include "uint256.h"
 
+#include <boost/unordered_map.hpp>
+
 class CBlockIndex;
 
+/** Follows the active chain and remembers, for every denomination, the first height each
+ *  accumulator checksum appeared at, so that GetChecksumHeight does not have to scan the chain */
+class CAccumulatorChecksumIndex
+{
+private:
+    mutable CCriticalSection cs;
+    const CBlockIndex* pindexTip;
+    std::map<libzerocoin::CoinDenomination, boost::unordered_map<uint32_t, int> > mapChecksumHeight;
+
+    void ConnectBlock(const CBlockIndex* pindex);
+    void DisconnectBlock(const CBlockIndex* pindex);
+
+public:
+    CAccumulatorChecksumIndex() : pindexTip(nullptr) {}
+
+    /** Move the index to a new tip of the active chain, rebuilding it if the tip is not adjacent */
+    void SetTip(const CBlockIndex* pindexNew);
+    /** First height of the active chain whose checkpoint holds nChecksum, 0 if there is none */
+    int GetHeight(uint32_t nChecksum, libzerocoin::CoinDenomination denom) const;
+    size_t Size() const;
+};
+
+extern CAccumulatorChecksumIndex accumulatorChecksumIndex;
+
+/** Resumable state of the chain walk that builds an accumulator witness for a single mint */
+class CoinWitnessData
+{
+public:
+    libzerocoin::CoinDenomination denom;
+    CBigNum bnPubcoin;
+    int nHeightMintAdded;
+    int nHeightAccStart;
+    int nHeightNext; //next block whose pubcoins get added to the witness
+    int nMintsAdded;
+    int nCheckpointsAdded;
+    bool fDoubleCounted;
+    uint256 hashLastBlock; //last block added, used to detect reorgs
+    CBigNum bnWitness;
+
+    CoinWitnessData() { SetNull(); }
+
+    void SetNull()
+    {
+        denom = libzerocoin::ZQ_ERROR;
+        bnPubcoin = 0;
+        nHeightMintAdded = 0;
+        nHeightAccStart = 0;
+        nHeightNext = 0;
+        nMintsAdded = 0;
+        nCheckpointsAdded = 0;
+        fDoubleCounted = false;
+        hashLastBlock = 0;
+        bnWitness = 0;
+    }
+
+    bool IsNull() const { return bnPubcoin == 0; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(denom);
+        READWRITE(bnPubcoin);
+        READWRITE(nHeightMintAdded);
+        READWRITE(nHeightAccStart);
+        READWRITE(nHeightNext);
+        READWRITE(nMintsAdded);
+        READWRITE(nCheckpointsAdded);
+        READWRITE(fDoubleCounted);
+        READWRITE(hashLastBlock);
+        READWRITE(bnWitness);
+    }
+};
+
 std::map<libzerocoin::CoinDenomination, int> GetMintMaturityHeight();
-bool GenerateAccumulatorWitness(const libzerocoin::PublicCoin &coin, libzerocoin::Accumulator& accumulator, libzerocoin::AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, std::string& strError, CBlockIndex* pindexCheckpoint = nullptr);
+bool InitAccumulatorWitness(const libzerocoin::PublicCoin& coin, CoinWitnessData& data);
+bool AdvanceAccumulatorWitness(CoinWitnessData& data, int nHeightStop, int nSecurityLevel, int& nHeightSpend);
+bool IsAccumulatorWitnessInChain(const CoinWitnessData& data);
+bool GenerateAccumulatorWitness(const libzerocoin::PublicCoin &coin, libzerocoin::Accumulator& accumulator, libzerocoin::AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, std::string& strError, CBlockIndex* pindexCheckpoint = nullptr, const CoinWitnessData* pWitnessData = nullptr);
 bool GetAccumulatorValueFromDB(uint256 nCheckpoint, libzerocoin::CoinDenomination denom, CBigNum& bnAccValue);
 bool GetAccumulatorValueFromChecksum(uint32_t nChecksum, bool fMemoryOnly, CBigNum& bnAccValue);
 void AddAccumulatorChecksum(const uint32_t nChecksum, const CBigNum &bnValue, bool fMemoryOnly);
@@ -0,0 +1,171 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+#include <map>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+    : nonce(GetRand(std::numeric_limits<uint64_t>::max())), header(block.GetBlockHeader()), vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase, and the coinstake of a proof-of-stake block, are never in the receiver's mempool
+    size_t nPrefilled = std::min(block.vtx.size(), (size_t)(block.IsProofOfStake() ? 2 : 1));
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = i;
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids[i - nPrefilled] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nonce;
+    uint256 shorttxidhash = ss.GetHash();
+    shorttxidk0 = shorttxidhash.Get64(0);
+    shorttxidk1 = shorttxidhash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<CTransaction>& vExtraTxn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    static const size_t nMinTxSize = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE_CURRENT / nMinTxSize || cmpctblock.BlockTxCount() > std::numeric_limits<uint16_t>::max())
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    int lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const CPrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull() || (int)prefilled.index <= lastprefilledindex || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        lastprefilledindex = prefilled.index;
+        txn_available[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // The positions of the short ids are the ones the prefilled transactions left free
+    std::map<uint64_t, uint16_t> mapShortTxIDs;
+    size_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vHave[i + nIndexOffset])
+            nIndexOffset++;
+        mapShortTxIDs[cmpctblock.shorttxids[i]] = i + nIndexOffset;
+    }
+    if (mapShortTxIDs.size() != cmpctblock.shorttxids.size()) {
+        // Two transactions of the block have the same short id
+        return READ_STATUS_FAILED;
+    }
+
+    // A position two of our transactions match is left to getblocktxn
+    std::vector<bool> vMatched(txn_available.size(), false);
+    {
+        LOCK(pool->cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            std::map<uint64_t, uint16_t>::iterator idit = mapShortTxIDs.find(cmpctblock.GetShortID(it->GetTx().GetHash()));
+            if (idit == mapShortTxIDs.end())
+                continue;
+            if (!vMatched[idit->second]) {
+                txn_available[idit->second] = it->GetTx();
+                vHave[idit->second] = true;
+                vMatched[idit->second] = true;
+                mempool_count++;
+            } else if (vHave[idit->second]) {
+                txn_available[idit->second] = CTransaction();
+                vHave[idit->second] = false;
+                mempool_count--;
+            }
+            if (mempool_count == mapShortTxIDs.size())
+                break;
+        }
+    }
+
+    std::vector<bool> vFromExtra(txn_available.size(), false);
+    for (size_t i = 0; i < vExtraTxn.size() && mempool_count + extra_count < mapShortTxIDs.size(); i++) {
+        const uint256& hash = vExtraTxn[i].GetHash();
+        std::map<uint64_t, uint16_t>::iterator idit = mapShortTxIDs.find(cmpctblock.GetShortID(hash));
+        if (idit == mapShortTxIDs.end())
+            continue;
+        if (!vMatched[idit->second]) {
+            txn_available[idit->second] = vExtraTxn[i];
+            vHave[idit->second] = true;
+            vMatched[idit->second] = true;
+            vFromExtra[idit->second] = true;
+            extra_count++;
+        } else if (vHave[idit->second] && txn_available[idit->second].GetHash() != hash) {
+            txn_available[idit->second] = CTransaction();
+            vHave[idit->second] = false;
+            if (vFromExtra[idit->second])
+                extra_count--;
+            else
+                mempool_count--;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized compact block %s: %u transactions, %u prefilled, %u from the mempool, %u from extra transactions\n",
+        header.GetHash().ToString(), txn_available.size(), prefilled_count, mempool_count, extra_count);
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.resize(txn_available.size());
+
+    size_t nMissingOffset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = txn_available[i];
+        } else {
+            if (nMissingOffset >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[nMissingOffset++];
+        }
+    }
+    if (nMissingOffset != vtx_missing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id collision with one of our transactions gives a block with the wrong transactions
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Reconstructed block %s with %u transactions asked for\n", header.GetHash().ToString(), vtx_missing.size());
+    return READ_STATUS_OK;
+}
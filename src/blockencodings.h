@@ -0,0 +1,164 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_BLOCKENCODINGS_H
+#define BITMONEY_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <vector>
+
+class CTxMemPool;
+
+//! Number of bytes of a short transaction id
+static const int SHORTTXIDS_LENGTH = 6;
+//! Compact blocks are only sent for blocks this close to the tip, peers would not have the transactions of older ones
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+//! getblocktxn is only answered for blocks this close to the tip, the full block is sent for older ones
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
+/** A transaction sent in full in a compact block, with its position in the block */
+struct CPrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(index);
+        READWRITE(tx);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //!< the peer sent something invalid
+    READ_STATUS_FAILED,  //!< the block could not be reconstructed, ask for the full block
+};
+
+/**
+ * A block announced by its header and block signature, the coinbase and coinstake, and the short
+ * ids of the other transactions, which the receiver is expected to have in its mempool. A short
+ * id is the lower 6 bytes of a SipHash-2-4 of the txid, keyed by the header and a random nonce, so
+ * that collisions cannot be prepared in advance.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class CPartialBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(VARINT(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            if (nShortTxIDs > MAX_BLOCK_SIZE_CURRENT)
+                throw std::ios_base::failure("too many short txids");
+            shorttxids.resize(nShortTxIDs);
+        }
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            READWRITE(lsb);
+            READWRITE(msb);
+            shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** The positions of the transactions of a compact block the receiver could not find ("getblocktxn") */
+struct CBlockTransactionsRequest {
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(indexes);
+    }
+};
+
+/** The transactions asked for with a CBlockTransactionsRequest, in the same order ("blocktxn") */
+struct CBlockTransactions {
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    CBlockTransactions() {}
+    explicit CBlockTransactions(const CBlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A block being reconstructed from a compact block, the mempool and the missing transactions */
+class CPartialBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count, extra_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    explicit CPartialBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), extra_count(0), pool(poolIn) {}
+
+    //! Find the transactions of a compact block in the mempool and in vExtraTxn
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<CTransaction>& vExtraTxn);
+    bool IsTxAvailable(size_t index) const;
+    //! Assemble the block from what was found and the missing transactions, in the order of the positions that were missing
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITMONEY_BLOCKENCODINGS_H
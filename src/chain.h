@@ -285,6 +285,9 @@ public:
         block.nBits = nBits;
         block.nNonce = nNonce;
         block.nAccumulatorCheckpoint = nAccumulatorCheckpoint;
+        // The index already knows its hash; only reuse it when the header is complete
+        if (phashBlock && (pprev || nHeight == 0))
+            block.SetCachedHash(*phashBlock);
         return block;
     }
 
@@ -484,7 +487,7 @@ public:
 
     }
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -494,7 +497,12 @@ public:
         block.nBits = nBits;
         block.nNonce = nNonce;
         block.nAccumulatorCheckpoint = nAccumulatorCheckpoint;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
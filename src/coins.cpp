@@ -5,10 +5,13 @@
 
 #include "coins.h"
 
+#include "memusage.h"
 #include "random.h"
 
 #include <assert.h>
 
+#include <algorithm>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -62,7 +65,7 @@ bool CCoins::Spend(int nPos)
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 
 
@@ -71,18 +74,35 @@ bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { retu
 bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase) { return base->BatchWrite(mapCoins, hashBlock, fErase); }
 bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0),
+                                                      cacheCoins(0, CCoinsKeyHasher(), std::equal_to<uint256>(), CCoinsMapAllocator(&cacheCoinsMemoryResource)),
+                                                      cachedCoinsUsage(0), cachedDirtyUsage(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
+size_t CCoinsViewCache::DirtyMemoryUsage() const
+{
+    return cachedDirtyUsage;
+}
+
+size_t CCoinsViewCache::PoolMemoryUsage() const
+{
+    return cacheCoinsMemoryResource.ChunkBytes();
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
     CCoinsMap::iterator it = cacheCoins.find(txid);
@@ -98,6 +118,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
@@ -115,6 +136,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -124,10 +146,13 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        cachedCoinUsage = ret.first->second.DynamicMemoryUsage();
     }
+    bool fWasDirty = (ret.first->second.flags & CCoinsCacheEntry::DIRTY) != 0;
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage, fWasDirty);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -162,7 +187,7 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
+bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn, bool fErase)
 {
     assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
@@ -176,10 +201,20 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // would have pulled it in at first GetCoins).
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
+                    if (fErase)
+                        entry.coins.swap(it->second.coins);
+                    else
+                        entry.coins = it->second.coins;
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    size_t nUsage = entry.DynamicMemoryUsage();
+                    cachedCoinsUsage += nUsage;
+                    cachedDirtyUsage += nUsage;
                 }
             } else {
+                size_t nUsageOld = itUs->second.DynamicMemoryUsage();
+                cachedCoinsUsage -= nUsageOld;
+                if (itUs->second.flags & CCoinsCacheEntry::DIRTY)
+                    cachedDirtyUsage -= nUsageOld;
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
@@ -187,13 +222,31 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
+                    if (!(itUs->second.flags & CCoinsCacheEntry::FRESH)) {
+                        // Our parent has a version of this entry, remember which outputs
+                        // now differ from it. A fresh child entry replaced ours as a whole.
+                        if (it->second.flags & CCoinsCacheEntry::FRESH)
+                            itUs->second.changed.SetRange(std::max(itUs->second.coins.vout.size(), it->second.coins.vout.size()));
+                        else
+                            itUs->second.changed.Merge(it->second.changed);
+                    }
+                    if (fErase)
+                        itUs->second.coins.swap(it->second.coins);
+                    else
+                        itUs->second.coins = it->second.coins;
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    size_t nUsage = itUs->second.DynamicMemoryUsage();
+                    cachedCoinsUsage += nUsage;
+                    cachedDirtyUsage += nUsage;
                 }
             }
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            it++;
+        }
     }
     hashBlock = hashBlockIn;
     return true;
@@ -201,11 +254,48 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
 
 bool CCoinsViewCache::Flush()
 {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, true);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
+    cachedDirtyUsage = 0;
     return fOk;
 }
 
+bool CCoinsViewCache::Sync()
+{
+    assert(!hasModifier);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, false);
+
+    // The base now has every entry as it is here; pruned entries are gone from it,
+    // the others are no longer modified
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.coins.IsPruned()) {
+            cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            cachedCoinsUsage -= it->second.changed.DynamicMemoryUsage();
+            it->second.changed.Clear();
+            it->second.flags = 0;
+            it++;
+        }
+    }
+    cachedDirtyUsage = 0;
+    return fOk;
+}
+
+void CCoinsViewCache::Trim(size_t nLimit)
+{
+    assert(!hasModifier);
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end() && DynamicMemoryUsage() > nLimit;) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            it++;
+            continue;
+        }
+        cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+        cacheCoins.erase(it++);
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -264,10 +354,23 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage, bool fDirty) : cache(cache_), it(it_), cachedCoinUsage(usage), fWasDirty(fDirty), fTrackOutputs(false), nOutputsBefore(0)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
+    const CCoins& coins = it->second.coins;
+    if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+        fTrackOutputs = true;
+        nOutputsBefore = coins.vout.size();
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull())
+                availableBefore.Set(i);
+        }
+        headerBefore.fCoinBase = coins.fCoinBase;
+        headerBefore.fCoinStake = coins.fCoinStake;
+        headerBefore.nHeight = coins.nHeight;
+        headerBefore.nVersion = coins.nVersion;
+    }
 }
 
 CCoinsModifier::~CCoinsModifier()
@@ -275,7 +378,30 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    if (fTrackOutputs) {
+        const CCoins& coins = it->second.coins;
+        unsigned int nOutputs = std::max(nOutputsBefore, (unsigned int)coins.vout.size());
+        if (coins.fCoinBase != headerBefore.fCoinBase || coins.fCoinStake != headerBefore.fCoinStake ||
+            coins.nHeight != headerBefore.nHeight || coins.nVersion != headerBefore.nVersion) {
+            // The metadata is stored with every output
+            it->second.changed.SetRange(nOutputs);
+        } else {
+            for (unsigned int i = 0; i < nOutputs; i++) {
+                bool fAvailable = i < coins.vout.size() && !coins.vout[i].IsNull();
+                if (fAvailable != availableBefore.IsSet(i))
+                    it->second.changed.Set(i);
+            }
+        }
+    }
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
+    if (fWasDirty)
+        cache.cachedDirtyUsage -= cachedCoinUsage;
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        size_t nUsage = it->second.DynamicMemoryUsage();
+        cache.cachedCoinsUsage += nUsage;
+        cache.cachedDirtyUsage += nUsage;
     }
 }
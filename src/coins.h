@@ -8,6 +8,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "core_memusage.h"
+#include "poolallocator.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -284,6 +286,15 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += RecursiveDynamicUsage(out.scriptPubKey);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -305,9 +316,69 @@ public:
     }
 };
 
+/**
+ * Set of output positions of a cached CCoins that may differ from the version in the
+ * parent view. A database storing one record per output only needs to rewrite these.
+ * The first 64 positions are kept inline.
+ */
+class CCoinsOutputMask
+{
+private:
+    prevector<8, unsigned char> bits;
+
+public:
+    void Set(unsigned int nPos)
+    {
+        if (nPos / 8 >= bits.size())
+            bits.resize(nPos / 8 + 1);
+        bits[nPos / 8] |= (1 << (nPos % 8));
+    }
+
+    //! mark the positions [0, nEnd)
+    void SetRange(unsigned int nEnd)
+    {
+        for (unsigned int i = 0; i < nEnd; i++)
+            Set(i);
+    }
+
+    bool IsSet(unsigned int nPos) const
+    {
+        return nPos / 8 < bits.size() && (bits[nPos / 8] & (1 << (nPos % 8))) != 0;
+    }
+
+    //! one past the highest position that can be set
+    unsigned int End() const { return bits.size() * 8; }
+
+    bool IsEmpty() const { return bits.empty(); }
+
+    void Merge(const CCoinsOutputMask& other)
+    {
+        if (other.bits.size() > bits.size())
+            bits.resize(other.bits.size());
+        for (unsigned int i = 0; i < other.bits.size(); i++)
+            bits[i] |= other.bits[i];
+    }
+
+    void Clear()
+    {
+        prevector<8, unsigned char>().swap(bits);
+    }
+
+    void swap(CCoinsOutputMask& other)
+    {
+        bits.swap(other.bits);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return bits.allocated_memory() ? memusage::DynamicUsage(bits) : 0;
+    }
+};
+
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    CCoinsOutputMask changed; // Outputs modified since the entry was fetched from the parent view, unless FRESH.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -315,9 +386,23 @@ struct CCoinsCacheEntry {
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
+
+    size_t DynamicMemoryUsage() const
+    {
+        return coins.DynamicMemoryUsage() + changed.DynamicMemoryUsage();
+    }
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+/**
+ * The nodes of the coins cache come from a pool owned by the cache. A boost unordered_map
+ * node holds the entry plus two words, the block size leaves room for implementation
+ * differences; larger allocations (the bucket array) bypass the pool.
+ */
+typedef PoolAllocator<std::pair<const uint256, CCoinsCacheEntry>,
+    sizeof(std::pair<const uint256, CCoinsCacheEntry>) + sizeof(void*) * 4>
+    CCoinsMapAllocator;
+typedef CCoinsMapAllocator::ResourceType CCoinsMapMemoryResource;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>, CCoinsMapAllocator> CCoinsMap;
 
 struct CCoinsStats {
     int nHeight;
@@ -347,8 +432,9 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! The passed mapCoins can be modified, unless fErase is false: then its entries
+    //! are only read, so a cache can write them out and keep them.
+    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
 
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
@@ -370,7 +456,7 @@ public:
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
     bool GetStats(CCoinsStats& stats) const;
 };
 
@@ -399,7 +485,15 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    bool fWasDirty;
+    // Unless the entry is fresh, which outputs were unspent and what the metadata was
+    // before modification, to find the outputs that changed.
+    bool fTrackOutputs;
+    CCoinsOutputMask availableBefore;
+    unsigned int nOutputsBefore;
+    CCoins headerBefore;
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage, bool fDirty);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -420,8 +514,15 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    //! Must outlive cacheCoins, whose nodes it holds
+    CCoinsMapMemoryResource cacheCoinsMemoryResource;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+    /* The part of cachedCoinsUsage belonging to DIRTY entries. */
+    size_t cachedDirtyUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -431,7 +532,7 @@ public:
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -454,9 +555,33 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(), but
+     * keep the written entries cached as unmodified ones. The base only writes the
+     * DIRTY entries and leaves the cache in place, so the cost is proportional to what
+     * changed since the last write, and the cache stays warm afterwards.
+     */
+    bool Sync();
+
+    /**
+     * Remove unmodified entries until the memory usage is at most nLimit, or no
+     * unmodified entries are left. Modified entries are never removed, Sync() first
+     * to make them eligible.
+     */
+    void Trim(size_t nLimit);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
+    //! Memory used by the modified entries, which a Sync() or Flush() would write
+    size_t DirtyMemoryUsage() const;
+
+    //! Memory reserved by the pool of the cache, which is kept for reuse as entries are removed
+    size_t PoolMemoryUsage() const;
+
     /** 
      * Amount of BitMoney coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
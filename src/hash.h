@@ -34,6 +34,7 @@
 #include "crypto/sph_sha2.h"  
 #include "crypto/sph_haval.h"  
 
+#include <atomic>
 #include <iomanip>
 #include <openssl/sha.h>
 #include <sstream>
@@ -307,6 +308,13 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+/** Compute the 160-bit hash of a prevector. */
+template <unsigned int N>
+inline uint160 Hash160(const prevector<N, unsigned char>& vch)
+{
+    return Hash160(vch.begin(), vch.end());
+}
+
 /** A writer stream (for serialization) that computes a 256-bit hash. */
 class CHashWriter
 {
@@ -353,14 +361,41 @@ uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROT
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, a keyed hash that is fast on short inputs */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data, only valid while the number of bytes written is a multiple of 8 */
+    CSipHasher& Write(uint64_t data);
+    /** Hash arbitrary bytes */
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far, the object remains untouched */
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a uint256, the same as CSipHasher(k0, k1).Write(val.begin(), 32).Finalize() but faster */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 void BIP32Hash(const ChainCode chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 //int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 //int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
+/** Number of XEVAN hashes computed since startup */
+extern std::atomic<uint64_t> nXevanHashCount;
+
 template<typename T1>
 inline uint256 XEVAN(const T1 pbegin, const T1 pend)
 {
+    nXevanHashCount++;
+
     //LogPrintf("X11 Hash \n");
 	sph_blake512_context      ctx_blake;
     sph_bmw512_context        ctx_bmw;
@@ -293,6 +293,22 @@ bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t
     return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
 }
 
+CHashWriter GetStakeKernelHasher(const CDataStream& ssUniqueID, const uint64_t nStakeModifier, unsigned int nTimeBlockFrom)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID;
+    return ss;
+}
+
+bool CheckStake(const CHashWriter& ssKernel, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    CHashWriter ss(ssKernel);
+    ss << nTimeTx;
+    hashProofOfStake = ss.GetHash();
+
+    return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
+}
+
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
     if (nTimeTx < nTimeBlockFrom)
@@ -314,8 +330,8 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     bool fSuccess = false;
     unsigned int nTryTime = 0;
     int nHeightStart = chainActive.Height();
-    int nHashDrift = 30;
-    CDataStream ssUniqueID = stakeInput->GetUniqueness();
+    int nHashDrift = STAKE_HASH_DRIFT;
+    CHashWriter ssKernel = GetStakeKernelHasher(stakeInput->GetUniqueness(), nStakeModifier, nTimeBlockFrom);
     CAmount nValueIn = stakeInput->GetValue();
     for (int i = 0; i < nHashDrift; i++) //iterate the hashing
     {
@@ -327,7 +343,7 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
         nTryTime = nTimeTx + nHashDrift - i;
 
         // if stake hash does not meet the target then continue to next iteration
-        if (!CheckStake(ssUniqueID, nValueIn, nStakeModifier, bnTargetPerCoinDay, nTimeBlockFrom, nTryTime, hashProofOfStake))
+        if (!CheckStake(ssKernel, nValueIn, bnTargetPerCoinDay, nTryTime, hashProofOfStake))
             continue;
 
         fSuccess = true; // if we make it this far then we have successfully created a stake hash
@@ -19,11 +19,18 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Number of future time slots tried for a stake kernel
+static const int STAKE_HASH_DRIFT = 30;
+
 // Compute the hash modifier for proof-of-stake
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
+// Hash state of the kernel parts that are the same for every time slot of a stake input
+CHashWriter GetStakeKernelHasher(const CDataStream& ssUniqueID, const uint64_t nStakeModifier, unsigned int nTimeBlockFrom);
+// Same as CheckStake(), continuing from a GetStakeKernelHasher() state
+bool CheckStake(const CHashWriter& ssKernel, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
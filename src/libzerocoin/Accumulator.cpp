@@ -43,7 +43,10 @@ Accumulator::Accumulator(const ZerocoinParams* p, const CoinDenomination d, cons
 
 void Accumulator::increment(const CBigNum& bnValue) {
     // Compute new accumulator = "old accumulator"^{element} mod N
-    this->value = this->value.pow_mod(bnValue, this->params->accumulatorModulus);
+    if (this->params->accumulatorMont)
+        this->value = this->value.pow_mod(bnValue, *this->params->accumulatorMont);
+    else
+        this->value.pow_mod_into(this->value, bnValue, this->params->accumulatorModulus);
 }
 
 void Accumulator::accumulate(const PublicCoin& coin) {
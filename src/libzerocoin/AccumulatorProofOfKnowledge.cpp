@@ -118,14 +118,21 @@ bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const CBigNum& v
 
 	CBigNum c = CBigNum(hasher.GetHash()); //this hash should be of length k_prime bits
 
-	CBigNum st_1_prime = (valueOfCommitmentToCoin.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * sg.pow_mod(s_alpha, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_phi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-	CBigNum st_2_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * ((valueOfCommitmentToCoin * sg.inverse(params->accumulatorPoKCommitmentGroup.modulus)).pow_mod(s_gamma, params->accumulatorPoKCommitmentGroup.modulus)) * sh.pow_mod(s_psi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-	CBigNum st_3_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * (sg * valueOfCommitmentToCoin).pow_mod(s_sigma, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_xi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-
-	CBigNum t_1_prime = (C_r.pow_mod(c, params->accumulatorModulus) * h_n.pow_mod(s_zeta, params->accumulatorModulus) * g_n.pow_mod(s_epsilon, params->accumulatorModulus)) % params->accumulatorModulus;
-	CBigNum t_2_prime = (C_e.pow_mod(c, params->accumulatorModulus) * h_n.pow_mod(s_eta, params->accumulatorModulus) * g_n.pow_mod(s_alpha, params->accumulatorModulus)) % params->accumulatorModulus;
-	CBigNum t_3_prime = ((a.getValue()).pow_mod(c, params->accumulatorModulus) * C_u.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
-	CBigNum t_4_prime = (C_r.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_delta, params->accumulatorModulus)) * ((g_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
+	// The generators go through the comb tables of their groups, the remaining bases
+	// through a simultaneous exponentiation. All exponents here are public.
+	const IntegerGroupParams& pokGroup = params->accumulatorPoKCommitmentGroup;
+	const IntegerGroupParams& qrnGroup = params->accumulatorQRNCommitmentGroup;
+	const CBigNum& pokModulus = pokGroup.modulus;
+	const CBigNum& accModulus = params->accumulatorModulus;
+
+	CBigNum st_1_prime = MultiExp({{valueOfCommitmentToCoin, c}}, pokModulus).mul_mod(pokGroup.pow_gh(s_alpha, s_phi, pokModulus), pokModulus);
+	CBigNum st_2_prime = MultiExp({{valueOfCommitmentToCoin * sg.inverse(pokModulus), s_gamma}}, pokModulus).mul_mod(pokGroup.pow_gh(c, s_psi, pokModulus), pokModulus);
+	CBigNum st_3_prime = MultiExp({{sg * valueOfCommitmentToCoin, s_sigma}}, pokModulus).mul_mod(pokGroup.pow_gh(c, s_xi, pokModulus), pokModulus);
+
+	CBigNum t_1_prime = MultiExp({{C_r, c}}, accModulus).mul_mod(qrnGroup.pow_gh(s_epsilon, s_zeta, accModulus), accModulus);
+	CBigNum t_2_prime = MultiExp({{C_e, c}}, accModulus).mul_mod(qrnGroup.pow_gh(s_alpha, s_eta, accModulus), accModulus);
+	CBigNum t_3_prime = MultiExp({{a.getValue(), c}, {C_u, s_alpha}}, accModulus).mul_mod(qrnGroup.pow_gh(CBigNum(0), -s_beta, accModulus), accModulus);
+	CBigNum t_4_prime = MultiExp({{C_r, s_alpha}}, accModulus).mul_mod(qrnGroup.pow_gh(-s_beta, -s_delta, accModulus), accModulus);
 
 	bool result_st1 = (st_1 == st_1_prime);
 	bool result_st2 = (st_2 == st_2_prime);
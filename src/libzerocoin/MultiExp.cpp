@@ -0,0 +1,136 @@
+/**
+ * @file       MultiExp.cpp
+ *
+ * @brief      Simultaneous and fixed-base modular exponentiation for the Zerocoin verifiers.
+ *
+ * @copyright  Copyright 2018 The BitMoney developers
+ * @license    This project is released under the MIT license.
+ **/
+
+#include "MultiExp.h"
+
+namespace libzerocoin {
+
+// Bit n of a little-endian magnitude as returned by CBigNum::getvch()
+static inline unsigned int GetBit(const std::vector<unsigned char>& vch, uint32_t n)
+{
+	return (n / 8 < vch.size()) ? (vch[n / 8] >> (n % 8)) & 1 : 0;
+}
+
+FixedBaseComb::FixedBaseComb(const CBigNum& base, const CBigNum& modulus, uint32_t nMaxExpBits)
+	: base(base % modulus), modulus(modulus) {
+	nSpacing = (nMaxExpBits + COMB_TEETH - 1) / COMB_TEETH;
+
+	// G_i = base^(2^(i * nSpacing))
+	std::vector<CBigNum> vG(COMB_TEETH);
+	vG[0] = this->base;
+	for (uint32_t i = 1; i < COMB_TEETH; i++) {
+		vG[i] = vG[i - 1];
+		for (uint32_t j = 0; j < nSpacing; j++)
+			vG[i].mul_mod_inplace(vG[i], modulus);
+	}
+
+	// vTable[v] = product of the G_i whose bit i is set in v
+	vTable.resize(1 << COMB_TEETH);
+	vTable[0] = CBigNum(1);
+	for (uint32_t v = 1; v < vTable.size(); v++) {
+		uint32_t i = 0;
+		while (!((v >> i) & 1))
+			i++;
+		uint32_t vRest = v & (v - 1);
+		vTable[v] = vRest ? vTable[vRest].mul_mod(vG[i], modulus) : vG[i];
+	}
+}
+
+CBigNum FixedBaseComb::pow_mod(const CBigNum& e) const {
+	bool fNegative = e < CBigNum(0);
+	CBigNum eAbs = fNegative ? CBigNum(0) - e : e;
+	if ((uint32_t)eAbs.bitSize() > nSpacing * COMB_TEETH)
+		return base.pow_mod(e, modulus);
+
+	std::vector<unsigned char> vch = eAbs.getvch();
+	CBigNum result(1);
+	bool fStarted = false;
+	for (int j = nSpacing - 1; j >= 0; j--) {
+		if (fStarted)
+			result.mul_mod_inplace(result, modulus);
+
+		uint32_t v = 0;
+		for (uint32_t i = 0; i < COMB_TEETH; i++)
+			v |= GetBit(vch, i * nSpacing + j) << i;
+
+		if (v) {
+			if (fStarted)
+				result.mul_mod_inplace(vTable[v], modulus);
+			else
+				result = vTable[v];
+			fStarted = true;
+		}
+	}
+
+	if (!fStarted)
+		return CBigNum(1) % modulus;
+
+	return fNegative ? result.inverse(modulus) : result;
+}
+
+CBigNum MultiExp(const std::vector<std::pair<CBigNum, CBigNum> >& vTerms, const CBigNum& modulus) {
+	const uint32_t nDigits = 1 << MULTIEXP_WINDOW;
+
+	// per term: the magnitude of the exponent and base^1 .. base^(2^w - 1)
+	std::vector<std::vector<unsigned char> > vExps;
+	std::vector<std::vector<CBigNum> > vTables;
+	uint32_t nMaxBits = 0;
+	for (const std::pair<CBigNum, CBigNum>& term : vTerms) {
+		const CBigNum& e = term.second;
+		if (e == CBigNum(0))
+			continue;
+
+		CBigNum base = term.first % modulus;
+		CBigNum eAbs = e;
+		if (e < CBigNum(0)) {
+			base = base.inverse(modulus);
+			eAbs = CBigNum(0) - e;
+		}
+
+		std::vector<CBigNum> vTable(nDigits);
+		vTable[1] = base;
+		for (uint32_t d = 2; d < nDigits; d++)
+			vTable[d] = vTable[d - 1].mul_mod(base, modulus);
+
+		nMaxBits = std::max(nMaxBits, (uint32_t)eAbs.bitSize());
+		vExps.emplace_back(eAbs.getvch());
+		vTables.emplace_back(std::move(vTable));
+	}
+
+	CBigNum result(1);
+	bool fStarted = false;
+	int nWindows = (nMaxBits + MULTIEXP_WINDOW - 1) / MULTIEXP_WINDOW;
+	for (int w = nWindows - 1; w >= 0; w--) {
+		if (fStarted) {
+			for (uint32_t i = 0; i < MULTIEXP_WINDOW; i++)
+				result.mul_mod_inplace(result, modulus);
+		}
+
+		for (uint32_t k = 0; k < vExps.size(); k++) {
+			uint32_t d = 0;
+			for (uint32_t i = 0; i < MULTIEXP_WINDOW; i++)
+				d |= GetBit(vExps[k], w * MULTIEXP_WINDOW + i) << i;
+
+			if (d) {
+				if (fStarted)
+					result.mul_mod_inplace(vTables[k][d], modulus);
+				else
+					result = vTables[k][d];
+				fStarted = true;
+			}
+		}
+	}
+
+	if (!fStarted)
+		return CBigNum(1) % modulus;
+
+	return result;
+}
+
+} /* namespace libzerocoin */
@@ -0,0 +1,61 @@
+/**
+ * @file       MultiExp.h
+ *
+ * @brief      Simultaneous and fixed-base modular exponentiation for the Zerocoin verifiers.
+ *
+ * @copyright  Copyright 2018 The BitMoney developers
+ * @license    This project is released under the MIT license.
+ **/
+
+#ifndef MULTIEXP_H_
+#define MULTIEXP_H_
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "bignum.h"
+
+// Number of teeth of a fixed-base comb, the table of a base holds 2^COMB_TEETH entries
+#define COMB_TEETH          8
+
+// Window width in bits used by the simultaneous (Straus) exponentiation
+#define MULTIEXP_WINDOW     4
+
+namespace libzerocoin {
+
+/**
+ * Lim-Lee comb table for a base that is raised to many different exponents modulo
+ * the same modulus, such as the generators of a group. Exponents of up to nMaxExpBits
+ * bits take nMaxExpBits / COMB_TEETH squarings and multiplications, larger ones fall
+ * back to a plain modular exponentiation.
+ *
+ * Not constant time, only use it with public exponents (proof verification).
+ */
+class FixedBaseComb {
+public:
+	FixedBaseComb(const CBigNum& base, const CBigNum& modulus, uint32_t nMaxExpBits);
+
+	/** base^e mod modulus, negative exponents use the inverse of the base */
+	CBigNum pow_mod(const CBigNum& e) const;
+
+	const CBigNum& getBase() const { return base; }
+	const CBigNum& getModulus() const { return modulus; }
+
+private:
+	CBigNum base;
+	CBigNum modulus;
+	uint32_t nSpacing;
+	std::vector<CBigNum> vTable;
+};
+
+/**
+ * Product of base_i^exp_i mod modulus computed with a single chain of squarings
+ * (Straus' simultaneous exponentiation). Negative exponents use the inverse of
+ * their base.
+ *
+ * Not constant time, only use it with public exponents (proof verification).
+ */
+CBigNum MultiExp(const std::vector<std::pair<CBigNum, CBigNum> >& vTerms, const CBigNum& modulus);
+
+} /* namespace libzerocoin */
+#endif /* MULTIEXP_H_ */
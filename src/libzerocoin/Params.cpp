@@ -12,6 +12,7 @@
 // Copyright (c) 2017 The PIVX developers
 
 #include "Params.h"
+#include "Commitment.h"
 #include "ParamGeneration.h"
 
 namespace libzerocoin {
@@ -26,6 +27,23 @@ ZerocoinParams::ZerocoinParams(CBigNum N, uint32_t securityLevel) {
 	// Generate the parameters
 	CalculateParams(*this, N, ZEROCOIN_PROTOCOL_VERSION, securityLevel);
 
+	// Comb tables for the generators the verifiers raise to large exponents. Each group is
+	// sized for the largest responses it sees: the commitment equality proof (PoK and SoK
+	// groups), the accumulator proof (PoK and QRN groups) and the serial number proof, whose
+	// sprime responses are up to twice the size of the SoK group order.
+	uint32_t nCommitmentProofBits = COMMITMENT_EQUALITY_CHALLENGE_SIZE + COMMITMENT_EQUALITY_SECMARGIN +
+	        std::max(std::max(serialNumberSoKCommitmentGroup.modulus.bitSize(), accumulatorParams.accumulatorPoKCommitmentGroup.modulus.bitSize()),
+	                 std::max(serialNumberSoKCommitmentGroup.groupOrder.bitSize(), accumulatorParams.accumulatorPoKCommitmentGroup.groupOrder.bitSize())) + 2;
+	uint32_t nAccumulatorProofBits = accumulatorParams.accumulatorModulus.bitSize() + accumulatorParams.accumulatorPoKCommitmentGroup.modulus.bitSize() +
+	        accumulatorParams.k_prime + accumulatorParams.k_dprime + 2;
+
+	coinCommitmentGroup.Precompute(coinCommitmentGroup.modulus, coinCommitmentGroup.groupOrder.bitSize() + 2);
+	uint32_t nSerialProofBits = 2 * serialNumberSoKCommitmentGroup.groupOrder.bitSize() + 2;
+	serialNumberSoKCommitmentGroup.Precompute(serialNumberSoKCommitmentGroup.modulus, std::max(nCommitmentProofBits, nSerialProofBits));
+	accumulatorParams.accumulatorPoKCommitmentGroup.Precompute(accumulatorParams.accumulatorPoKCommitmentGroup.modulus, nCommitmentProofBits);
+	accumulatorParams.accumulatorQRNCommitmentGroup.Precompute(accumulatorParams.accumulatorModulus, nAccumulatorProofBits);
+	accumulatorParams.accumulatorMont = accumulatorParams.accumulatorQRNCommitmentGroup.mont;
+
 	this->accumulatorParams.initialized = true;
 	this->initialized = true;
 }
@@ -45,4 +63,25 @@ CBigNum IntegerGroupParams::randomElement() const {
 	return this->g.pow_mod(CBigNum::randBignum(this->groupOrder),this->modulus);
 }
 
+void IntegerGroupParams::Precompute(const CBigNum& mod, uint32_t nMaxExpBits) {
+	this->mont = std::make_shared<const CBigNumMont>(mod);
+	this->gComb = std::make_shared<const FixedBaseComb>(this->g, mod, nMaxExpBits);
+	this->hComb = std::make_shared<const FixedBaseComb>(this->h, mod, nMaxExpBits);
+}
+
+CBigNum IntegerGroupParams::pow_gh(const CBigNum& eg, const CBigNum& eh, const CBigNum& mod) const {
+	CBigNum ret;
+	if (gComb && hComb && gComb->getModulus() == mod) {
+		ret = gComb->pow_mod(eg);
+		ret.mul_mod_inplace(hComb->pow_mod(eh), mod);
+	} else if (mont && mont->getModulus() == mod) {
+		ret = this->g.pow_mod(eg, *mont);
+		ret.mul_mod_inplace(this->h.pow_mod(eh, *mont), mod);
+	} else {
+		ret = this->g.pow_mod(eg, mod);
+		ret.mul_mod_inplace(this->h.pow_mod(eh, mod), mod);
+	}
+	return ret;
+}
+
 } /* namespace libzerocoin */
@@ -14,7 +14,9 @@
 #ifndef PARAMS_H_
 #define PARAMS_H_
 
+#include <memory>
 #include "bignum.h"
+#include "MultiExp.h"
 #include "ZerocoinDefines.h"
 
 namespace libzerocoin {
@@ -32,6 +34,19 @@ public:
 	 * @return a random element in the group.
 	 */
 	CBigNum randomElement() const;
+
+	/**
+	 * Builds the Montgomery context of mod and the comb tables of g and h
+	 * for exponents of up to nMaxExpBits bits modulo mod.
+	 */
+	void Precompute(const CBigNum& mod, uint32_t nMaxExpBits);
+
+	/**
+	 * g^eg * h^eh mod mod, using the comb tables when they were built for
+	 * this modulus. Only for public exponents (proof verification).
+	 */
+	CBigNum pow_gh(const CBigNum& eg, const CBigNum& eh, const CBigNum& mod) const;
+
 	bool initialized;
 
 	/**
@@ -56,6 +71,14 @@ public:
 	 */
 	CBigNum groupOrder;
 
+	/**
+	 * Comb tables of g and h and the Montgomery context of their modulus,
+	 * not serialized and shared between copies.
+	 */
+	std::shared_ptr<const FixedBaseComb> gComb;
+	std::shared_ptr<const FixedBaseComb> hComb;
+	std::shared_ptr<const CBigNumMont> mont;
+
 	ADD_SERIALIZE_METHODS;
   template <typename Stream, typename Operation>  inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
 		    READWRITE(initialized);
@@ -139,6 +162,12 @@ public:
 	 * The statistical zero-knowledgeness of the accumulator proof.
 	 */
 	uint32_t k_dprime;
+
+	/**
+	 * Montgomery context of the accumulator modulus, not serialized.
+	 */
+	std::shared_ptr<const CBigNumMont> accumulatorMont;
+
 	ADD_SERIALIZE_METHODS;
   template <typename Stream, typename Operation>  inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
 	    READWRITE(initialized);
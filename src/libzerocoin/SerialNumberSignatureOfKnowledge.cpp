@@ -124,12 +124,16 @@ inline CBigNum SerialNumberSignatureOfKnowledge::challengeCalculation(const CBig
 	return (g.pow_mod(exponent, params->serialNumberSoKCommitmentGroup.modulus) * h.pow_mod(h_exp, params->serialNumberSoKCommitmentGroup.modulus)) % params->serialNumberSoKCommitmentGroup.modulus;
 }
 
+inline CBigNum SerialNumberSignatureOfKnowledge::challengeVerification(const CBigNum& a_exp, const CBigNum& b_exp,
+        const CBigNum& h_exp) const {
+
+	CBigNum exponent = params->coinCommitmentGroup.pow_gh(a_exp, b_exp, params->serialNumberSoKCommitmentGroup.groupOrder);
+
+	return params->serialNumberSoKCommitmentGroup.pow_gh(exponent, h_exp, params->serialNumberSoKCommitmentGroup.modulus);
+}
+
 bool SerialNumberSignatureOfKnowledge::Verify(const CBigNum& coinSerialNumber, const CBigNum& valueOfCommitmentToCoin,
         const uint256 msghash) const {
-	CBigNum a = params->coinCommitmentGroup.g;
-	CBigNum b = params->coinCommitmentGroup.h;
-	CBigNum g = params->serialNumberSoKCommitmentGroup.g;
-	CBigNum h = params->serialNumberSoKCommitmentGroup.h;
 	CHashWriter hasher(0,0);
 	hasher << *params << valueOfCommitmentToCoin << coinSerialNumber << msghash;
 
@@ -141,12 +145,12 @@ bool SerialNumberSignatureOfKnowledge::Verify(const CBigNum& coinSerialNumber, c
 		int byte = i / 8;
 		bool challenge_bit = ((hashbytes[byte] >> bit) & 0x01);
 		if(challenge_bit) {
-			tprime[i] = challengeCalculation(coinSerialNumber, s_notprime[i], SeedTo1024(sprime[i].getuint256()));
+			tprime[i] = challengeVerification(coinSerialNumber, s_notprime[i], SeedTo1024(sprime[i].getuint256()));
 		} else {
-			CBigNum exp = b.pow_mod(s_notprime[i], params->serialNumberSoKCommitmentGroup.groupOrder);
-			tprime[i] = ((valueOfCommitmentToCoin.pow_mod(exp, params->serialNumberSoKCommitmentGroup.modulus) % params->serialNumberSoKCommitmentGroup.modulus) *
-			             (h.pow_mod(sprime[i], params->serialNumberSoKCommitmentGroup.modulus) % params->serialNumberSoKCommitmentGroup.modulus)) %
-			            params->serialNumberSoKCommitmentGroup.modulus;
+			CBigNum exp = params->coinCommitmentGroup.pow_gh(CBigNum(0), s_notprime[i], params->serialNumberSoKCommitmentGroup.groupOrder);
+			tprime[i] = MultiExp({{valueOfCommitmentToCoin, exp}}, params->serialNumberSoKCommitmentGroup.modulus).mul_mod(
+			            params->serialNumberSoKCommitmentGroup.pow_gh(CBigNum(0), sprime[i], params->serialNumberSoKCommitmentGroup.modulus),
+			            params->serialNumberSoKCommitmentGroup.modulus);
 		}
 	}
 	for(uint32_t i = 0; i < params->zkp_iterations; i++) {
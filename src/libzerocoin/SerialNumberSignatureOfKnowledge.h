@@ -69,6 +69,10 @@ private:
 	vector<CBigNum> sprime;
 	inline CBigNum challengeCalculation(const CBigNum& a_exp, const CBigNum& b_exp,
 	                                   const CBigNum& h_exp) const;
+	// Same as challengeCalculation, but through the comb tables of the groups.
+	// Only for the public responses checked in Verify.
+	inline CBigNum challengeVerification(const CBigNum& a_exp, const CBigNum& b_exp,
+	                                    const CBigNum& h_exp) const;
 };
 
 } /* namespace libzerocoin */
@@ -10,7 +10,10 @@
 #include "BitMoney-config.h"
 #endif
 
+#include <cstring>
+#include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 #if defined(USE_NUM_GMP)
 #include <gmp.h>
@@ -34,25 +37,36 @@ public:
 #if defined(USE_NUM_OPENSSL)
 
 
-/** RAII encapsulated BN_CTX (OpenSSL bignum context) */
+struct BN_CTXDeleter
+{
+    void operator()(BN_CTX* pctx) const { BN_CTX_free(pctx); }
+};
+
+/** BN_CTX (OpenSSL bignum context) of the calling thread. OpenSSL functions
+ *  take and release their temporaries in BN_CTX_start/BN_CTX_end frames, so one
+ *  context per thread serves every CBigNum operation of that thread and its
+ *  temporaries are reused instead of being allocated on every call. */
+inline BN_CTX* GetThreadBN_CTX()
+{
+    static thread_local std::unique_ptr<BN_CTX, BN_CTXDeleter> pctx;
+    if (!pctx) {
+        pctx.reset(BN_CTX_new());
+        if (!pctx)
+            throw bignum_error("GetThreadBN_CTX : BN_CTX_new() returned NULL");
+    }
+    return pctx.get();
+}
+
+/** Encapsulated BN_CTX (OpenSSL bignum context), borrowed from the calling thread */
 class CAutoBN_CTX
 {
 protected:
     BN_CTX* pctx;
-    BN_CTX* operator=(BN_CTX* pnew) { return pctx = pnew; }
 
 public:
     CAutoBN_CTX()
     {
-        pctx = BN_CTX_new();
-        if (pctx == NULL)
-            throw bignum_error("CAutoBN_CTX : BN_CTX_new() returned NULL");
-    }
-
-    ~CAutoBN_CTX()
-    {
-        if (pctx != NULL)
-            BN_CTX_free(pctx);
+        pctx = GetThreadBN_CTX();
     }
 
     operator BN_CTX*() { return pctx; }
@@ -61,9 +75,12 @@ public:
     bool operator!() { return (pctx == NULL); }
 };
 
+class CBigNumMont;
+
 /** C++ wrapper for BIGNUM (OpenSSL bignum) */
 class CBigNum
 {
+    friend class CBigNumMont;
     BIGNUM* bn;
 public:
     CBigNum()
@@ -81,6 +98,13 @@ public:
         }
     }
 
+    // The moved-from number is left as a valid zero, only the limbs change hands
+    CBigNum(CBigNum&& b)
+    {
+        bn = BN_new();
+        std::swap(bn, b.bn);
+    }
+
     CBigNum& operator=(const CBigNum& b)
     {
         if (!BN_copy(bn, b.bn))
@@ -88,6 +112,12 @@ public:
         return (*this);
     }
 
+    CBigNum& operator=(CBigNum&& b)
+    {
+        std::swap(bn, b.bn);
+        return (*this);
+    }
+
     ~CBigNum()
     {
         BN_clear_free(bn);
@@ -446,6 +476,19 @@ public:
         return ret;
     }
 
+    /**
+     * modular multiplication in place: this = (this * b) mod m
+     * @param b operand
+     * @param m modulus
+     */
+    CBigNum& mul_mod_inplace(const CBigNum& b, const CBigNum& m) {
+        CAutoBN_CTX pctx;
+        if (!BN_mod_mul(bn, bn, b.bn, m.bn, pctx))
+                throw bignum_error("CBigNum::mul_mod_inplace : BN_mod_mul failed");
+
+        return *this;
+    }
+
     /**
      * modular exponentiation: this^e mod n
      * @param e exponent
@@ -467,6 +510,29 @@ public:
         return ret;
     }
 
+    /**
+     * modular exponentiation into an existing number: ret = this^e mod m
+     * @param ret result, reuses its allocation
+     * @param e exponent
+     * @param m modulus
+     */
+    void pow_mod_into(CBigNum& ret, const CBigNum& e, const CBigNum& m) const {
+        if (&ret == this || BN_is_negative(e.bn)) {
+            ret = pow_mod(e, m);
+            return;
+        }
+        CAutoBN_CTX pctx;
+        if (!BN_mod_exp(ret.bn, bn, e.bn, m.bn, pctx))
+            throw bignum_error("CBigNum::pow_mod_into : BN_mod_exp failed");
+    }
+
+    /**
+     * modular exponentiation with the cached Montgomery context of the modulus
+     * @param e exponent
+     * @param mont Montgomery context of the modulus
+     */
+    CBigNum pow_mod(const CBigNum& e, const CBigNumMont& mont) const;
+
    /**
     * Calculates the inverse of this element mod m.
     * i.e. i such this*i = 1 mod m
@@ -582,7 +648,7 @@ public:
         a <<= shift;
         if (BN_cmp(a.bn, bn) > 0)
         {
-            bn = 0;
+            BN_zero(bn);
             return *this;
         }
 
@@ -614,7 +680,7 @@ public:
         CBigNum r;
         if (!BN_sub(r.bn, bn, BN_value_one()))
             throw bignum_error("CBigNum::operator-- : BN_sub failed");
-        bn = r.bn;
+        std::swap(bn, r.bn);
         return *this;
     }
 
@@ -626,13 +692,13 @@ public:
         return ret;
     }
 
-    friend inline const CBigNum operator+(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator-(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator/(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator%(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator*(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator<<(const CBigNum& a, unsigned int shift);
-    friend inline const CBigNum operator-(const CBigNum& a);
+    friend inline CBigNum operator+(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator-(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator/(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator%(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator*(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator<<(const CBigNum& a, unsigned int shift);
+    friend inline CBigNum operator-(const CBigNum& a);
     friend inline bool operator==(const CBigNum& a, const CBigNum& b);
     friend inline bool operator!=(const CBigNum& a, const CBigNum& b);
     friend inline bool operator<=(const CBigNum& a, const CBigNum& b);
@@ -641,7 +707,7 @@ public:
     friend inline bool operator>(const CBigNum& a, const CBigNum& b);
 };
 
-inline const CBigNum operator+(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator+(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     if (!BN_add(r.bn, a.bn, b.bn))
@@ -649,7 +715,7 @@ inline const CBigNum operator+(const CBigNum& a, const CBigNum& b)
     return r;
 }
 
-inline const CBigNum operator-(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator-(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     if (!BN_sub(r.bn, a.bn, b.bn))
@@ -657,14 +723,14 @@ inline const CBigNum operator-(const CBigNum& a, const CBigNum& b)
     return r;
 }
 
-inline const CBigNum operator-(const CBigNum& a)
+inline CBigNum operator-(const CBigNum& a)
 {
     CBigNum r(a);
     BN_set_negative(r.bn, !BN_is_negative(r.bn));
     return r;
 }
 
-inline const CBigNum operator*(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator*(const CBigNum& a, const CBigNum& b)
 {
     CAutoBN_CTX pctx;
     CBigNum r;
@@ -673,7 +739,7 @@ inline const CBigNum operator*(const CBigNum& a, const CBigNum& b)
     return r;
 }
 
-inline const CBigNum operator/(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator/(const CBigNum& a, const CBigNum& b)
 {
     CAutoBN_CTX pctx;
     CBigNum r;
@@ -682,7 +748,7 @@ inline const CBigNum operator/(const CBigNum& a, const CBigNum& b)
     return r;
 }
 
-inline const CBigNum operator%(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator%(const CBigNum& a, const CBigNum& b)
 {
     CAutoBN_CTX pctx;
     CBigNum r;
@@ -691,7 +757,7 @@ inline const CBigNum operator%(const CBigNum& a, const CBigNum& b)
     return r;
 }
 
-inline const CBigNum operator<<(const CBigNum& a, unsigned int shift)
+inline CBigNum operator<<(const CBigNum& a, unsigned int shift)
 {
     CBigNum r;
     if (!BN_lshift(r.bn, a.bn, shift))
@@ -699,7 +765,7 @@ inline const CBigNum operator<<(const CBigNum& a, unsigned int shift)
     return r;
 }
 
-inline const CBigNum operator>>(const CBigNum& a, unsigned int shift)
+inline CBigNum operator>>(const CBigNum& a, unsigned int shift)
 {
     CBigNum r = a;
     r >>= shift;
@@ -714,8 +780,58 @@ inline bool operator<(const CBigNum& a, const CBigNum& b)  { return (BN_cmp(a.bn
 inline bool operator>(const CBigNum& a, const CBigNum& b)  { return (BN_cmp(a.bn, b.bn) > 0); }
 inline std::ostream& operator<<(std::ostream &strm, const CBigNum &b) { return strm << b.ToString(10); }
 
+/** Montgomery context (BN_MONT_CTX) of an odd modulus, computed once and kept
+ *  next to the modulus so repeated exponentiations do not rebuild it */
+class CBigNumMont
+{
+    BN_MONT_CTX* pmont;
+    CBigNum modulus;
+
+public:
+    explicit CBigNumMont(const CBigNum& m) : modulus(m)
+    {
+        pmont = BN_MONT_CTX_new();
+        if (pmont == NULL)
+            throw bignum_error("CBigNumMont : BN_MONT_CTX_new() returned NULL");
+        CAutoBN_CTX pctx;
+        if (!BN_MONT_CTX_set(pmont, modulus.bn, pctx)) {
+            BN_MONT_CTX_free(pmont);
+            throw bignum_error("CBigNumMont : BN_MONT_CTX_set failed");
+        }
+    }
+
+    ~CBigNumMont()
+    {
+        BN_MONT_CTX_free(pmont);
+    }
+
+    CBigNumMont(const CBigNumMont&) = delete;
+    CBigNumMont& operator=(const CBigNumMont&) = delete;
+
+    const CBigNum& getModulus() const { return modulus; }
+
+    void pow_mod(CBigNum& ret, const CBigNum& base, const CBigNum& e) const
+    {
+        CAutoBN_CTX pctx;
+        if (!BN_mod_exp_mont(ret.bn, base.bn, e.bn, modulus.bn, pctx, pmont))
+            throw bignum_error("CBigNumMont::pow_mod : BN_mod_exp_mont failed");
+    }
+};
+
+inline CBigNum CBigNum::pow_mod(const CBigNum& e, const CBigNumMont& mont) const
+{
+    CBigNum ret;
+    if (BN_is_negative(e.bn))
+        mont.pow_mod(ret, this->inverse(mont.getModulus()), -e);
+    else
+        mont.pow_mod(ret, *this, e);
+    return ret;
+}
+
 #endif
 #if defined(USE_NUM_GMP)
+class CBigNumMont;
+
 /** C++ wrapper for BIGNUM (Gmp bignum) */
 class CBigNum
 {
@@ -732,12 +848,25 @@ public:
         mpz_set(bn, b.bn);
     }
 
+    // The moved-from number is left as a valid zero, only the limbs change hands
+    CBigNum(CBigNum&& b)
+    {
+        mpz_init(bn);
+        mpz_swap(bn, b.bn);
+    }
+
     CBigNum& operator=(const CBigNum& b)
     {
         mpz_set(bn, b.bn);
         return (*this);
     }
 
+    CBigNum& operator=(CBigNum&& b)
+    {
+        mpz_swap(bn, b.bn);
+        return (*this);
+    }
+
     ~CBigNum()
     {
         mpz_clear(bn);
@@ -822,7 +951,7 @@ public:
     int getint() const
     {
         unsigned long n = getulong();
-        if (mpz_cmp(bn, CBigNum(0).bn) >= 0) {
+        if (mpz_sgn(bn) >= 0) {
             return (n > (unsigned long)std::numeric_limits<int>::max() ? std::numeric_limits<int>::max() : n);
         } else {
             return (n > (unsigned long)std::numeric_limits<int>::max() ? std::numeric_limits<int>::min() : -(int)n);
@@ -859,7 +988,7 @@ public:
 
     std::vector<unsigned char> getvch() const
     {
-        if (mpz_cmp(bn, CBigNum(0).bn) == 0) {
+        if (mpz_sgn(bn) == 0) {
             return std::vector<unsigned char>(0);
         }
         size_t size = (mpz_sizeinbase (bn, 2) + CHAR_BIT-1) / CHAR_BIT;
@@ -902,8 +1031,9 @@ public:
 
     std::string ToString(int nBase=10) const
     {
-        char* c_str = mpz_get_str(NULL, nBase, bn);
-        std::string str(c_str);
+        std::string str(mpz_sizeinbase(bn, nBase) + 2, '\0');
+        mpz_get_str(&str[0], nBase, bn);
+        str.resize(strlen(str.c_str()));
         return str;
     }
 
@@ -969,6 +1099,17 @@ public:
         return ret;
     }
 
+    /**
+     * modular multiplication in place: this = (this * b) mod m
+     * @param b operand
+     * @param m modulus
+     */
+    CBigNum& mul_mod_inplace(const CBigNum& b, const CBigNum& m) {
+        mpz_mul (bn, bn, b.bn);
+        mpz_mod (bn, bn, m.bn);
+        return *this;
+    }
+
     /**
      * modular exponentiation: this^e mod n
      * @param e exponent
@@ -976,13 +1117,30 @@ public:
      */
     CBigNum pow_mod(const CBigNum& e, const CBigNum& m) const {
         CBigNum ret;
-        if (e > CBigNum(0) && mpz_odd_p(m.bn))
+        pow_mod_into(ret, e, m);
+        return ret;
+    }
+
+    /**
+     * modular exponentiation into an existing number: ret = this^e mod m
+     * @param ret result, reuses its allocation
+     * @param e exponent
+     * @param m modulus
+     */
+    void pow_mod_into(CBigNum& ret, const CBigNum& e, const CBigNum& m) const {
+        if (mpz_sgn(e.bn) > 0 && mpz_odd_p(m.bn))
             mpz_powm_sec (ret.bn, bn, e.bn, m.bn);
         else
             mpz_powm (ret.bn, bn, e.bn, m.bn);
-        return ret;
     }
 
+    /**
+     * modular exponentiation with the cached Montgomery context of the modulus
+     * @param e exponent
+     * @param mont Montgomery context of the modulus
+     */
+    CBigNum pow_mod(const CBigNum& e, const CBigNumMont& mont) const;
+
    /**
     * Calculates the inverse of this element mod m.
     * i.e. i such this*i = 1 mod m
@@ -1032,12 +1190,12 @@ public:
 
     bool isOne() const
     {
-        return mpz_cmp(bn, CBigNum(1).bn) == 0;
+        return mpz_cmp_ui(bn, 1) == 0;
     }
 
     bool operator!() const
     {
-        return mpz_cmp(bn, CBigNum(0).bn) == 0;
+        return mpz_sgn(bn) == 0;
     }
 
     CBigNum& operator+=(const CBigNum& b)
@@ -1086,7 +1244,7 @@ public:
     CBigNum& operator++()
     {
         // prefix operator
-        mpz_add(bn, bn, CBigNum(1).bn);
+        mpz_add_ui(bn, bn, 1);
         return *this;
     }
 
@@ -1101,7 +1259,7 @@ public:
     CBigNum& operator--()
     {
         // prefix operator
-        mpz_sub(bn, bn, CBigNum(1).bn);
+        mpz_sub_ui(bn, bn, 1);
         return *this;
     }
 
@@ -1113,13 +1271,13 @@ public:
         return ret;
     }
 
-    friend inline const CBigNum operator+(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator-(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator/(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator%(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator*(const CBigNum& a, const CBigNum& b);
-    friend inline const CBigNum operator<<(const CBigNum& a, unsigned int shift);
-    friend inline const CBigNum operator-(const CBigNum& a);
+    friend inline CBigNum operator+(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator-(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator/(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator%(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator*(const CBigNum& a, const CBigNum& b);
+    friend inline CBigNum operator<<(const CBigNum& a, unsigned int shift);
+    friend inline CBigNum operator-(const CBigNum& a);
     friend inline bool operator==(const CBigNum& a, const CBigNum& b);
     friend inline bool operator!=(const CBigNum& a, const CBigNum& b);
     friend inline bool operator<=(const CBigNum& a, const CBigNum& b);
@@ -1128,56 +1286,56 @@ public:
     friend inline bool operator>(const CBigNum& a, const CBigNum& b);
 };
 
-inline const CBigNum operator+(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator+(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     mpz_add(r.bn, a.bn, b.bn);
     return r;
 }
 
-inline const CBigNum operator-(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator-(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     mpz_sub(r.bn, a.bn, b.bn);
     return r;
 }
 
-inline const CBigNum operator-(const CBigNum& a)
+inline CBigNum operator-(const CBigNum& a)
 {
     CBigNum r;
     mpz_neg(r.bn, a.bn);
     return r;
 }
 
-inline const CBigNum operator*(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator*(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     mpz_mul(r.bn, a.bn, b.bn);
     return r;
 }
 
-inline const CBigNum operator/(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator/(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     mpz_tdiv_q(r.bn, a.bn, b.bn);
     return r;
 }
 
-inline const CBigNum operator%(const CBigNum& a, const CBigNum& b)
+inline CBigNum operator%(const CBigNum& a, const CBigNum& b)
 {
     CBigNum r;
     mpz_mmod(r.bn, a.bn, b.bn);
     return r;
 }
 
-inline const CBigNum operator<<(const CBigNum& a, unsigned int shift)
+inline CBigNum operator<<(const CBigNum& a, unsigned int shift)
 {
     CBigNum r;
     mpz_mul_2exp(r.bn, a.bn, shift);
     return r;
 }
 
-inline const CBigNum operator>>(const CBigNum& a, unsigned int shift)
+inline CBigNum operator>>(const CBigNum& a, unsigned int shift)
 {
     CBigNum r = a;
     r >>= shift;
@@ -1191,6 +1349,27 @@ inline bool operator>=(const CBigNum& a, const CBigNum& b) { return (mpz_cmp(a.b
 inline bool operator<(const CBigNum& a, const CBigNum& b)  { return (mpz_cmp(a.bn, b.bn) < 0); }
 inline bool operator>(const CBigNum& a, const CBigNum& b)  { return (mpz_cmp(a.bn, b.bn) > 0); }
 inline std::ostream& operator<<(std::ostream &strm, const CBigNum &b) { return strm << b.ToString(10); }
+
+/** Modulus for repeated exponentiations. GMP sets up its Montgomery (REDC) form
+ *  inside mpz_powm on every call, so this only keeps the modulus to give both
+ *  backends the same interface */
+class CBigNumMont
+{
+    CBigNum modulus;
+
+public:
+    explicit CBigNumMont(const CBigNum& m) : modulus(m) {}
+
+    CBigNumMont(const CBigNumMont&) = delete;
+    CBigNumMont& operator=(const CBigNumMont&) = delete;
+
+    const CBigNum& getModulus() const { return modulus; }
+};
+
+inline CBigNum CBigNum::pow_mod(const CBigNum& e, const CBigNumMont& mont) const
+{
+    return pow_mod(e, mont.getModulus());
+}
 #endif
 
 typedef CBigNum Bignum;
@@ -12,6 +12,7 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -35,6 +36,7 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 #include "zbitchain.h"
+#include "zbitspendcache.h"
 
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
@@ -77,7 +79,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -177,6 +179,21 @@ map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/**
+ * Blocks downloaded before their parent, by the hash of the parent. The proof of stake of a block
+ * can only be checked once its parent is connected, so they are processed when the parent is.
+ * Protected by cs_main.
+ */
+struct PendingBlock {
+    boost::shared_ptr<CBlock> pblock;
+    NodeId nodeid; //! The peer that sent the block.
+    size_t nSize;  //! Serialized size of the block.
+};
+multimap<uint256, PendingBlock> mapBlocksPendingParent;
+/** The hashes of the blocks in mapBlocksPendingParent, and their total size. */
+set<uint256> setBlocksPendingParent;
+size_t nBlocksPendingParentSize = 0;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -233,6 +250,10 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The compact block from this peer whose missing transactions we asked for.
+    boost::shared_ptr<CPartialBlock> partialBlock;
+    //! The last header accepted from this peer before header sync waited for block validation.
+    CBlockIndex* pindexHeadersPaused;
 
     CNodeState()
     {
@@ -246,12 +267,17 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        pindexHeadersPaused = NULL;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+// Misbehavior reported by the message workers while cs_main is taken, applied by SendMessages
+CCriticalSection cs_mapPendingMisbehavior;
+map<NodeId, int> mapPendingMisbehavior;
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -309,6 +335,9 @@ void FinalizeNode(NodeId nodeid)
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
+
+    LOCK(cs_mapPendingMisbehavior);
+    mapPendingMisbehavior.erase(nodeid);
 }
 
 // Requires cs_main.
@@ -458,8 +487,14 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (setBlocksPendingParent.count(pindex->GetBlockHash())) {
+                // Downloaded, waiting for its parent.
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
+                if (nBlocksPendingParentSize >= MAX_BLOCKS_PENDING_PARENT_SIZE / 2 && !(pindex->pprev->nStatus & BLOCK_HAVE_DATA)) {
+                    // Blocks ahead of their parent take too much memory already, wait for the gap to fill.
+                    continue;
+                }
                 if (pindex->nHeight > nWindowEnd) {
                     // We reached the end of the window.
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
@@ -929,8 +964,14 @@ bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend
     return true;
 }
 
-bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state)
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, CZerocoinSpendBatch* pZerocoinBatch)
 {
+    // Without a caller supplied batch the proofs of this transaction are verified together before returning
+    CZerocoinSpendBatch batchLocal;
+    bool fVerifyLocal = (pZerocoinBatch == NULL);
+    if (fVerifyLocal)
+        pZerocoinBatch = &batchLocal;
+
     //max needed non-mint outputs should be 2 - one for redemption address and a possible 2nd for change
     if (tx.vout.size() > 2) {
         int outs = 0;
@@ -977,19 +1018,11 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
 
         // Skip signature verification during initial block download
         if (fVerifySignature) {
-            //see if we have record of the accumulator used in the spend tx
-            CBigNum bnAccumulatorValue = 0;
-            if (!zerocoinDB->ReadAccumulatorValue(newSpend.getAccumulatorChecksum(), bnAccumulatorValue)) {
+            //queue the proof, checking that we have record of the accumulator used in the spend tx
+            if (!pZerocoinBatch->Add(newSpend)) {
                 uint32_t nChecksum = newSpend.getAccumulatorChecksum();
                 return state.DoS(100, error("%s: Zerocoinspend could not find accumulator associated with checksum %s", __func__, HexStr(BEGIN(nChecksum), END(nChecksum))));
             }
-
-            Accumulator accumulator(Params().Zerocoin_Params(chainActive.Height() < Params().Zerocoin_Block_V2_Start()),
-                                    newSpend.getDenomination(), bnAccumulatorValue);
-
-            //Check that the coin has been accumulated
-            if(!newSpend.Verify(accumulator))
-                    return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
         }
 
         if (serials.count(newSpend.getCoinSerialNumber()))
@@ -1006,10 +1039,14 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
         return state.DoS(100, error("Transaction spend more than was redeemed in zerocoins"));
     }
 
+    //Check that the coins have been accumulated
+    if (fVerifyLocal && !batchLocal.Verify())
+        return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
+
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, CZerocoinSpendBatch* pZerocoinBatch)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1065,7 +1102,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 
             // Do not require signature verification if this is initial sync and a block over 24 hours old
             bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
-            if (!CheckZerocoinSpend(tx, fVerifySignature, state))
+            if (!CheckZerocoinSpend(tx, fVerifySignature, state, pZerocoinBatch))
                 return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
     }
@@ -1158,8 +1195,25 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+
+    //Stop tracking zerocoinspends that expired from the pool
+    for (auto it = mapZerocoinspends.begin(); it != mapZerocoinspends.end();) {
+        if (pool.exists(it->first))
+            ++it;
+        else
+            mapZerocoinspends.erase(it++);
+    }
+}
+
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1322,7 +1376,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = 0;
         if (!tx.IsZerocoinSpend())
-            view.GetPriority(tx, chainActive.Height());
+            dPriority = view.GetPriority(tx, chainActive.Height());
 
         CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
@@ -1338,6 +1392,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // After the mempool filled up, the fee rate of what was evicted is needed to get back in
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees < mempoolRejectFee && !tx.IsZerocoinSpend())
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (tx.IsZerocoinMint()) {
                 if(nFees < Params().Zerocoin_MintFee() * tx.GetZerocoinMintCount())
@@ -1403,8 +1464,29 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        LOCK(pool.cs);
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool : too many unconfirmed ancestors [%s]", errString),
+                REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString()),
+                    REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -2345,12 +2427,8 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
-void Misbehaving(NodeId pnode, int howmuch)
+void static ApplyMisbehaving(NodeId pnode, int howmuch)
 {
-    if (howmuch == 0)
-        return;
-
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -2364,6 +2442,36 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
 }
 
+// Takes cs_main if it is free, or leaves the score to the next SendMessages for the node.
+void Misbehaving(NodeId pnode, int howmuch)
+{
+    if (howmuch == 0)
+        return;
+
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) {
+        LOCK(cs_mapPendingMisbehavior);
+        mapPendingMisbehavior[pnode] += howmuch;
+        return;
+    }
+    ApplyMisbehaving(pnode, howmuch);
+}
+
+// Requires cs_main.
+void static ApplyPendingMisbehaving(NodeId pnode)
+{
+    int howmuch = 0;
+    {
+        LOCK(cs_mapPendingMisbehavior);
+        map<NodeId, int>::iterator it = mapPendingMisbehavior.find(pnode);
+        if (it == mapPendingMisbehavior.end())
+            return;
+        howmuch = it->second;
+        mapPendingMisbehavior.erase(it);
+    }
+    ApplyMisbehaving(pnode, howmuch);
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (!pindexBestInvalid || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
@@ -2727,6 +2835,10 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             if(!EraseAccumulatorValues(nCheckpoint, pindex->pprev->nAccumulatorCheckpoint))
                 return error("DisconnectBlock(): failed to erase checkpoint");
         }
+
+        //remove the pubcoin index entry of this block
+        if (pindex->nHeight >= Params().Zerocoin_StartHeight() && !zerocoinDB->EraseBlockPubcoins(pindex->GetBlockHash()))
+            return error("DisconnectBlock(): failed to erase block pubcoins");
     }
 
     if (pfClean) {
@@ -2770,6 +2882,73 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+// Each proof takes many modexps, so workers take them one at a time
+static CCheckQueue<CZerocoinSpendCheck> zerocoinspendcheckqueue(1);
+// CheckBlock and AcceptToMemoryPool can run on different threads; only one may drive the queue
+static boost::mutex cs_zerocoinspendcheckqueue;
+
+void ThreadZerocoinSpendCheck()
+{
+    RenameThread("BitMoney-zcspendch");
+    zerocoinspendcheckqueue.Thread();
+}
+
+bool CZerocoinSpendCheck::operator()()
+{
+    try {
+        if (!spend->Verify(*accumulator))
+            return false;
+        if (hashCacheKey != 0)
+            AddZerocoinSpendToCache(hashCacheKey);
+        return true;
+    } catch (std::exception& e) {
+        return error("CZerocoinSpendCheck() : %s", e.what());
+    }
+}
+
+bool CZerocoinSpendBatch::Add(const CoinSpend& spend)
+{
+    bool fV1Params = chainActive.Height() < Params().Zerocoin_Block_V2_Start();
+    std::pair<uint32_t, CoinDenomination> key = std::make_pair(spend.getAccumulatorChecksum(), spend.getDenomination());
+    std::shared_ptr<const Accumulator>& accumulator = mapAccumulators[key];
+    if (!accumulator) {
+        CBigNum bnAccumulatorValue = 0;
+        if (!zerocoinDB->ReadAccumulatorValue(key.first, bnAccumulatorValue)) {
+            mapAccumulators.erase(key);
+            return false;
+        }
+        accumulator = std::make_shared<const Accumulator>(Params().Zerocoin_Params(fV1Params), key.second, bnAccumulatorValue);
+    }
+
+    // A spend already verified against this accumulator (usually when it entered the mempool) is not checked again
+    uint256 hashCacheKey = GetZerocoinSpendCacheKey(spend, accumulator->getValue(), fV1Params);
+    if (IsZerocoinSpendCached(hashCacheKey))
+        return true;
+
+    vChecks.push_back(CZerocoinSpendCheck(std::make_shared<const CoinSpend>(spend), accumulator, hashCacheKey));
+    return true;
+}
+
+bool CZerocoinSpendBatch::Verify()
+{
+    bool fOk = true;
+    if (vChecks.size() <= 1 || !nScriptCheckThreads) {
+        for (CZerocoinSpendCheck& check : vChecks) {
+            if (!check()) {
+                fOk = false;
+                break;
+            }
+        }
+    } else {
+        boost::lock_guard<boost::mutex> lock(cs_zerocoinspendcheckqueue);
+        CCheckQueueControl<CZerocoinSpendCheck> control(&zerocoinspendcheckqueue);
+        control.Add(vChecks);
+        fOk = control.Wait();
+    }
+    vChecks.clear();
+    return fOk;
+}
+
 void RecalculatezbitMinted()
 {
     CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
@@ -2779,16 +2958,12 @@ void RecalculatezbitMinted()
             LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
 
         //overwrite possibly wrong vMintsInBlock data
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+        CBlockPubcoins pubcoins;
+        assert(GetBlockPubcoins(pindex, pubcoins));
 
-        std::list<CZerocoinMint> listMints;
-        BlockToZerocoinMintList(block, listMints, true);
-
-        vector<libzerocoin::CoinDenomination> vDenomsBefore = pindex->vMintDenominationsInBlock;
         pindex->vMintDenominationsInBlock.clear();
-        for (auto mint : listMints)
-            pindex->vMintDenominationsInBlock.emplace_back(mint.GetDenomination());
+        for (auto& it : pubcoins.mapValid)
+            pindex->vMintDenominationsInBlock.insert(pindex->vMintDenominationsInBlock.end(), it.second.size(), it.first);
 
         if (pindex->nHeight < nHeightEnd)
             pindex = chainActive.Next(pindex);
@@ -3319,6 +3494,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (!zerocoinDB->WriteCoinSpendBatch(vSpends)) return state.Abort(("Failed to record coin serials to database"));
     if (!zerocoinDB->WriteCoinMintBatch(vMints)) return state.Abort(("Failed to record new mints to database"));
 
+    //Index the mints of this block so that accumulator calculations don't have to read it from disk again
+    if (pindex->nHeight >= Params().Zerocoin_StartHeight()) {
+        CBlockPubcoins pubcoins;
+        if (!BlockToPubcoins(block, pubcoins) || !zerocoinDB->WriteBlockPubcoins(pindex->GetBlockHash(), pubcoins))
+            return state.Abort(("Failed to record block pubcoins to database"));
+    }
+
     //Record accumulator checksums
     DatabaseChecksums(mapAccumulators);
 
@@ -3364,17 +3546,26 @@ enum FlushStateMode {
 
 /**
  * Update the on-disk chain state.
- * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
+ * The caches and indexes are written if either they're too large, forceWrite is set, or
+ * fast is not set and it's been a while since the last write. Only the modified coins are
+ * written, and the coins cache is trimmed rather than emptied, so block processing
+ * continues with a warm cache afterwards.
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // The cache is close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > nCoinCacheUsage / 10 * 9;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        // Enough coins changed to be worth writing; doing it often keeps each write short.
+        bool fDirtyLarge = mode == FLUSH_STATE_PERIODIC && pcoinsTip->DirtyMemoryUsage() > nCoinCacheUsage / 4;
+        // It's been a while since we wrote the block index and chain state to disk.
+        bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000;
+        if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fCacheCritical || fDirtyLarge || fPeriodicWrite) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
@@ -3404,9 +3595,14 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
 
             pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Finally write the chainstate (which may refer to block index entries).
+            if (!pcoinsTip->Sync())
                 return state.Abort("Failed to write to coin database");
+            // Everything cached is unmodified now, make room for the next blocks.
+            if (fCacheLarge || fCacheCritical)
+                pcoinsTip->Trim(nCoinCacheUsage / 2);
+            LogPrint("coindb", "%s: coins cache %.1fMiB -> %.1fMiB (pool %.1fMiB)\n", __func__,
+                cacheSize * (1.0 / (1 << 20)), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), pcoinsTip->PoolMemoryUsage() * (1.0 / (1 << 20)));
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -3429,6 +3625,7 @@ void FlushStateToDisk()
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    accumulatorChecksumIndex.SetTip(pindexNew);
 
     // If turned on AutoZeromint will automatically convert BIT to zBIT
     if (pwalletMain->isZeromintEnabled ())
@@ -3438,10 +3635,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3489,13 +3686,25 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true)) {
             mempool.remove(tx, removed, true);
-    }
+        } else if (mempool.exists(tx.GetHash())) {
+            vHashUpdate.push_back(tx.GetHash());
+        }
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    // We should always be able to trim now that the mempool links are consistent again
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -3959,6 +4168,51 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/**
+ * Compute the proof-of-stake data of a block index from its parent's. An index added from a header
+ * does not know yet whether its block is proof of stake, its data is computed again once the block
+ * is received, by then its parent's is final.
+ */
+void static SetStakeIndexData(CBlockIndex* pindexNew)
+{
+    uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute chain trust score
+    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: record proof-of-stake hash value
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
+        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+}
+
+/**
+ * Proof of stake headers cost nothing to make, so only headers whose work was checked move
+ * pindexBestHeader: proof of work headers and blocks whose proof of stake was checked. Otherwise
+ * made up headers could keep IsInitialBlockDownload true forever.
+ */
+void static UpdateBestHeader(CBlockIndex* pindex)
+{
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindex->nChainWork)
+        pindexBestHeader = pindex;
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -3990,34 +4244,13 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+        SetStakeIndexData(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
-        pindexBestHeader = pindexNew;
+    // A proof of stake header only counts once AcceptBlock checked the stake of its block
+    if (pindexNew->nHeight <= Params().LAST_POW_BLOCK())
+        UpdateBestHeader(pindexNew);
 
     //update previous block pointer
     if (pindexNew->nHeight)
@@ -4292,8 +4525,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Check transactions
     bool fZerocoinActive = block.GetBlockTime() > Params().Zerocoin_StartTime();
     vector<CBigNum> vBlockSerials;
+    CZerocoinSpendBatch zerocoinBatch;
     for (const CTransaction& tx : block.vtx) {
-        if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_Block_EnforceSerialRange(), state))
+        if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_Block_EnforceSerialRange(), state, &zerocoinBatch))
             return error("CheckBlock() : CheckTransaction failed");
 
         // double check that there are no double spent zBIT spends in this block
@@ -4320,6 +4554,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
             REJECT_INVALID, "bad-blk-sigops", true);
 
+    // Verify the zerocoin spend proofs of all transactions at once, after the cheap checks passed
+    if (!zerocoinBatch.Verify())
+        return state.DoS(100, error("CheckBlock() : zerocoin spend did not verify"),
+            REJECT_INVALID, "bad-zerocoinspend");
+
     return true;
 }
 
@@ -4513,6 +4752,35 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+/**
+ * The checks of a header that do not need its block's transactions: the difficulty, the time, and
+ * the proof of work of the blocks before proof of stake.
+ */
+bool static CheckHeaderWork(const CBlockHeader& header, CValidationState& state, CBlockIndex* const pindexPrev)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    if (nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(header.GetHash(), header.nBits))
+        return state.DoS(50, error("%s : proof of work failed at %d", __func__, nHeight),
+            REJECT_INVALID, "high-hash");
+
+    if (!CheckWork(CBlock(header), pindexPrev))
+        return state.DoS(50, error("%s : incorrect difficulty at %d", __func__, nHeight),
+            REJECT_INVALID, "bad-diffbits");
+
+    if (header.GetBlockTime() > GetAdjustedTime() + 7200)
+        return state.Invalid(error("%s : header timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
+
+    return true;
+}
+
+//! Whether a header on top of pindexPrev is a proof of stake header too far ahead of the best validated header
+bool static IsHeaderTooFarAhead(const CBlockIndex* pindexPrev)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    return nHeight > Params().LAST_POW_BLOCK() && pindexBestHeader && nHeight > pindexBestHeader->nHeight + MAX_UNVALIDATED_HEADERS;
+}
+
 bool ContextualCheckZerocoinStake(int nHeight, CStakeInput* stake)
 {
     if (nHeight < Params().Zerocoin_Block_V2_Start())
@@ -4588,6 +4856,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
 
+    bool fHeaderKnown = mapBlockIndex.count(block.GetHash());
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
@@ -4597,6 +4866,19 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // The index of a block first received as a header lacks what only its transactions tell
+    if (fHeaderKnown && pindex->pprev) {
+        if (block.IsProofOfStake()) {
+            pindex->SetProofOfStake();
+            pindex->prevoutStake = block.vtx[1].vin[0].prevout;
+            pindex->nStakeTime = block.nTime;
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        }
+        pindex->nFlags &= ~CBlockIndex::BLOCK_STAKE_MODIFIER;
+        SetStakeIndexData(pindex);
+        setDirtyBlockIndex.insert(pindex);
+    }
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -4606,6 +4888,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
     }
 
     int nHeight = pindex->nHeight;
+    UpdateBestHeader(pindex);
 
     // Write block to history file
     try {
@@ -4748,6 +5031,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!fLiteMode) {
         if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
             obfuScationPool.NewBlock();
+            mnodeman.UpdateScores(GetHeight());
             masternodePayments.ProcessBlock(GetHeight() + 10);
             budget.NewBlock();
         }
@@ -4915,7 +5199,8 @@ bool static LoadBlockIndexDB(string& strError)
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindex->nHeight <= Params().LAST_POW_BLOCK() || (pindex->nStatus & BLOCK_HAVE_DATA)) &&
+            (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
 
@@ -4974,6 +5259,7 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    accumulatorChecksumIndex.SetTip(it->second);
 
     PruneBlockIndexCandidates();
 
@@ -5035,7 +5321,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -5077,6 +5363,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    accumulatorChecksumIndex.SetTip(NULL);
     pindexBestInvalid = NULL;
 }
 
@@ -5430,7 +5717,116 @@ string GetWarnings(string strFor)
 //
 
 
-bool static AlreadyHave(const CInv& inv)
+/**
+ * Masternode, budget, spork, SwiftTX and obfuscation messages are processed on the message
+ * workers (see QueueNodeMessage), without cs_main, in one lane per module. A worker holds the lane
+ * lock while it processes a message, the message handler thread only reads the module's items when
+ * it can take the lock. The SwiftTX lane is the exception: mempool and block validation read its
+ * lock maps under cs_main, so its worker takes cs_main first.
+ */
+enum MessageLane {
+    MESSAGE_LANE_NONE = -1, //!< processed by the message handler thread
+    MESSAGE_LANE_MASTERNODE,
+    MESSAGE_LANE_PAYMENTS,
+    MESSAGE_LANE_BUDGET,
+    MESSAGE_LANE_SWIFTTX,
+    MESSAGE_LANE_SPORK,
+    MESSAGE_LANE_OBFUSCATION,
+    MESSAGE_LANE_COUNT
+};
+
+CCriticalSection cs_messageLane[MESSAGE_LANE_COUNT];
+
+int static GetMessageLane(const string& strCommand)
+{
+    if (strCommand == "mnb" || strCommand == "mnp" || strCommand == "dsee" || strCommand == "dseep" ||
+        strCommand == "dseg" || strCommand == "ssc")
+        return MESSAGE_LANE_MASTERNODE;
+    if (strCommand == "mnw" || strCommand == "mnget")
+        return MESSAGE_LANE_PAYMENTS;
+    if (strCommand == "mprop" || strCommand == "mvote" || strCommand == "fbs" || strCommand == "fbvote" ||
+        strCommand == "mnvs")
+        return MESSAGE_LANE_BUDGET;
+    if (strCommand == "ix" || strCommand == "txlvote")
+        return MESSAGE_LANE_SWIFTTX;
+    if (strCommand == "spork" || strCommand == "getsporks")
+        return MESSAGE_LANE_SPORK;
+    if (strCommand == "dsa" || strCommand == "dsc" || strCommand == "dsf" || strCommand == "dsi" ||
+        strCommand == "dsq" || strCommand == "dss" || strCommand == "dssu")
+        return MESSAGE_LANE_OBFUSCATION;
+    return MESSAGE_LANE_NONE;
+}
+
+//! The lock of the lane whose module keeps the inventory items of this type, NULL for core items
+CCriticalSection static* GetInventoryLaneLock(int nType)
+{
+    switch (nType) {
+    case MSG_MASTERNODE_ANNOUNCE:
+    case MSG_MASTERNODE_PING:
+        return &cs_messageLane[MESSAGE_LANE_MASTERNODE];
+    case MSG_MASTERNODE_WINNER:
+        return &cs_messageLane[MESSAGE_LANE_PAYMENTS];
+    case MSG_BUDGET_VOTE:
+    case MSG_BUDGET_PROPOSAL:
+    case MSG_BUDGET_FINALIZED_VOTE:
+    case MSG_BUDGET_FINALIZED:
+        return &cs_messageLane[MESSAGE_LANE_BUDGET];
+    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_VOTE:
+        return &cs_messageLane[MESSAGE_LANE_SWIFTTX];
+    case MSG_SPORK:
+        return &cs_messageLane[MESSAGE_LANE_SPORK];
+    case MSG_DSTX:
+        return &cs_messageLane[MESSAGE_LANE_OBFUSCATION];
+    }
+    return NULL;
+}
+
+bool static ProcessLaneMessage(CNode* pfrom, string strCommand, boost::shared_ptr<CDataStream> pvRecv, int nLane)
+{
+    CDataStream& vRecv = *pvRecv;
+    try {
+        LOCK(nLane == MESSAGE_LANE_SWIFTTX ? &cs_main : NULL);
+        LOCK(cs_messageLane[nLane]);
+        switch (nLane) {
+        case MESSAGE_LANE_MASTERNODE:
+            mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+            masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+            break;
+        case MESSAGE_LANE_PAYMENTS:
+            masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+            break;
+        case MESSAGE_LANE_BUDGET:
+            budget.ProcessMessage(pfrom, strCommand, vRecv);
+            break;
+        case MESSAGE_LANE_SWIFTTX:
+            ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
+            break;
+        case MESSAGE_LANE_SPORK:
+            ProcessSpork(pfrom, strCommand, vRecv);
+            break;
+        case MESSAGE_LANE_OBFUSCATION:
+            obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+            break;
+        }
+        boost::this_thread::interruption_point();
+    } catch (std::ios_base::failure& e) {
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        LogPrintf("ProcessLaneMessage(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), vRecv.size(), e.what());
+        return false;
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessLaneMessage()");
+        return false;
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessLaneMessage()");
+        return false;
+    }
+    return true;
+}
+
+bool static AlreadyHaveItem(const CInv& inv)
 {
     switch (inv.type) {
     case MSG_TX: {
@@ -5493,6 +5889,41 @@ bool static AlreadyHave(const CInv& inv)
     return true;
 }
 
+//! Whether we have the item. When the worker of its lane is busy we cannot tell yet (fDeferred), the
+//! peers' inventory is not kept waiting for the worker: the item is queued and looked up again later.
+bool static AlreadyHave(const CInv& inv, bool& fDeferred)
+{
+    CCriticalSection* pcsLane = GetInventoryLaneLock(inv.type);
+    TRY_LOCK(pcsLane, lockLane);
+    fDeferred = pcsLane && !lockLane;
+    if (fDeferred)
+        return false;
+    return AlreadyHaveItem(inv);
+}
+
+
+// The "block" messages of the blocks peers asked for last
+CSharedMessageCache blockMessageCache(BLOCK_MESSAGE_CACHE_SIZE);
+// The "cmpctblock" messages of the blocks peers asked for last
+CSharedMessageCache compactBlockMessageCache(COMPACT_BLOCK_MESSAGE_CACHE_SIZE);
+
+// Transactions that did not make it into the mempool, which a compact block may still contain. Requires cs_main.
+std::vector<CTransaction> vExtraTxnForCompact;
+size_t nExtraTxnForCompactPos = 0;
+
+void static AddToCompactExtraTransactions(const CTransaction& tx)
+{
+    size_t nMaxExtraTxn = (size_t)std::max((int64_t)0, GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+    if (nMaxExtraTxn == 0)
+        return;
+    if (vExtraTxnForCompact.size() < nMaxExtraTxn) {
+        vExtraTxnForCompact.push_back(tx);
+        return;
+    }
+    // Full: overwrite the oldest
+    vExtraTxnForCompact[nExtraTxnForCompactPos] = tx;
+    nExtraTxnForCompactPos = (nExtraTxnForCompactPos + 1) % vExtraTxnForCompact.size();
+}
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -5502,17 +5933,26 @@ void static ProcessGetData(CNode* pfrom)
 
     LOCK(cs_main);
 
+    pfrom->fGetDataWaiting = false;
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
         const CInv& inv = *it;
+
+        // Answer in order, the rest waits until the worker processing the item's lane is done
+        CCriticalSection* pcsLane = GetInventoryLaneLock(inv.type);
+        TRY_LOCK(pcsLane, lockLane);
+        if (pcsLane && !lockLane) {
+            pfrom->fGetDataWaiting = true;
+            break;
+        }
         {
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5531,14 +5971,34 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Send block from disk, a new block is read and serialized once for all
+                    // the peers asking for it. Peers asking for an older block as a compact
+                    // block would not have its transactions, they get the full block.
+                    if (inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                        CSerializeDataRef msgCmpctBlock = compactBlockMessageCache.Get(inv.hash);
+                        if (!msgCmpctBlock) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            msgCmpctBlock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            compactBlockMessageCache.Insert(inv.hash, msgCmpctBlock);
+                        }
+                        pfrom->PushSharedMessage(msgCmpctBlock);
+                    } else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
+                        CSerializeDataRef msgBlock = blockMessageCache.Get(inv.hash);
+                        if (!msgBlock) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            msgBlock = MakeSharedMessage("block", block);
+                            blockMessageCache.Insert(inv.hash, msgBlock);
+                        }
+                        pfrom->PushSharedMessage(msgBlock);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5574,9 +6034,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializeDataRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -5707,7 +6167,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5727,6 +6187,138 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+
+// Requires cs_main.
+void static AddBlockPendingParent(const CBlock& block, NodeId nodeid)
+{
+    uint256 hash = block.GetHash();
+    if (setBlocksPendingParent.count(hash))
+        return;
+    PendingBlock pending;
+    pending.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBlocksPendingParentSize + pending.nSize > MAX_BLOCKS_PENDING_PARENT_SIZE) {
+        // It is downloaded again once the blocks before it are in
+        LogPrint("net", "%s : no room for block %s ahead of its parent\n", __func__, hash.ToString());
+        return;
+    }
+    pending.pblock.reset(new CBlock(block));
+    pending.nodeid = nodeid;
+    mapBlocksPendingParent.insert(std::make_pair(block.hashPrevBlock, pending));
+    setBlocksPendingParent.insert(hash);
+    nBlocksPendingParentSize += pending.nSize;
+}
+
+// Take the blocks waiting for hashParent out of mapBlocksPendingParent. Requires cs_main.
+void static TakeBlocksPendingParent(const uint256& hashParent, std::vector<PendingBlock>& vChildren)
+{
+    std::pair<multimap<uint256, PendingBlock>::iterator, multimap<uint256, PendingBlock>::iterator> range = mapBlocksPendingParent.equal_range(hashParent);
+    while (range.first != range.second) {
+        multimap<uint256, PendingBlock>::iterator it = range.first;
+        vChildren.push_back(it->second);
+        setBlocksPendingParent.erase(it->second.pblock->GetHash());
+        nBlocksPendingParentSize -= it->second.nSize;
+        range.first++;
+        mapBlocksPendingParent.erase(it);
+    }
+}
+
+// Process the blocks that were downloaded before hashParent once it is stored, and the ones after those
+void static ProcessBlocksPendingParent(const uint256& hashParent)
+{
+    // The blocks whose children to look at, and whether they are invalid
+    deque<pair<uint256, bool> > queue;
+    queue.push_back(std::make_pair(hashParent, false));
+    while (!queue.empty()) {
+        uint256 head = queue.front().first;
+        bool fInvalid = queue.front().second;
+        queue.pop_front();
+
+        std::vector<PendingBlock> vChildren;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(head);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_FAILED_MASK))
+                fInvalid = true;
+            // Until the parent is stored its children wait, it is downloaded again if it could not be
+            if (!fInvalid && (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)))
+                continue;
+            TakeBlocksPendingParent(head, vChildren);
+        }
+
+        BOOST_FOREACH (const PendingBlock& pending, vChildren) {
+            uint256 hash = pending.pblock->GetHash();
+            if (fInvalid) {
+                // The descendants of an invalid block are dropped with it
+                LogPrint("net", "%s : dropping block %s, its parent %s is invalid\n", __func__, hash.ToString(), head.ToString());
+            } else {
+                LogPrint("net", "%s : processing block %s downloaded ahead of its parent\n", __func__, hash.ToString());
+                {
+                    LOCK(cs_main);
+                    mapBlockSource[hash] = pending.nodeid;
+                }
+                CValidationState state;
+                ProcessNewBlock(state, NULL, pending.pblock.get());
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    LOCK(cs_main);
+                    Misbehaving(pending.nodeid, nDoS);
+                }
+            }
+            queue.push_back(std::make_pair(hash, fInvalid));
+        }
+    }
+}
+
+// Process a block a peer sent in full or as a compact block
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            MarkBlockAsReceived(inv.hash);
+            LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, inv.hash.GetHex());
+            return;
+        }
+
+        // A block downloaded ahead of its parent waits for it, its proof of stake can only be
+        // checked once the parent is connected
+        BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+        if (miPrev != mapBlockIndex.end() && !(miPrev->second->nStatus & BLOCK_HAVE_DATA)) {
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+            if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId())
+                AddBlockPendingParent(block, pfrom->GetId());
+            else
+                LogPrint("net", "%s : ignoring unrequested block %s ahead of its parent peer=%d\n", __func__, inv.hash.ToString(), pfrom->id);
+            MarkBlockAsReceived(inv.hash);
+            return;
+        }
+    }
+
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if(state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if(nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+
+    {
+        LOCK(cs_main);
+        MarkBlockAsReceived(inv.hash);
+    }
+    ProcessBlocksPendingParent(inv.hash);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5957,8 +6549,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             boost::this_thread::interruption_point();
             pfrom->AddInventoryKnown(inv);
 
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+            bool fDeferred;
+            bool fAlreadyHave = AlreadyHave(inv, fDeferred);
+            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : fDeferred ? "deferred" : "new", pfrom->id);
 
             if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
                 pfrom->AskFor(inv);
@@ -5967,9 +6560,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (pfrom->nVersion >= HEADERS_FIRST_VERSION) {
+                        // Ask for the headers leading to the block, during initial download the blocks
+                        // are then fetched from all peers by SendMessages. A new block at the tip is
+                        // fetched right away.
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                        if (!IsInitialBlockDownload()) {
+                            vToFetch.push_back(inv);
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        }
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -5982,6 +6587,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        // A single new block is most likely the peer's new tip, whose transactions we already
+        // have in the mempool: ask for it as a compact block
+        if (vToFetch.size() == 1 && pfrom->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload()) {
+            vToFetch[0].type = MSG_CMPCT_BLOCK;
+            if (!mapBlocksInFlight.count(vToFetch[0].hash))
+                MarkBlockAsInFlight(pfrom->GetId(), vToFetch[0].hash);
+        }
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -6007,7 +6620,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    // Peers before HEADERS_FIRST_VERSION expect block invs in answer to getheaders
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && pfrom->nVersion < HEADERS_FIRST_VERSION)) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6039,7 +6653,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6116,6 +6730,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 ignoreFees = true;
                 pmn->allowFreeTx = false;
 
+                LOCK(cs_messageLane[MESSAGE_LANE_OBFUSCATION]);
                 if (!mapObfuscationBroadcastTxes.count(tx.GetHash())) {
                     CObfuscationBroadcastTx dstx;
                     dstx.tx = tx;
@@ -6187,6 +6802,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // Probably non-standard or insufficient fee/priority
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
                         vEraseQueue.push_back(orphanHash);
+                        if (nDos == 0)
+                            AddToCompactExtraTransactions(orphanTx);
                     }
                     mempool.check(pcoinsTip);
                 }
@@ -6203,6 +6820,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                      mempool.mapTx.size());
         } else if (fMissingInputs) {
             AddOrphanTx(tx, pfrom->GetId());
+            AddToCompactExtraTransactions(tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -6231,11 +6849,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
             if (nDoS > 0)
                 Misbehaving(pfrom->GetId(), nDoS);
+            else
+                AddToCompactExtraTransactions(tx);
         }
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -6252,6 +6872,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the whole message as one batch before taking cs_main
+        std::vector<uint256> vHashes;
+        GetBlockHeaderHashes(headers, vHashes);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -6259,22 +6883,43 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
         CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
+        bool fPaused = false;
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
+            // Already known and valid: nothing for AcceptBlockHeader to do
+            BlockMap::iterator mi = mapBlockIndex.find(vHashes[n]);
+            if (mi != mapBlockIndex.end() && !(mi->second->nStatus & BLOCK_FAILED_MASK)) {
+                pindexLast = mi->second;
+                continue;
+            }
+
+            // The proof of stake of the block is checked once it is downloaded, until then the
+            // peer has to wait with more headers. SendMessages asks for them again.
+            BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
+            if (miPrev != mapBlockIndex.end() && IsHeaderTooFarAhead(miPrev->second)) {
+                State(pfrom->GetId())->pindexHeadersPaused = miPrev->second;
+                fPaused = true;
+                break;
+            }
+            if (miPrev != mapBlockIndex.end() && !CheckHeaderWork(header, state, miPrev->second)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid work in header received %s", vHashes[n].ToString());
+            }
+
             if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
                         Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
+                    std::string strError = "invalid header received " + vHashes[n].ToString();
                     return error(strError.c_str());
                 }
             }
@@ -6283,7 +6928,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast && !fPaused) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -6304,7 +6949,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            LOCK(cs_main);
+            MarkBlockAsReceived(hashBlock);
+            if (pfrom->nVersion >= HEADERS_FIRST_VERSION) {
+                // Get the headers connecting the block, it is then downloaded again in order
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -6314,26 +6964,154 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block);
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received compact block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                MarkBlockAsReceived(hashBlock);
+                return true;
+            }
+
+            // Only blocks we asked this peer for are reconstructed, anything else is just a header
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fRequested = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, hashBlock));
+            BlockMap::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (miPrev == mapBlockIndex.end()) {
+                // The full block is synced towards by the "block" handler
+                if (fRequested)
+                    pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            if (IsHeaderTooFarAhead(miPrev->second))
+                return true;
 
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckHeaderWork(cmpctblock.header, state, miPrev->second) ||
+                !AcceptBlockHeader((CBlock)cmpctblock.header, state)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid compact block header %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            }
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            if (!fRequested) {
+                LogPrint("net", "unrequested compact block %s from peer=%d\n", hashBlock.ToString(), pfrom->id);
+                return true;
+            }
+
+            boost::shared_ptr<CPartialBlock> partialBlock(new CPartialBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxnForCompact);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid compact block %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            CBlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                State(pfrom->GetId())->partialBlock = partialBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            // One of our transactions had the short id of one of the block's
+            if (partialBlock->FillBlock(block, std::vector<CTransaction>()) != READ_STATUS_OK) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
             }
         }
+        ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(mi->second)) {
+                LogPrint("net", "peer=%d asked for transactions of block %s we do not have\n", pfrom->id, req.blockhash.ToString());
+                return true;
+            }
+            if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                // Asking for the transactions of an old block, send the full block instead
+                pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+                ProcessGetData(pfrom);
+                return true;
+            }
+            if (!ReadBlockFromDisk(block, mi->second))
+                assert(!"cannot load block from disk");
+        }
+
+        CBlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn index %u out of range from peer=%d", req.indexes[i], pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        boost::shared_ptr<CPartialBlock> partialBlock;
+        {
+            LOCK(cs_main);
+            CNodeState* state = State(pfrom->GetId());
+            if (!state->partialBlock || state->partialBlock->header.GetHash() != resp.blockhash) {
+                LogPrint("net", "peer=%d sent transactions of block %s we did not ask for\n", pfrom->id, resp.blockhash.ToString());
+                return true;
+            }
+            partialBlock.swap(state->partialBlock);
+        }
+
+        CBlock block;
+        ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid transactions for compact block %s from peer=%d", resp.blockhash.ToString(), pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // One of our transactions had the short id of one of the block's
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+        ProcessBlockFromPeer(pfrom, block);
     }
 
 
@@ -6556,14 +7334,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
     } else {
-        //probably one the extensions
-        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        //probably one the extensions, processed on a message worker if there is one
+        int nLane = GetMessageLane(strCommand);
+        if (nLane != MESSAGE_LANE_NONE) {
+            boost::shared_ptr<CDataStream> pvRecv(new CDataStream(vRecv.begin(), vRecv.end(), vRecv.GetType(), vRecv.GetVersion()));
+            boost::function<void()> task = boost::bind(&ProcessLaneMessage, pfrom, strCommand, pvRecv, nLane);
+            if (!QueueNodeMessage(pfrom, nLane, task))
+                task();
+        }
     }
 
 
@@ -6603,6 +7381,10 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // Our previous message is still being processed by a message worker
+    if (pfrom->fMessageQueued)
+        return fOk;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
@@ -6775,6 +7557,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
 
+        ApplyPendingMisbehaving(pto->GetId());
         CNodeState& state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -6803,13 +7586,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (pto->nVersion >= HEADERS_FIRST_VERSION) {
+                    // Headers first, the blocks are then fetched from all peers in parallel
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Continue the header sync that waited for the blocks before it to be validated
+        if (state.pindexHeadersPaused && state.pindexHeadersPaused->nHeight < pindexBestHeader->nHeight + MAX_UNVALIDATED_HEADERS / 2) {
+            LogPrint("net", "resume getheaders (%d) to peer=%d\n", state.pindexHeadersPaused->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(state.pindexHeadersPaused), uint256(0));
+            state.pindexHeadersPaused = NULL;
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -6904,19 +7698,28 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
+        std::vector<CInv> vDeferred;
         while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(inv)) {
-                if (fDebug)
-                    LogPrint("net", "Requesting %s peer=%d\n", inv.ToString(), pto->id);
-                vGetData.push_back(inv);
-                if (vGetData.size() >= 1000) {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
+            bool fDeferred;
+            if (!AlreadyHave(inv, fDeferred)) {
+                if (fDeferred) {
+                    // Don't ask for an item we may have seen, look again once the lane's worker is done
+                    vDeferred.push_back(inv);
+                } else {
+                    if (fDebug)
+                        LogPrint("net", "Requesting %s peer=%d\n", inv.ToString(), pto->id);
+                    vGetData.push_back(inv);
+                    if (vGetData.size() >= 1000) {
+                        pto->PushMessage("getdata", vGetData);
+                        vGetData.clear();
+                    }
                 }
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        BOOST_FOREACH (const CInv& inv, vDeferred)
+            pto->mapAskFor.insert(std::make_pair(nNow + MESSAGE_LANE_INV_RETRY_DELAY, inv));
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
     }
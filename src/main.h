@@ -33,6 +33,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -116,8 +117,28 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Maximum size of the serialized blocks kept to answer getdata, a new block is asked for by most peers at once */
+static const unsigned int BLOCK_MESSAGE_CACHE_SIZE = 4 * MAX_BLOCK_SIZE_CURRENT;
+/** Maximum size of the serialized compact blocks kept to answer getdata */
+static const unsigned int COMPACT_BLOCK_MESSAGE_CACHE_SIZE = MAX_BLOCK_SIZE_CURRENT / 4;
+/** Delay before an item announced for a busy message lane is looked up again, in microseconds */
+static const int64_t MESSAGE_LANE_INV_RETRY_DELAY = 500000;
+/** Default for -blockreconstructionextratxn, transactions not in the mempool kept to reconstruct compact blocks */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -142,6 +163,11 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum size of the blocks kept in memory because they were downloaded before their parent */
+static const unsigned int MAX_BLOCKS_PENDING_PARENT_SIZE = 32 * MAX_BLOCK_SIZE_CURRENT;
+/** How far proof of stake headers may run ahead of the best validated header before header sync
+ *  with a peer waits for the blocks to catch up. */
+static const int MAX_UNVALIDATED_HEADERS = 2 * MAX_HEADERS_RESULTS;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -181,7 +207,7 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -251,6 +277,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the zerocoin spend proof checking thread */
+void ThreadZerocoinSpendCheck();
 
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
@@ -281,7 +309,10 @@ void FlushStateToDisk();
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false, bool fOverrideMempoolLimit = false);
+
+/** Expire mempool transactions older than age seconds and trim the mempool to limit bytes of memory */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -374,10 +405,14 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state);
+class CZerocoinSpendBatch;
+
+/** Context-independent validity checks.
+ * If pZerocoinBatch is set, zerocoin spend proofs are queued on it instead of being verified inline.
+ */
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, CZerocoinSpendBatch* pZerocoinBatch = NULL);
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
-bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state);
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, CZerocoinSpendBatch* pZerocoinBatch = NULL);
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const libzerocoin::CoinSpend& spend, CBlockIndex* pindex);
 bool IsTransactionInChain(const uint256& txId, int& nHeightTx, CTransaction& tx);
 bool IsTransactionInChain(const uint256& txId, int& nHeightTx);
@@ -458,6 +493,54 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the proof verification of one zerocoin spend.
+ * The accumulator is shared with every other check in the batch that uses
+ * the same checksum and denomination.
+ */
+class CZerocoinSpendCheck
+{
+private:
+    std::shared_ptr<const libzerocoin::CoinSpend> spend;
+    std::shared_ptr<const libzerocoin::Accumulator> accumulator;
+    uint256 hashCacheKey;
+
+public:
+    CZerocoinSpendCheck() {}
+    CZerocoinSpendCheck(const std::shared_ptr<const libzerocoin::CoinSpend>& spendIn, const std::shared_ptr<const libzerocoin::Accumulator>& accumulatorIn,
+                        const uint256& hashCacheKeyIn = uint256()) : spend(spendIn), accumulator(accumulatorIn), hashCacheKey(hashCacheKeyIn) {}
+
+    //! Verify the spend proofs, remembering a success in the spend cache if a cache key was given
+    bool operator()();
+
+    void swap(CZerocoinSpendCheck& check)
+    {
+        spend.swap(check.spend);
+        accumulator.swap(check.accumulator);
+        std::swap(hashCacheKey, check.hashCacheKey);
+    }
+};
+
+/**
+ * Zerocoin spend proofs collected from one or more transactions, verified
+ * together on the zerocoin check queue. Accumulator values are read from
+ * zerocoinDB once per checksum and denomination, and spends found in the
+ * verified spend cache are not queued at all.
+ */
+class CZerocoinSpendBatch
+{
+private:
+    std::vector<CZerocoinSpendCheck> vChecks;
+    std::map<std::pair<uint32_t, libzerocoin::CoinDenomination>, std::shared_ptr<const libzerocoin::Accumulator> > mapAccumulators;
+
+public:
+    //! Queue the proof of spend for verification. Fails if the accumulator it uses is unknown.
+    bool Add(const libzerocoin::CoinSpend& spend);
+    //! Verify every queued proof, in parallel when verification threads are running
+    bool Verify();
+    size_t size() const { return vChecks.size(); }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
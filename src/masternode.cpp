@@ -13,47 +13,28 @@
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
 // cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
+    if (pindexTip->nHeight == 0 || pindexTip->nHeight + 1 < nBlockHeight) return false;
 
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    // the hash for a height is the hash of the block before it (the tip itself for non-positive heights);
+    // genesis is never used
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight <= 0) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+    const CBlockIndex* pindex = chainActive[nHeight];
+    if (pindex == NULL) return false;
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -164,7 +145,6 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     if (chainActive.Tip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
@@ -173,16 +153,20 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
-    uint256 hash2 = ss.GetHash();
+
+    return CalculateScore(vin.prevout, hash, ss.GetHash());
+}
+
+uint256 CMasternode::CalculateScore(const COutPoint& outpoint, const uint256& hashBlock, const uint256& hashBlockHash)
+{
+    uint256 aux = outpoint.hash + outpoint.n;
 
     CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
-    ss2 << hash;
+    ss2 << hashBlock;
     ss2 << aux;
     uint256 hash3 = ss2.GetHash();
 
-    uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
-
-    return r;
+    return (hash3 > hashBlockHash ? hash3 - hashBlockHash : hashBlockHash - hash3);
 }
 
 void CMasternode::Check(bool forceCheck)
@@ -552,7 +536,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     if (pmn->pubKeyCollateralAddress == pubKeyCollateralAddress && !pmn->IsBroadcastedWithin(MASTERNODE_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
-        if (pmn->UpdateFromNewBroadcast((*this))) {
+        if (mnodeman.UpdateFromNewBroadcast(pmn, *this)) {
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
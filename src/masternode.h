@@ -27,7 +27,6 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -192,6 +191,8 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    /// Score of a collateral outpoint against the block hash of a height and its hash (Hash(hashBlock))
+    static uint256 CalculateScore(const COutPoint& outpoint, const uint256& hashBlock, const uint256& hashBlockHash);
 
     ADD_SERIALIZE_METHODS;
 
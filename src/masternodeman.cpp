@@ -11,6 +11,7 @@
 #include "spork.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
 
@@ -25,14 +26,6 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 struct CompareScoreMN {
     bool operator()(const pair<int64_t, CMasternode>& t1,
         const pair<int64_t, CMasternode>& t2) const
@@ -41,6 +34,57 @@ struct CompareScoreMN {
     }
 };
 
+//
+// CMasternodeScores
+//
+
+static void CalculateMasternodeScores(const uint256& hashBlock, const uint256& hashBlockHash, const std::vector<COutPoint>& vOutPoints,
+    std::vector<std::pair<uint256, COutPoint> >& vScores, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        vScores[i] = make_pair(CMasternode::CalculateScore(vOutPoints[i], hashBlock, hashBlockHash), vOutPoints[i]);
+}
+
+void CMasternodeScores::Calculate(const uint256& hashBlockIn, const std::vector<COutPoint>& vOutPoints)
+{
+    hashBlock = hashBlockIn;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    hashBlockHash = ss.GetHash();
+
+    // split large lists over all cores, every score is two independent hashes
+    size_t nSize = vOutPoints.size();
+    vScores.resize(nSize);
+    size_t nThreads = std::min((size_t)std::max(boost::thread::hardware_concurrency(), 1u), nSize / MASTERNODES_SCORE_THREAD_MIN);
+    if (nThreads <= 1) {
+        CalculateMasternodeScores(hashBlock, hashBlockHash, vOutPoints, vScores, 0, nSize);
+    } else {
+        size_t nChunk = (nSize + nThreads - 1) / nThreads;
+        boost::thread_group threads;
+        for (size_t i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CalculateMasternodeScores, boost::cref(hashBlock), boost::cref(hashBlockHash), boost::cref(vOutPoints),
+                boost::ref(vScores), std::min(nSize, i * nChunk), std::min(nSize, (i + 1) * nChunk)));
+        CalculateMasternodeScores(hashBlock, hashBlockHash, vOutPoints, vScores, 0, nChunk);
+        threads.join_all();
+    }
+
+    sort(vScores.begin(), vScores.end(), std::greater<std::pair<uint256, COutPoint> >());
+
+    mapScore.clear();
+    for (size_t i = 0; i < nSize; i++)
+        mapScore[vScores[i].second] = vScores[i].first;
+}
+
+void CMasternodeScores::Insert(const COutPoint& outpoint)
+{
+    if (mapScore.count(outpoint))
+        return;
+
+    std::pair<uint256, COutPoint> score(CMasternode::CalculateScore(outpoint, hashBlock, hashBlockHash), outpoint);
+    vScores.insert(std::lower_bound(vScores.begin(), vScores.end(), score, std::greater<std::pair<uint256, COutPoint> >()), score);
+    mapScore[outpoint] = score.first;
+}
+
 //
 // CMasternodeDB
 //
@@ -197,6 +241,47 @@ CMasternodeMan::CMasternodeMan()
     nDsqCount = 0;
 }
 
+void CMasternodeMan::IndexMasternode(CMasternode* pmn)
+{
+    mapMasternodesByVin[pmn->vin.prevout] = pmn;
+    mapMasternodesByPubKey.insert(make_pair(pmn->pubKeyMasternode.GetID(), pmn));
+    mapMasternodesByPayee.insert(make_pair(pmn->pubKeyCollateralAddress.GetID(), pmn));
+    mapEnabledCount.clear();
+}
+
+void CMasternodeMan::UnindexMasternode(CMasternode* pmn)
+{
+    mapMasternodesByVin.erase(pmn->vin.prevout);
+
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator keyit;
+    std::pair<keyit, keyit> range = mapMasternodesByPubKey.equal_range(pmn->pubKeyMasternode.GetID());
+    for (keyit it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+    range = mapMasternodesByPayee.equal_range(pmn->pubKeyCollateralAddress.GetID());
+    for (keyit it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
+    }
+    mapEnabledCount.clear();
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapMasternodesByVin.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    mapScores.clear();
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        IndexMasternode(&mn);
+    }
+}
+
 bool CMasternodeMan::Add(CMasternode& mn)
 {
     LOCK(cs);
@@ -207,7 +292,10 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        listMasternodes.push_back(mn);
+        IndexMasternode(&listMasternodes.back());
+        for (std::map<int64_t, CMasternodeScores>::iterator it = mapScores.begin(); it != mapScores.end(); ++it)
+            it->second.Insert(mn.vin.prevout);
         return true;
     }
 
@@ -234,7 +322,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -246,8 +334,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -277,7 +365,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            UnindexMasternode(&(*it));
+            it = listMasternodes.erase(it);
         } else {
             ++it;
         }
@@ -338,7 +427,12 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapMasternodesByVin.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    mapEnabledCount.clear();
+    mapScores.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -354,7 +448,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -376,15 +470,24 @@ int CMasternodeMan::stable_size ()
 
 int CMasternodeMan::CountEnabled(int protocolVersion)
 {
-    int i = 0;
+    LOCK(cs);
+
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // entries only change state on list updates or, through Check(), every MASTERNODE_CHECK_SECONDS
+    int64_t nNow = GetTime();
+    std::map<int, std::pair<int, int64_t> >::iterator itCount = mapEnabledCount.find(protocolVersion);
+    if (itCount != mapEnabledCount.end() && nNow - itCount->second.second < MASTERNODE_CHECK_SECONDS)
+        return itCount->second.first;
+
+    int i = 0;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
     }
 
+    mapEnabledCount[protocolVersion] = std::make_pair(i, nNow);
     return i;
 }
 
@@ -392,7 +495,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -437,12 +540,17 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    // masternodes are only ever paid to the P2PKH script of their collateral key
+    CTxDestination dest;
+    if (!ExtractDestination(payee, dest) || boost::get<CKeyID>(&dest) == NULL)
+        return NULL;
+
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator keyit;
+    std::pair<keyit, keyit> range = mapMasternodesByPayee.equal_range(boost::get<CKeyID>(dest));
+    for (keyit it = range.first; it != range.second; ++it) {
+        if (GetScriptForDestination(it->second->pubKeyCollateralAddress.GetID()) == payee)
+            return it->second;
     }
     return NULL;
 }
@@ -451,10 +559,9 @@ CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
+    boost::unordered_map<COutPoint, CMasternode*, MasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(vin.prevout);
+    if (it != mapMasternodesByVin.end())
+        return it->second;
     return NULL;
 }
 
@@ -463,9 +570,11 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator keyit;
+    std::pair<keyit, keyit> range = mapMasternodesByPubKey.equal_range(pubKeyMasternode.GetID());
+    for (keyit it = range.first; it != range.second; ++it) {
+        if (it->second->pubKeyMasternode == pubKeyMasternode)
+            return it->second;
     }
     return NULL;
 }
@@ -485,7 +594,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -519,11 +628,16 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     int nTenthNetwork = CountEnabled() / 10;
     int nCountTenth = 0;
     uint256 nHigh = 0;
+    const CMasternodeScores* pscores = GetScores(nBlockHeight - 100);
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
         CMasternode* pmn = Find(s.second);
         if (!pmn) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
+        uint256 n = 0;
+        if (pscores != NULL) {
+            boost::unordered_map<COutPoint, uint256, MasternodeOutPointHasher>::const_iterator itScore = pscores->mapScore.find(pmn->vin.prevout);
+            n = itScore != pscores->mapScore.end() ? itScore->second : pmn->CalculateScore(1, nBlockHeight - 100);
+        }
         if (n > nHigh) {
             nHigh = n;
             pBestMasternode = pmn;
@@ -548,7 +662,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -568,68 +682,65 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
 
 CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    const CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return NULL;
 
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    // scores are sorted high to low, so the first eligible Masternode is the winner
+    std::vector<std::pair<uint256, COutPoint> >::const_iterator it;
+    for (it = pscores->vScores.begin(); it != pscores->vScores.end(); ++it) {
+        if (it->first.GetCompact(false) == 0) break;
 
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+        CMasternode* pmn = Find(CTxIn(it->second));
+        if (pmn == NULL) continue;
+
+        pmn->Check();
+        if (pmn->protocolVersion < minProtocol || !pmn->IsEnabled()) continue;
+
+        return pmn;
     }
 
-    return winner;
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
+    // scores are sorted high to low, count the eligible Masternodes ahead of vin
+    int rank = 0;
+    std::vector<std::pair<uint256, COutPoint> >::const_iterator it;
+    for (it = pscores->vScores.begin(); it != pscores->vScores.end(); ++it) {
+        CMasternode* pmn = Find(CTxIn(it->second));
+        if (pmn == NULL) continue;
+
+        if (pmn->protocolVersion < minProtocol) {
+            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", pmn->protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
         if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = GetAdjustedTime() - mn.sigTime;
+            nMasternode_Age = GetAdjustedTime() - pmn->sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
                 continue;                                                   // Skip masternodes younger than (default) 1 hour
             }
         }
         if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
+            pmn->Check();
+            if (!pmn->IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (it->second == vin.prevout) {
             return rank;
         }
     }
@@ -642,12 +753,14 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
     std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
+    LOCK(cs);
+
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
@@ -657,8 +770,9 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+        boost::unordered_map<COutPoint, uint256, MasternodeOutPointHasher>::const_iterator itScore = pscores->mapScore.find(mn.vin.prevout);
+        if (itScore == pscores->mapScore.end()) continue;
+        int64_t n2 = itScore->second.GetCompact(false);
 
         vecMasternodeScores.push_back(make_pair(n2, mn));
     }
@@ -676,35 +790,75 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
+    const CMasternodeScores* pscores = GetScores(nBlockHeight);
+    if (pscores == NULL) return NULL;
+
+    int rank = 0;
+    std::vector<std::pair<uint256, COutPoint> >::const_iterator it;
+    for (it = pscores->vScores.begin(); it != pscores->vScores.end(); ++it) {
+        CMasternode* pmn = Find(CTxIn(it->second));
+        if (pmn == NULL || pmn->protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
+            pmn->Check();
+            if (!pmn->IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return pmn;
         }
     }
 
     return NULL;
 }
 
+const CMasternodeScores* CMasternodeMan::GetScores(int64_t nBlockHeight)
+{
+    uint256 hashBlock = 0;
+    if (!GetBlockHash(hashBlock, nBlockHeight)) return NULL;
+
+    // a different block at this height means there was a reorg since the scores were calculated
+    std::map<int64_t, CMasternodeScores>::iterator it = mapScores.find(nBlockHeight);
+    if (it != mapScores.end() && it->second.hashBlock == hashBlock)
+        return &it->second;
+
+    std::vector<COutPoint> vOutPoints;
+    vOutPoints.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        vOutPoints.push_back(mn.vin.prevout);
+    }
+
+    CMasternodeScores& scores = mapScores[nBlockHeight];
+    scores.Calculate(hashBlock, vOutPoints);
+
+    // keep the cache bounded, dropping the lowest other height first
+    if (mapScores.size() > MASTERNODES_SCORE_CACHE_HEIGHTS) {
+        if (mapScores.begin()->first != nBlockHeight)
+            mapScores.erase(mapScores.begin());
+        else
+            mapScores.erase(--mapScores.end());
+    }
+
+    return &scores;
+}
+
+void CMasternodeMan::UpdateScores(int nTipHeight)
+{
+    LOCK(cs);
+
+    std::map<int64_t, CMasternodeScores>::iterator it = mapScores.begin();
+    while (it != mapScores.end() && it->first < nTipHeight - MASTERNODES_SCORE_CACHE_HEIGHTS) {
+        mapScores.erase(it++);
+    }
+
+    // SwiftX locks and obfuscation relays rank against the next block,
+    // payment votes for tip + 10 (see ProcessNewBlock) rank 100 blocks before that
+    GetScores(nTipHeight + 1);
+    GetScores(nTipHeight + 10 - 100);
+}
+
 void CMasternodeMan::ProcessMasternodeConnections()
 {
     //we don't care about this for regtest
@@ -822,7 +976,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -940,6 +1094,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (pmn->nLastDsee < sigTime) { //take the newest entry
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
+                        UnindexMasternode(pmn);
                         pmn->pubKeyMasternode = pubkey2;
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
@@ -947,6 +1102,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->addr = addr;
                         //fake ping
                         pmn->lastPing = CMasternodePing(vin);
+                        IndexMasternode(pmn);
                     }
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
@@ -1134,11 +1290,12 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            UnindexMasternode(&(*it));
+            listMasternodes.erase(it);
             break;
         }
         ++it;
@@ -1158,15 +1315,25 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         CMasternode mn(mnb);
         Add(mn);
     } else {
-    	pmn->UpdateFromNewBroadcast(mnb);
+        UpdateFromNewBroadcast(pmn, mnb);
     }
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    UnindexMasternode(pmn);
+    bool fUpdated = pmn->UpdateFromNewBroadcast(mnb);
+    IndexMasternode(pmn);
+    return fUpdated;
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -14,8 +14,14 @@
 #include "sync.h"
 #include "util.h"
 
+#include <list>
+
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_HEIGHTS 150
+#define MASTERNODES_SCORE_THREAD_MIN 500
 
 using namespace std;
 
@@ -48,6 +54,32 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
+struct MasternodeOutPointHasher {
+    size_t operator()(const COutPoint& out) const { return out.hash.GetLow64() ^ out.n; }
+};
+
+struct MasternodeKeyIDHasher {
+    size_t operator()(const CKeyID& id) const { return id.GetLow64(); }
+};
+
+/** Masternode scores for one block height, shared by all ranking functions
+ */
+class CMasternodeScores
+{
+public:
+    // block hash the scores were calculated from, see GetBlockHash()
+    uint256 hashBlock;
+    // Hash(hashBlock), the same for every masternode
+    uint256 hashBlockHash;
+    // scores sorted high to low
+    std::vector<std::pair<uint256, COutPoint> > vScores;
+    // score of each outpoint in vScores
+    boost::unordered_map<COutPoint, uint256, MasternodeOutPointHasher> mapScore;
+
+    void Calculate(const uint256& hashBlockIn, const std::vector<COutPoint>& vOutPoints);
+    void Insert(const COutPoint& outpoint);
+};
+
 class CMasternodeMan
 {
 private:
@@ -57,8 +89,16 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs; list nodes never move, so the indexes below can hold plain pointers
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes by collateral outpoint, masternode key and collateral (payee) key
+    boost::unordered_map<COutPoint, CMasternode*, MasternodeOutPointHasher> mapMasternodesByVin;
+    boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher> mapMasternodesByPubKey;
+    boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher> mapMasternodesByPayee;
+    // CountEnabled() results per protocol version and the time they were counted
+    std::map<int, std::pair<int, int64_t> > mapEnabledCount;
+    // masternode scores for recently used block heights
+    std::map<int64_t, CMasternodeScores> mapScores;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -66,6 +106,13 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    void IndexMasternode(CMasternode* pmn);
+    void UnindexMasternode(CMasternode* pmn);
+    void RebuildIndexes();
+
+    /// Scores for a block height, calculated on first use and again after a reorg; NULL if the block is unknown
+    const CMasternodeScores* GetScores(int64_t nBlockHeight);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -81,7 +128,15 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // keep the on-disk format of the old vector based list
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -132,7 +187,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -141,10 +197,13 @@ public:
 
     void ProcessMasternodeConnections();
 
+    /// Drop scores outside the window around a new tip and calculate the ones the next block will need
+    void UpdateScores(int nTipHeight);
+
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -157,6 +216,9 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Update an existing entry from a newer broadcast, keeping the indexes in sync
+    bool UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb);
 };
 
 #endif
@@ -19,6 +19,7 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #ifdef ENABLE_WALLET
+#include "staker.h"
 #include "wallet.h"
 #endif
 #include "validationinterface.h"
@@ -30,8 +31,11 @@
 #include "zbitchain.h"
 
 
+#include <limits>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -41,23 +45,110 @@ using namespace std;
 //
 
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Block assembly walks the mempool's ancestor_score index, which keeps every
+// transaction ordered by the fee rate of the transaction together with all of
+// its unconfirmed ancestors (its "package"). Once transactions are in the
+// block, the packages of their descendants shrink; those descendants are
+// tracked in an indexed_modified_transaction_set with the package stats of
+// the ancestors that are not in the block yet, so only transactions related
+// to the block contents are ever revisited.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+/** Comparator for CTxMemPool::txiter objects.
+ *  It simply compares the internal memory address of the CTxMemPoolEntry object
+ *  pointed to. This means it has no meaning, and is only useful for using them
+ *  as key in other indexes.
+ */
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+// This matches the calculation in CompareTxMemPoolEntryByAncestorFee,
+// except operating on CTxMemPoolModifiedEntry.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
     {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
+    }
+};
+
+// A comparator that sorts transactions based on number of ancestors.
+// This is sufficient to sort an ancestor package in an order that is valid
+// to appear in a block.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+// We want to sort transactions by priority for the priority space:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second); // Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
@@ -65,28 +156,441 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/** Number of package failures in a row before giving up on a nearly full block */
+static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+
+/**
+ * Fills a block template with mempool transactions: first the space reserved
+ * for high priority transactions, then the rest of the block by package fee
+ * rate. Only transactions that make it into the block and the packages tried
+ * on the way are looked at, instead of the whole mempool.
+ */
+class CBlockTxSelector
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache view;
+    const int nHeight;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries failedTx;
+    std::vector<CBigNum> vBlockSerials;
+
+    /** Check the transaction against the block limits and the chain, and add it */
+    bool AddTx(CTxMemPool::txiter iter);
+    /** True if the transaction has in-mempool parents that are not in the block yet */
+    bool IsStillDependent(CTxMemPool::txiter iter) const;
+    /** Add descendants of the given transactions to mapModifiedTx with their ancestor
+     *  state updated for the given transactions being in the block */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const;
+    /** Return true if the mapTx entry is in the block, failed, or already represented in mapModifiedTx */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set& mapModifiedTx) const;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockTxSelector(CBlockTemplate* pblocktemplateIn, int nHeightIn);
+
+    /** Add transactions by coin age priority until nBlockPrioritySize is reached */
+    void AddPriorityTxs(unsigned int nBlockPrioritySize);
+    /** Add transactions by ancestor package fee rate */
+    void AddPackageTxs();
+    /** Add the zBIT spends that did not make it in yet, they do not need to pay the relay fee */
+    void AddZerocoinSpends();
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+// zBIT spends have no coin age. Priority = (age^6+100000)*amount gives higher priority
+// to zBITs that have been in the mempool long and to zBITs that are large in value.
+static double GetTxPriority(const CTxMemPoolEntry& entry, int nHeight)
+{
+    const CTransaction& tx = entry.GetTx();
+    if (!tx.IsZerocoinSpend())
+        return entry.GetPriority(nHeight);
+
+    uint256 txid = tx.GetHash();
+    CAmount nTotalIn = tx.GetZerocoinSpent();
+    int64_t nTimeSeen = GetAdjustedTime();
+    double nConfs = 100000;
+
+    auto it = mapZerocoinspends.find(txid);
+    if (it != mapZerocoinspends.end()) {
+        nTimeSeen = it->second;
+    } else {
+        //for some reason not in map, add it
+        mapZerocoinspends[txid] = nTimeSeen;
+    }
+
+    double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
+
+    double dPriority = 0;
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        // zBIT spends can have very large priority, use non-overflowing safe functions
+        dPriority = double_safe_addition(dPriority, (nTimePriority * nConfs));
+        dPriority = double_safe_multiplication(dPriority, nTotalIn);
+    }
+
+    return tx.ComputePriority(dPriority, entry.GetTxSize());
+}
+
+CBlockTxSelector::CBlockTxSelector(CBlockTemplate* pblocktemplateIn, int nHeightIn) : pblocktemplate(pblocktemplateIn),
+                                                                                    view(pcoinsTip),
+                                                                                    nHeight(nHeightIn),
+                                                                                    nBlockSize(1000),
+                                                                                    nBlockTx(0),
+                                                                                    nBlockSigOps(100),
+                                                                                    nFees(0)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    fPrintPriority = GetBoolArg("-printpriority", false);
+}
+
+bool CBlockTxSelector::AddTx(CTxMemPool::txiter iter)
+{
+    const CTransaction& tx = iter->GetTx();
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+        return false;
+    if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
+        return false;
+
+    // Size limits
+    unsigned int nTxSize = iter->GetTxSize();
+    if (nBlockSize + nTxSize >= nBlockMaxSize)
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+        return false;
+
+    //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+    if (!tx.IsZerocoinSpend()) {
+        for (const CTxIn& txin : tx.vin) {
+            if (invalid_out::ContainsOutPoint(txin.prevout)) {
+                LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+                return false;
+            }
+        }
+    }
+
+    if (!view.HaveInputs(tx))
+        return false;
+
+    // double check that there are no double spent zBIT spends in this block or tx
+    vector<CBigNum> vTxSerials;
+    if (tx.IsZerocoinSpend()) {
+        int nHeightTx = 0;
+        if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+            return false;
+
+        for (const CTxIn& txIn : tx.vin) {
+            if (txIn.scriptSig.IsZerocoinSpend()) {
+                libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
+                bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
+                //This zBIT serial has already been included in the block, do not add this tx.
+                if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
+                    return false;
+                if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
+                    return false;
+                if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
+                    return false;
+                vTxSerials.emplace_back(spend.getCoinSerialNumber());
+            }
+        }
+    }
+
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+
+    CValidationState state;
+    if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        return false;
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, nHeight);
+
+    // Added
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    for (const CBigNum& bnSerial : vTxSerials)
+        vBlockSerials.emplace_back(bnSerial);
+
+    return true;
+}
+
+bool CBlockTxSelector::IsStillDependent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+void CBlockTxSelector::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc) || failedTx.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+bool CBlockTxSelector::SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set& mapModifiedTx) const
+{
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void CBlockTxSelector::AddPriorityTxs(unsigned int nBlockPrioritySize)
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = GetTxPriority(*mi, nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        double dPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // Transactions with in-mempool parents wait until the parents are in
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
+
+        if (!AddTx(iter)) {
+            failedTx.insert(iter);
+            continue;
+        }
+
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+        }
+
+        // Once past the priority size or out of high-priority transactions,
+        // the rest of the block is filled by fee rate
+        if (nBlockSize >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            waitPriIter wpiter = waitPriMap.find(child);
+            if (wpiter != waitPriMap.end()) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                waitPriMap.erase(wpiter);
+            }
+        }
+    }
+}
+
+void CBlockTxSelector::AddPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    int64_t nConsecutiveFailed = 0;
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+            SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
         }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+        }
+
+        // Skip free transactions if we're past the minimum block size,
+        // everything else we might consider has a lower fee rate
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            return;
+
+        CTxMemPool::setEntries ancestors;
+        bool fFailed = nBlockSize + packageSize >= nBlockMaxSize;
+        if (!fFailed) {
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            // a package with a transaction that could not go into the block cannot go in either
+            BOOST_FOREACH (CTxMemPool::txiter ancestor, ancestors) {
+                if (failedTx.count(ancestor)) {
+                    fFailed = true;
+                    break;
+                }
+            }
+        }
+
+        if (fFailed) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+            }
+            failedTx.insert(iter);
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        // Package can be added. Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        BOOST_FOREACH (CTxMemPool::txiter ancestor, ancestors) {
+            if (!inBlock.count(ancestor))
+                sortedEntries.push_back(ancestor);
+        }
+        sortedEntries.push_back(iter);
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+
+        CTxMemPool::setEntries added;
+        bool fAllAdded = true;
+        for (size_t i = 0; i < sortedEntries.size(); ++i) {
+            // the entries after a failed one depend on it or are re-tried with their own package
+            if (!fAllAdded || !AddTx(sortedEntries[i])) {
+                if (fAllAdded)
+                    failedTx.insert(sortedEntries[i]);
+                fAllAdded = false;
+                mapModifiedTx.erase(sortedEntries[i]);
+                continue;
+            }
+            added.insert(sortedEntries[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
+
+        if (fAllAdded) {
+            nConsecutiveFailed = 0;
+            if (fPrintPriority) {
+                LogPrintf("package fee %s txid %s\n",
+                    CFeeRate(packageFees, packageSize).ToString(), iter->GetTx().GetHash().ToString());
+            }
+        } else {
+            ++nConsecutiveFailed;
+        }
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(added, mapModifiedTx);
     }
-};
+}
+
+void CBlockTxSelector::AddZerocoinSpends()
+{
+    for (std::map<uint256, int64_t>::const_iterator it = mapZerocoinspends.begin(); it != mapZerocoinspends.end(); ++it) {
+        CTxMemPool::txiter iter = mempool.mapTx.find(it->first);
+        if (iter == mempool.mapTx.end() || inBlock.count(iter) || failedTx.count(iter))
+            continue;
+        if (!AddTx(iter))
+            failedTx.insert(iter);
+    }
+}
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -98,7 +602,7 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 }
 
 std::pair<int, std::pair<uint256, uint256> > pCheckpointCache;
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake, const CStakeHit* pStakeHit)
 {
     CReserveKey reservekey(pwallet);
 
@@ -137,7 +641,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         CMutableTransaction txCoinStake;
         int64_t nSearchTime = pblock->nTime; // search to current time
         bool fStakeFound = false;
-        if (nSearchTime >= nLastCoinStakeSearchTime) {
+        if (pStakeHit != NULL) {
+            // the kernel was found ahead of time, it is only valid on the same tip and difficulty
+            if (pindexPrev->GetBlockHash() != pStakeHit->hashPrevBlock || pblock->nBits != pStakeHit->nBits)
+                return NULL;
+
+            if (pwallet->CreateCoinStake(pStakeHit->input, txCoinStake)) {
+                pblock->nTime = pStakeHit->nTime;
+                pblock->vtx[0].vout[0].SetEmpty();
+                pblock->vtx.push_back(CTransaction(txCoinStake));
+                fStakeFound = true;
+            }
+        } else if (nSearchTime >= nLastCoinStakeSearchTime) {
             unsigned int nTxNewTime = 0;
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
                 pblock->nTime = nTxNewTime;
@@ -153,22 +668,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
@@ -177,247 +676,15 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
-            }
-            if(GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins()){
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
-            for (const CTxIn& txin : tx.vin) {
-                //zerocoinspend has special vin
-                if (tx.IsZerocoinSpend()) {
-                    nTotalIn = tx.GetZerocoinSpent();
-
-                    //Give a high priority to zerocoinspends to get into the next block
-                    //Priority = (age^6+100000)*amount - gives higher priority to zbits that have been in mempool long
-                    //and higher priority to zbits that are large in value
-                    int64_t nTimeSeen = GetAdjustedTime();
-                    double nConfs = 100000;
-
-                    auto it = mapZerocoinspends.find(txid);
-                    if (it != mapZerocoinspends.end()) {
-                        nTimeSeen = it->second;
-                    } else {
-                        //for some reason not in map, add it
-                        mapZerocoinspends[txid] = nTimeSeen;
-                    }
-
-                    double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
-
-                    // zBIT spends can have very large priority, use non-overflowing safe functions
-                    dPriority = double_safe_addition(dPriority, (nTimePriority * nConfs));
-                    dPriority = double_safe_multiplication(dPriority, nTotalIn);
-
-                    continue;
-                }
-
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-                    fMissingInputs = true;
-                    break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                // zBIT spends can have very large priority, use non-overflowing safe functions
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
+        CBlockTxSelector selector(pblocktemplate.get(), nHeight);
+        selector.AddPriorityTxs(GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE));
+        selector.AddPackageTxs();
+        selector.AddZerocoinSpends();
 
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (!tx.IsZerocoinSpend() && fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            // double check that there are no double spent zBIT spends in this block or tx
-            if (tx.IsZerocoinSpend()) {
-                int nHeightTx = 0;
-                if (IsTransactionInChain(tx.GetHash(), nHeightTx))
-                    continue;
-
-                bool fDoubleSerial = false;
-                for (const CTxIn& txIn : tx.vin) {
-                    if (txIn.scriptSig.IsZerocoinSpend()) {
-                        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
-                        bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
-                        if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
-                            fDoubleSerial = true;
-                        if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (fDoubleSerial)
-                            break;
-                        vTxSerials.emplace_back(spend.getCoinSerialNumber());
-                    }
-                }
-                //This zBIT serial has already been included in the block, do not add this tx.
-                if (fDoubleSerial)
-                    continue;
-            }
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum& bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = selector.nBlockSize;
+        uint64_t nBlockTx = selector.nBlockTx;
+        nFees = selector.nFees;
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -513,14 +780,14 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
-CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfStake)
+CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfStake, const CStakeHit* pStakeHit)
 {
     CPubKey pubkey;
     if (!reservekey.GetReservedKey(pubkey))
         return NULL;
 
     CScript scriptPubKey = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
-    return CreateNewBlock(scriptPubKey, pwallet, fProofOfStake);
+    return CreateNewBlock(scriptPubKey, pwallet, fProofOfStake, pStakeHit);
 }
 
 bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
@@ -578,6 +845,12 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // Kernel search state kept across stake attempts
+    std::unique_ptr<CStaker> pstaker;
+    if (fProofOfStake)
+        pstaker.reset(new CStaker(pwallet));
+    CStakeHit stakeHit;
+
     while (fGenerateBitcoins || fProofOfStake) {
         if (fProofOfStake) {
             //control the amount of times the client will check for mintable coins
@@ -607,13 +880,10 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
                     continue;
             }
 
-            if (mapHashedBlocks.count(chainActive.Tip()->nHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
-            {
-                if (GetTime() - mapHashedBlocks[chainActive.Tip()->nHeight] < max(pwallet->nHashInterval, (unsigned int)1)) // wait half of the nHashDrift with max wait of 3 minutes
-                {
-                    MilliSleep(5000);
-                    continue;
-                }
+            // hash the time slots that opened up since the last attempt, the block is only built on a hit
+            if (!pstaker->FindKernel(stakeHit)) {
+                pstaker->WaitForNextSlot();
+                continue;
             }
         }
 
@@ -625,7 +895,7 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
         if (!pindexPrev)
             continue;
 
-        unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
+        unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake, fProofOfStake ? &stakeHit : NULL));
         if (!pblocktemplate.get())
             continue;
 
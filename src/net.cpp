@@ -25,6 +25,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -89,7 +90,7 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializeDataRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -107,7 +108,24 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+// Wakes the message handler thread when a message arrived, fMessageHandlerWake keeps the
+// notification if it arrives while the thread is busy
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static bool fMessageHandlerWake = false;
+
+// Messages queued for the message workers, see QueueNodeMessage
+struct CNodeMessageTask {
+    CNode* pnode;
+    int nLane;
+    boost::function<void()> task;
+};
+static boost::mutex mutexMessageTasks;
+static boost::condition_variable condMessageTasks;
+static std::list<CNodeMessageTask> listMessageTasks;
+static std::set<int> setBusyLanes; // lanes a worker is processing a task of
+static int nMessageThreads = 0;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -706,8 +724,9 @@ void CNode::copyStats(CNodeStats& stats)
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fComplete)
 {
+    fComplete = false;
     while (nBytes > 0) {
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
@@ -736,7 +755,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            fComplete = true;
         }
     }
 
@@ -790,33 +809,63 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
+//! Maximum number of queued messages handed to one sendmsg() call
+static const int MAX_SEND_IOVECS = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializeDataRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+        pnode->readiness.fSend = false;
+#ifdef WIN32
+        const CSerializeData& data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Send the queued messages straight from their buffers, as many as fit in one call
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializeDataRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov) {
+            iov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
+            pnode->readiness.fSend = true;
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
             }
+            // could not send everything: try the rest until the socket would block, the poller
+            // only reports it writable again after that
         } else {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                if (nErr == WSAEINTR) {
+                    pnode->readiness.fSend = true;
+                } else if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS) {
                     LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
                     pnode->CloseSocketDisconnect();
                 }
@@ -835,9 +884,180 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+//! Maximum number of recv() calls for one node per socket thread iteration, before the other nodes get their turn
+static const int MAX_SOCKET_RECV_PER_NODE = 4;
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+/**
+ * Send to and receive from a node whose socket the poller reported ready. Sends until the queue
+ * is empty or the socket buffer is full, reads until the socket runs dry, so that the readiness
+ * flags are only cleared when the socket would block. Returns whether the node has to be looked
+ * at again without waiting for the socket: fMore if there is more to read right away, fRetry if
+ * it is waiting on a lock or for the message handler to make room in the receive buffer.
+ */
+static void ServiceNodeSocket(CNode* pnode, bool& fMore, bool& fRetry, bool& fMessageComplete)
+{
+    fMore = false;
+    fRetry = false;
+
+    //
+    // Send
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    bool fSendPending = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend) {
+            fRetry = pnode->readiness.fSend;
+        } else {
+            if (pnode->readiness.fSend && !pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            fSendPending = !pnode->vSendMsg.empty();
+        }
+    }
+
+    //
+    // Receive
+    //
+    // If there is data to send, drain the write buffer before receiving more, it is only left
+    // when the socket buffer is full. This avoids needlessly queueing received data, if the
+    // remote peer is not themselves receiving data. This means properly utilizing TCP flow
+    // control signalling. The receive resumes when the poller reports the socket writable again.
+    if (pnode->hSocket == INVALID_SOCKET || fSendPending)
+        return;
+    if (pnode->readiness.fRecv) {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        // If there is a complete message in the receive buffer and no space left, leave the rest
+        // in the socket until the message handler catches up.
+        if (!lockRecv || !(pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                             pnode->GetTotalRecvSize() <= ReceiveFloodSize())) {
+            fRetry = true;
+        } else {
+            // typical socket buffer is 8K-64K
+            char pchBuf[0x10000];
+            for (int i = 0; i < MAX_SOCKET_RECV_PER_NODE && pnode->readiness.fRecv; i++) {
+                pnode->readiness.fRecv = false;
+                int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                if (nBytes > 0) {
+                    pnode->readiness.fRecv = true;
+                    bool fComplete = false;
+                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete)) {
+                        pnode->CloseSocketDisconnect();
+                        return;
+                    }
+                    fMessageComplete |= fComplete;
+                    pnode->nLastRecv = GetTime();
+                    pnode->nRecvBytes += nBytes;
+                    pnode->RecordBytesRecv(nBytes);
+                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize())
+                        break;
+                } else if (nBytes == 0) {
+                    // socket closed gracefully
+                    if (!pnode->fDisconnect)
+                        LogPrint("net", "socket closed\n");
+                    pnode->CloseSocketDisconnect();
+                    return;
+                } else {
+                    // error
+                    int nErr = WSAGetLastError();
+                    if (nErr == WSAEINTR) {
+                        pnode->readiness.fRecv = true;
+                    } else if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS) {
+                        if (!pnode->fDisconnect)
+                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                        pnode->CloseSocketDisconnect();
+                        return;
+                    }
+                }
+            }
+            fMore = pnode->readiness.fRecv;
+        }
+    }
+
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+
+    // Sockets are registered with the poller once, which then only reports the ones that became
+    // ready. Nodes that could not be served completely are kept in setRetry.
+    CSocketPoller poller;
+    LogPrintf("%s : using %s\n", __func__, poller.GetName());
+    BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket) {
+        if (hListenSocket.socket != INVALID_SOCKET && !poller.Add(hListenSocket.socket, &hListenSocket))
+            LogPrintf("%s : could not poll listening socket\n", __func__);
+    }
+    set<CNode*> setRetry;
+    bool fMore = false;
+    vector<void*> vReady;
+
     while (true) {
         //
         // Disconnect nodes
@@ -857,6 +1077,8 @@ void ThreadSocketHandler()
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
+                    poller.Remove(pnode);
+                    setRetry.erase(pnode);
 
                     // hold in disconnected pool until all refs are released
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -864,6 +1086,17 @@ void ThreadSocketHandler()
                     vNodesDisconnected.push_back(pnode);
                 }
             }
+
+            // Register new nodes
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->fSocketPolled || pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                pnode->fSocketPolled = true;
+                if (!poller.Add(pnode->hSocket, pnode, &pnode->readiness)) {
+                    LogPrintf("socket poll error, disconnecting peer=%d\n", pnode->id);
+                    pnode->fDisconnect = true;
+                }
+            }
         }
         {
             // Delete disconnected nodes
@@ -901,216 +1134,54 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready. Don't wait at all if a node has more to read, and at
+        // most 50ms otherwise, the frequency to look at new nodes and nodes in setRetry.
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+        if (!poller.Wait(fMore ? 0 : 50, vReady)) {
+            LogPrintf("socket poll error %s\n", NetworkErrorString(WSAGetLastError()));
+            MilliSleep(50);
         }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
-
         //
-        // Accept new connections
+        // Accept new connections and service each ready socket
         //
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
+        set<CNode*> setService;
+        setService.swap(setRetry);
+        BOOST_FOREACH (void* pReady, vReady) {
+            bool fListen = false;
+            BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+                if (pReady == &hListenSocket) {
+                    AcceptConnection(hListenSocket);
+                    fListen = true;
                 }
             }
+            if (!fListen)
+                setService.insert((CNode*)pReady);
         }
 
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        bool fMessageComplete = false;
+        fMore = false;
+        BOOST_FOREACH (CNode* pnode, setService) {
             boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            bool fNodeMore, fNodeRetry;
+            ServiceNodeSocket(pnode, fNodeMore, fNodeRetry, fMessageComplete);
+            if (fNodeMore || fNodeRetry)
+                setRetry.insert(pnode);
+            fMore |= fNodeMore;
         }
-        {
+        if (fMessageComplete)
+            WakeMessageHandler();
+
+        //
+        // Inactivity checking
+        //
+        if (GetTime() != nLastInactivityCheck) {
+            nLastInactivityCheck = GetTime();
             LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH (CNode* pnode, vNodes)
+                InactivityCheck(pnode);
         }
     }
 }
@@ -1492,11 +1563,17 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+void WakeMessageHandler()
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_one();
+}
 
+void ThreadMessageHandler()
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
         vector<CNode*> vNodesCopy;
@@ -1526,7 +1603,8 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
+                    // Nodes waiting for a message worker are looked at again when it is done
+                    if (pnode->nSendSize < SendBufferSize() && !pnode->fMessageQueued && !pnode->fGetDataWaiting) {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
@@ -1551,8 +1629,79 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        // Wait for the socket thread to receive a message, or 100ms for SendMessages to run again
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        if (fSleep) {
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(100);
+            while (!fMessageHandlerWake) {
+                if (!condMessageHandler.timed_wait(lock, deadline))
+                    break;
+            }
+        }
+        fMessageHandlerWake = false;
+    }
+}
+
+bool QueueNodeMessage(CNode* pnode, int nLane, const boost::function<void()>& task)
+{
+    if (nMessageThreads == 0)
+        return false;
+
+    {
+        LOCK(cs_vNodes);
+        pnode->AddRef();
+    }
+    pnode->fMessageQueued = true;
+
+    CNodeMessageTask item;
+    item.pnode = pnode;
+    item.nLane = nLane;
+    item.task = task;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageTasks);
+        listMessageTasks.push_back(item);
+    }
+    condMessageTasks.notify_one();
+    return true;
+}
+
+void ThreadMessageWorker()
+{
+    while (true) {
+        // Take the first task whose lane no other worker is processing
+        CNodeMessageTask item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageTasks);
+            std::list<CNodeMessageTask>::iterator it;
+            while (true) {
+                for (it = listMessageTasks.begin(); it != listMessageTasks.end(); ++it) {
+                    if (!setBusyLanes.count(it->nLane))
+                        break;
+                }
+                if (it != listMessageTasks.end())
+                    break;
+                condMessageTasks.wait(lock);
+            }
+            item = *it;
+            listMessageTasks.erase(it);
+            setBusyLanes.insert(item.nLane);
+        }
+
+        item.task();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageTasks);
+            setBusyLanes.erase(item.nLane);
+        }
+        // The next task of the lane may be waiting for us
+        condMessageTasks.notify_all();
+
+        item.pnode->fMessageQueued = false;
+        {
+            LOCK(cs_vNodes);
+            item.pnode->Release();
+        }
+        WakeMessageHandler();
     }
 }
 
@@ -1768,6 +1917,11 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
+    // Process masternode, budget, spork, SwiftTX and obfuscation messages next to the message handler
+    nMessageThreads = std::max(0, std::min((int)GetArg("-msgthreads", DEFAULT_MESSAGE_THREADS), MAX_MESSAGE_THREADS));
+    for (int i = 0; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
+
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
 
@@ -1855,8 +2009,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved, it is sent as is to
+        // every peer asking for it
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2073,6 +2228,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketPolled = false;
+    fMessageQueued = false;
+    fGetDataWaiting = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2145,6 +2303,23 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+// Set the size and checksum in the header of a message, returns the payload size
+static unsigned int SetMessageSizeAndChecksum(CDataStream& ssMessage)
+{
+    // Set the size
+    unsigned int nSize = ssMessage.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMessage[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ssMessage.begin() + CMessageHeader::HEADER_SIZE, ssMessage.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ssMessage.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMessage[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    return nSize;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2180,30 +2355,86 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    unsigned int nSize = SetMessageSizeAndChecksum(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    CSerializeData* pdata = new CSerializeData();
+    ssSend.GetAndClear(*pdata);
+    nSendSize += pdata->size();
+    vSendMsg.push_back(CSerializeDataRef(pdata));
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSharedMessage(const CSerializeDataRef& msg)
+{
+    LOCK(cs_vSend);
+    assert(msg->size() >= CMessageHeader::HEADER_SIZE);
+    std::string strCommand(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(strCommand.c_str()), msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+//
+// Shared messages
+//
+
+CSerializeDataRef FinishSharedMessage(CDataStream& ssMessage)
+{
+    SetMessageSizeAndChecksum(ssMessage);
+    CSerializeData* pdata = new CSerializeData();
+    ssMessage.GetAndClear(*pdata);
+    return CSerializeDataRef(pdata);
+}
+
+CSerializeDataRef CSharedMessageCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, list_type::iterator>::iterator it = mapMessages.find(hash);
+    if (it == mapMessages.end())
+        return CSerializeDataRef();
+    listMessages.splice(listMessages.begin(), listMessages, it->second);
+    return it->second->second;
+}
+
+void CSharedMessageCache::Insert(const uint256& hash, const CSerializeDataRef& msg)
+{
+    LOCK(cs);
+    if (mapMessages.count(hash))
+        return;
+    listMessages.push_front(std::make_pair(hash, msg));
+    mapMessages[hash] = listMessages.begin();
+    nSize += msg->size();
+    while (nSize > nMaxSize && !listMessages.empty()) {
+        nSize -= listMessages.back().second->size();
+        mapMessages.erase(listMessages.back().first);
+        listMessages.pop_back();
+    }
+}
+
+size_t CSharedMessageCache::Count()
+{
+    LOCK(cs);
+    return listMessages.size();
+}
+
+size_t CSharedMessageCache::Size()
+{
+    LOCK(cs);
+    return nSize;
+}
+
 //
 // CBanDB
 //
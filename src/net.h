@@ -13,6 +13,7 @@
 #include "limitedmap.h"
 #include "mruset.h"
 #include "netbase.h"
+#include "netpoll.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -20,7 +21,9 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <list>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -29,6 +32,8 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -63,6 +68,10 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -msgthreads default: threads processing masternode, budget, spork, SwiftTX and obfuscation messages (0 = the message handler thread) */
+static const int DEFAULT_MESSAGE_THREADS = 2;
+/** Maximum number of message worker threads */
+static const int MAX_MESSAGE_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -82,9 +91,20 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Have the message handler thread look at the nodes again, without waiting for its timeout */
+void WakeMessageHandler();
+/**
+ * Process a message of pnode on a message worker thread. Tasks of the same lane run one at a time,
+ * in the order they were queued, and pnode's next messages wait until the task is done. Returns
+ * false if there are no message workers, the caller then runs the task itself.
+ */
+bool QueueNodeMessage(CNode* pnode, int nLane, const boost::function<void()>& task);
 
 typedef int NodeId;
 
+/** A complete message, header and payload, that can be queued to any number of nodes without copying it */
+typedef boost::shared_ptr<const CSerializeData> CSerializeDataRef;
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
@@ -133,7 +153,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializeDataRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -219,6 +239,45 @@ public:
 };
 
 
+/** Set the size and checksum in the header of a message serialized after a CMessageHeader, and move it into a shared buffer */
+CSerializeDataRef FinishSharedMessage(CDataStream& ssMessage);
+
+/**
+ * Serialize a message once, to push it to several nodes with CNode::PushSharedMessage. The payload
+ * is serialized with PROTOCOL_VERSION, only use this for payloads that serialize the same way for
+ * every peer version, like blocks and transactions.
+ */
+template <typename T>
+CSerializeDataRef MakeSharedMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << CMessageHeader(pszCommand, 0) << payload;
+    return FinishSharedMessage(ssMessage);
+}
+
+/** The most recently used shared messages, up to a total size, looked up by the hash of what they carry */
+class CSharedMessageCache
+{
+private:
+    typedef std::list<std::pair<uint256, CSerializeDataRef> > list_type;
+    list_type listMessages; //!< most recently used first
+    std::map<uint256, list_type::iterator> mapMessages;
+    size_t nSize;
+    size_t nMaxSize;
+    CCriticalSection cs;
+
+public:
+    CSharedMessageCache(size_t nMaxSizeIn) : nSize(0), nMaxSize(nMaxSizeIn) {}
+
+    //! The message for hash, NULL if it is not cached
+    CSerializeDataRef Get(const uint256& hash);
+    //! Cache a message, evicting the least recently used ones beyond the maximum size
+    void Insert(const uint256& hash, const CSerializeDataRef& msg);
+    size_t Count();
+    size_t Size();
+};
+
+
 typedef enum BanReason
 {
     BanReasonUnknown          = 0,
@@ -292,8 +351,12 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeDataRef> vSendMsg;
     CCriticalSection cs_vSend;
+    CSocketReadiness readiness; // what the socket thread's poller last reported about hSocket
+    bool fSocketPolled;         // hSocket is registered with the socket thread's poller
+    std::atomic<bool> fMessageQueued;  // a message worker is processing one of our messages
+    bool fGetDataWaiting;              // vRecvGetData waits for a message worker to leave a lane
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -416,8 +479,8 @@ public:
         return total;
     }
 
-    // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+    // requires LOCK(cs_vRecvMsg), fComplete is set if a message was completed
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -489,6 +552,9 @@ public:
 
     void PushVersion();
 
+    /** Queue a message made with MakeSharedMessage, the buffer is shared with the other nodes it is pushed to */
+    void PushSharedMessage(const CSerializeDataRef& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
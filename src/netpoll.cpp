@@ -0,0 +1,199 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+
+#include "netbase.h"
+#include "util.h"
+#include "utiltime.h"
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifndef WIN32
+#include <poll.h>
+#endif
+
+using namespace std;
+
+//! Maximum number of events taken from epoll per wait
+static const int MAX_EPOLL_EVENTS = 256;
+
+CSocketPoller::CSocketPoller()
+{
+#ifdef USE_EPOLL
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll < 0)
+        LogPrintf("%s : epoll_create1 failed (%s), using poll()\n", __func__, NetworkErrorString(errno));
+#endif
+}
+
+CSocketPoller::~CSocketPoller()
+{
+#ifdef USE_EPOLL
+    if (hEpoll >= 0)
+        close(hEpoll);
+#endif
+}
+
+const char* CSocketPoller::GetName() const
+{
+#ifdef USE_EPOLL
+    if (hEpoll >= 0)
+        return "epoll";
+#endif
+#ifdef WIN32
+    return "select";
+#else
+    return "poll";
+#endif
+}
+
+bool CSocketPoller::Add(SOCKET hSocket, void* pOwner, CSocketReadiness* pready)
+{
+    Remove(pOwner);
+    Entry& entry = mapEntries[pOwner];
+    entry.hSocket = hSocket;
+    entry.pOwner = pOwner;
+    entry.pready = pready;
+#ifdef USE_EPOLL
+    if (hEpoll >= 0) {
+        struct epoll_event event;
+        event.events = pready ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+        event.data.ptr = &entry;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0) {
+            LogPrint("net", "%s : epoll_ctl failed: %s\n", __func__, NetworkErrorString(errno));
+            mapEntries.erase(pOwner);
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void CSocketPoller::Remove(void* pOwner)
+{
+    // A closed socket is no longer in the epoll set, and the descriptor may already belong to
+    // another socket, so it is not removed from the set explicitly.
+    mapEntries.erase(pOwner);
+}
+
+bool CSocketPoller::Wait(int nTimeout, std::vector<void*>& vReady)
+{
+    vReady.clear();
+#ifdef USE_EPOLL
+    if (hEpoll >= 0) {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+        if (nEvents < 0)
+            return errno == EINTR;
+        for (int i = 0; i < nEvents; i++) {
+            const Entry* pentry = (const Entry*)events[i].data.ptr;
+            uint32_t nFlags = events[i].events;
+            if (pentry->pready) {
+                if (nFlags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pentry->pready->fRecv = true;
+                if (nFlags & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    pentry->pready->fSend = true;
+            }
+            vReady.push_back(pentry->pOwner);
+        }
+        return true;
+    }
+#endif
+    return WaitPoll(nTimeout, vReady);
+}
+
+#ifdef WIN32
+bool CSocketPoller::WaitPoll(int nTimeout, std::vector<void*>& vReady)
+{
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    bool have_fds = false;
+    for (std::map<void*, Entry>::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+        const Entry& entry = it->second;
+        if (entry.hSocket == INVALID_SOCKET)
+            continue;
+        if (!entry.pready || !entry.pready->fRecv)
+            FD_SET(entry.hSocket, &fdsetRecv);
+        if (entry.pready && !entry.pready->fSend)
+            FD_SET(entry.hSocket, &fdsetSend);
+        FD_SET(entry.hSocket, &fdsetError);
+        have_fds = true;
+    }
+    if (!have_fds) {
+        MilliSleep(nTimeout);
+        return true;
+    }
+
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    if (select(0, &fdsetRecv, &fdsetSend, &fdsetError, &timeout) == SOCKET_ERROR)
+        return false;
+    for (std::map<void*, Entry>::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+        const Entry& entry = it->second;
+        if (entry.hSocket == INVALID_SOCKET)
+            continue;
+        bool fRecv = FD_ISSET(entry.hSocket, &fdsetRecv) || FD_ISSET(entry.hSocket, &fdsetError);
+        bool fSend = FD_ISSET(entry.hSocket, &fdsetSend);
+        if (!fRecv && !fSend)
+            continue;
+        if (entry.pready) {
+            if (fRecv)
+                entry.pready->fRecv = true;
+            if (fSend)
+                entry.pready->fSend = true;
+        }
+        vReady.push_back(entry.pOwner);
+    }
+    return true;
+}
+#else
+bool CSocketPoller::WaitPoll(int nTimeout, std::vector<void*>& vReady)
+{
+    std::vector<struct pollfd> vPollFds;
+    std::vector<const Entry*> vPollEntries;
+    vPollFds.reserve(mapEntries.size());
+    vPollEntries.reserve(mapEntries.size());
+    for (std::map<void*, Entry>::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+        const Entry& entry = it->second;
+        struct pollfd pfd;
+        pfd.fd = entry.hSocket;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (!entry.pready || !entry.pready->fRecv)
+            pfd.events |= POLLIN;
+        if (entry.pready && !entry.pready->fSend)
+            pfd.events |= POLLOUT;
+        if (entry.hSocket == INVALID_SOCKET || pfd.events == 0)
+            continue;
+        vPollFds.push_back(pfd);
+        vPollEntries.push_back(&entry);
+    }
+    if (vPollFds.empty()) {
+        MilliSleep(nTimeout);
+        return true;
+    }
+
+    if (poll(&vPollFds[0], vPollFds.size(), nTimeout) < 0)
+        return errno == EINTR;
+    for (unsigned int i = 0; i < vPollFds.size(); i++) {
+        short nFlags = vPollFds[i].revents;
+        if (!nFlags)
+            continue;
+        const Entry* pentry = vPollEntries[i];
+        if (pentry->pready) {
+            if (nFlags & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+                pentry->pready->fRecv = true;
+            if (nFlags & (POLLOUT | POLLHUP | POLLERR | POLLNVAL))
+                pentry->pready->fSend = true;
+        }
+        vReady.push_back(pentry->pOwner);
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,75 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_NETPOLL_H
+#define BITMONEY_NETPOLL_H
+
+#if defined(HAVE_CONFIG_H)
+#include "config/BitMoney-config.h"
+#endif
+
+#include "compat.h"
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#endif
+
+/**
+ * What is known about a socket without asking it: set when the poller reports it readable or
+ * writable, cleared right before a recv or send that may find out it no longer is. The flags
+ * stay set until then, so a socket is only polled again once it ran dry or its buffer filled.
+ */
+class CSocketReadiness
+{
+public:
+    std::atomic<bool> fRecv;
+    std::atomic<bool> fSend;
+
+    CSocketReadiness() : fRecv(false), fSend(false) {}
+};
+
+/**
+ * Waits for sockets to become ready. Sockets are registered once, with an owner pointer that is
+ * handed back when they are ready.
+ *
+ * On Linux, sockets with a CSocketReadiness are registered edge triggered with epoll, the cost of
+ * a wait only depends on the number of sockets that became ready. Elsewhere, or if epoll is not
+ * available, poll() (select() on Windows) is asked about the sockets whose readiness flags are
+ * not set. Sockets registered without a CSocketReadiness, like listening sockets, are level
+ * triggered and only polled for reading.
+ *
+ * Closing a socket unregisters it from epoll, Remove() must still be called before the owner
+ * goes away. Only one thread may use a poller.
+ */
+class CSocketPoller
+{
+private:
+    struct Entry {
+        SOCKET hSocket;
+        void* pOwner;
+        CSocketReadiness* pready;
+    };
+    std::map<void*, Entry> mapEntries;
+#ifdef USE_EPOLL
+    int hEpoll;
+#endif
+
+    bool WaitPoll(int nTimeout, std::vector<void*>& vReady);
+
+public:
+    CSocketPoller();
+    ~CSocketPoller();
+
+    bool Add(SOCKET hSocket, void* pOwner, CSocketReadiness* pready = NULL);
+    void Remove(void* pOwner);
+    /** Wait up to nTimeout milliseconds for a socket to become ready, and return the owners of the ready ones */
+    bool Wait(int nTimeout, std::vector<void*>& vReady);
+    const char* GetName() const;
+};
+
+#endif // BITMONEY_NETPOLL_H
@@ -0,0 +1,205 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_POOLALLOCATOR_H
+#define BITMONEY_POOLALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * Memory resource for containers that allocate many small nodes of the same few sizes,
+ * like the hash map of the coins cache.
+ *
+ * Blocks of up to MAX_BLOCK_SIZE_BYTES are cut from large chunks, and freed blocks are
+ * kept in a free list per block size to be handed out again. Nothing is returned to the
+ * system before the resource is destroyed, so the memory used settles at the peak of the
+ * container instead of fragmenting the heap. Larger requests, like the bucket array of
+ * a hash map, go to operator new.
+ *
+ * Chunks start small and double in size up to MAX_CHUNK_SIZE_BYTES, so short lived
+ * containers holding a few nodes stay cheap.
+ *
+ * Not thread safe: the resource is meant to be owned by one container, and used under
+ * whatever lock protects that container.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+private:
+    struct ListNode {
+        ListNode* pNext;
+    };
+
+    static const std::size_t MIN_CHUNK_SIZE_BYTES = 4096;
+    static const std::size_t MAX_CHUNK_SIZE_BYTES = 256 * 1024;
+    static const std::size_t NUM_FREE_LISTS = MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES + 2;
+
+    //! Freed blocks, indexed by block size in units of ALIGN_BYTES
+    ListNode* vFreeLists[NUM_FREE_LISTS];
+    std::vector<void*> vChunks;
+    std::size_t nChunkBytes;
+    std::size_t nNextChunkSize;
+
+    //! Unused part of the newest chunk
+    char* pAvailable;
+    char* pAvailableEnd;
+
+    static std::size_t NumElems(std::size_t bytes)
+    {
+        return (bytes + ALIGN_BYTES - 1) / ALIGN_BYTES;
+    }
+
+    static bool IsPoolable(std::size_t bytes, std::size_t alignment)
+    {
+        return bytes <= MAX_BLOCK_SIZE_BYTES && alignment <= ALIGN_BYTES;
+    }
+
+    void PushFree(void* p, std::size_t nElems)
+    {
+        ListNode* node = new (p) ListNode;
+        node->pNext = vFreeLists[nElems];
+        vFreeLists[nElems] = node;
+    }
+
+    void AllocateChunk()
+    {
+        // Keep what is left of the current chunk around as a free block
+        std::size_t nRemaining = (pAvailableEnd - pAvailable) / ALIGN_BYTES;
+        if (nRemaining > 0)
+            PushFree(pAvailable, nRemaining);
+
+        void* pChunk = ::operator new(nNextChunkSize);
+        vChunks.push_back(pChunk);
+        nChunkBytes += nNextChunkSize;
+        pAvailable = static_cast<char*>(pChunk);
+        pAvailableEnd = pAvailable + nNextChunkSize;
+        if (nNextChunkSize < MAX_CHUNK_SIZE_BYTES)
+            nNextChunkSize *= 2;
+    }
+
+    PoolResource(const PoolResource&);
+    PoolResource& operator=(const PoolResource&);
+
+public:
+    PoolResource() : nChunkBytes(0), nNextChunkSize(MIN_CHUNK_SIZE_BYTES), pAvailable(NULL), pAvailableEnd(NULL)
+    {
+        static_assert(ALIGN_BYTES >= sizeof(ListNode) && (ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two that fits a pointer");
+        static_assert(MAX_BLOCK_SIZE_BYTES <= MIN_CHUNK_SIZE_BYTES, "MAX_BLOCK_SIZE_BYTES must fit a chunk");
+        for (std::size_t i = 0; i < NUM_FREE_LISTS; i++)
+            vFreeLists[i] = NULL;
+    }
+
+    ~PoolResource()
+    {
+        for (std::vector<void*>::iterator it = vChunks.begin(); it != vChunks.end(); ++it)
+            ::operator delete(*it);
+    }
+
+    void* Allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (!IsPoolable(bytes, alignment))
+            return ::operator new(bytes);
+
+        std::size_t nElems = NumElems(bytes);
+        if (vFreeLists[nElems] != NULL) {
+            ListNode* node = vFreeLists[nElems];
+            vFreeLists[nElems] = node->pNext;
+            return node;
+        }
+
+        std::size_t nBytes = nElems * ALIGN_BYTES;
+        if (pAvailable + nBytes > pAvailableEnd)
+            AllocateChunk();
+        void* p = pAvailable;
+        pAvailable += nBytes;
+        return p;
+    }
+
+    void Deallocate(void* p, std::size_t bytes, std::size_t alignment)
+    {
+        if (!IsPoolable(bytes, alignment)) {
+            ::operator delete(p);
+            return;
+        }
+        PushFree(p, NumElems(bytes));
+    }
+
+    //! Size of a pooled block holding the given number of bytes
+    static std::size_t BlockSize(std::size_t bytes)
+    {
+        return NumElems(bytes) * ALIGN_BYTES;
+    }
+
+    //! Memory taken from the system for pooled blocks
+    std::size_t ChunkBytes() const { return nChunkBytes; }
+    std::size_t NumChunks() const { return vChunks.size(); }
+};
+
+/**
+ * Allocator using a PoolResource. A default constructed allocator has no resource and
+ * uses operator new, so containers that are not worth a pool can share the type.
+ */
+template <class T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES = sizeof(void*)>
+class PoolAllocator
+{
+public:
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <class U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    PoolAllocator() : pResource(NULL) {}
+    explicit PoolAllocator(ResourceType* pResourceIn) : pResource(pResourceIn) {}
+
+    template <class U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) : pResource(other.resource())
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (pResource == NULL)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(pResource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (pResource == NULL)
+            ::operator delete(p);
+        else
+            pResource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceType* resource() const { return pResource; }
+
+private:
+    ResourceType* pResource;
+};
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return a.resource() == b.resource();
+}
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITMONEY_POOLALLOCATOR_H
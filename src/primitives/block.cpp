@@ -6,6 +6,7 @@
 
 #include "primitives/block.h"
 
+#include "checkqueue.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -13,12 +14,134 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <boost/thread.hpp>
+
+std::atomic<uint64_t> nBlockHashCacheHits(0);
+
 uint256 CBlockHeader::GetHash() const
 {
+    if (nHashCacheState.load(std::memory_order_acquire) == HASH_CACHE_READY &&
+        memcmp(vchHashedFields, BEGIN(nVersion), HASHED_FIELDS_SIZE) == 0) {
+        nBlockHashCacheHits++;
+        return hashCached;
+    }
+
+    uint256 hash;
     if(nVersion < 4)
-        return XEVAN(BEGIN(nVersion), END(nNonce));
+        hash = XEVAN(BEGIN(nVersion), END(nNonce));
+    else
+        hash = Hash(BEGIN(nVersion), END(nAccumulatorCheckpoint));
+
+    SetCachedHash(hash);
+    return hash;
+}
+
+void CBlockHeader::SetCachedHash(const uint256& hash) const
+{
+    static_assert(HASHED_FIELDS_SIZE == sizeof(nVersion) + sizeof(hashPrevBlock) + sizeof(hashMerkleRoot) + sizeof(nTime) +
+                  sizeof(nBits) + sizeof(nNonce) + sizeof(nAccumulatorCheckpoint), "unexpected header field sizes");
+    // A READY snapshot only gets replaced after the fields were mutated, which
+    // already requires exclusive access. If another thread is filling the cache
+    // just leave it to that thread.
+    int nState = nHashCacheState.load(std::memory_order_acquire);
+    if (nState == HASH_CACHE_WRITING ||
+        !nHashCacheState.compare_exchange_strong(nState, HASH_CACHE_WRITING, std::memory_order_acquire))
+        return;
+    hashCached = hash;
+    memcpy(vchHashedFields, BEGIN(nVersion), HASHED_FIELDS_SIZE);
+    nHashCacheState.store(HASH_CACHE_READY, std::memory_order_release);
+}
+
+void CBlockHeader::CopyHashCache(const CBlockHeader& header)
+{
+    if (header.nHashCacheState.load(std::memory_order_acquire) != HASH_CACHE_READY) {
+        nHashCacheState = HASH_CACHE_EMPTY;
+        return;
+    }
+    hashCached = header.hashCached;
+    memcpy(vchHashedFields, header.vchHashedFields, HASHED_FIELDS_SIZE);
+    nHashCacheState.store(HASH_CACHE_READY, std::memory_order_release);
+}
+
+/** One XEVAN hash of a header, queued on xevancheckqueue */
+class CXevanCheck
+{
+private:
+    const CBlockHeader* pheader;
+    uint256* phash;
+
+public:
+    CXevanCheck() : pheader(NULL), phash(NULL) {}
+    CXevanCheck(const CBlockHeader* pheaderIn, uint256* phashIn) : pheader(pheaderIn), phash(phashIn) {}
+
+    bool operator()()
+    {
+        *phash = XEVAN(BEGIN(pheader->nVersion), END(pheader->nNonce));
+        return true;
+    }
 
-    return Hash(BEGIN(nVersion), END(nAccumulatorCheckpoint));
+    void swap(CXevanCheck& check)
+    {
+        std::swap(pheader, check.pheader);
+        std::swap(phash, check.phash);
+    }
+};
+
+static CCheckQueue<CXevanCheck> xevancheckqueue(128);
+static std::atomic<int> nXevanHashThreads(0);
+// CCheckQueue supports a single master at a time
+static boost::mutex csXevanMulti;
+
+void ThreadXevanHash()
+{
+    RenameThread("BitMoney-xevan");
+    nXevanHashThreads++;
+    xevancheckqueue.Thread();
+}
+
+void XEVAN_Multi(const CBlockHeader* headers, size_t n, uint256* out)
+{
+    if (n < XEVAN_MULTI_MIN_PARALLEL || nXevanHashThreads == 0) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = XEVAN(BEGIN(headers[i].nVersion), END(headers[i].nNonce));
+        return;
+    }
+
+    // Each check writes its own slot of out, so no locking is needed.
+    std::vector<CXevanCheck> vChecks;
+    vChecks.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        vChecks.push_back(CXevanCheck(&headers[i], &out[i]));
+
+    boost::unique_lock<boost::mutex> lock(csXevanMulti);
+    CCheckQueueControl<CXevanCheck> control(&xevancheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+
+    std::vector<CBlockHeader> vLegacy;
+    std::vector<size_t> vLegacyPos;
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        if (vHeaders[i].nVersion < 4) {
+            vLegacy.push_back(vHeaders[i]);
+            vLegacyPos.push_back(i);
+        } else {
+            vHashes[i] = vHeaders[i].GetHash();
+        }
+    }
+    if (vLegacy.empty())
+        return;
+
+    std::vector<uint256> vLegacyHashes(vLegacy.size());
+    XEVAN_Multi(&vLegacy[0], vLegacy.size(), &vLegacyHashes[0]);
+    for (size_t i = 0; i < vLegacy.size(); i++) {
+        vHashes[vLegacyPos[i]] = vLegacyHashes[i];
+        vHeaders[vLegacyPos[i]].SetCachedHash(vLegacyHashes[i]);
+    }
 }
 
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
@@ -12,6 +12,11 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <atomic>
+
+/** Minimum batch size before XEVAN_Multi hands the work to the hashing threads */
+static const size_t XEVAN_MULTI_MIN_PARALLEL = 256;
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE_CURRENT = 2000000;
 static const unsigned int MAX_BLOCK_SIZE_LEGACY = 1000000;
@@ -36,11 +41,40 @@ public:
     uint32_t nNonce;
     uint256 nAccumulatorCheckpoint;
 
+    // memory only: hash of the header fields as they were when it was computed.
+    // GetHash() compares the fields against the snapshot, so direct mutation of
+    // any header field invalidates the cache. The snapshot is published through
+    // nHashCacheState: a writer claims it EMPTY->WRITING and releases it READY,
+    // readers only use it once READY, so concurrent GetHash() calls are safe.
+    static const size_t HASHED_FIELDS_SIZE = 4 + 32 + 32 + 4 + 4 + 4 + 32;
+    enum { HASH_CACHE_EMPTY, HASH_CACHE_WRITING, HASH_CACHE_READY };
+    mutable std::atomic<int> nHashCacheState;
+    mutable uint256 hashCached;
+    mutable unsigned char vchHashedFields[HASHED_FIELDS_SIZE];
+
     CBlockHeader()
     {
         SetNull();
     }
 
+    CBlockHeader(const CBlockHeader& header)
+    {
+        *this = header;
+    }
+
+    CBlockHeader& operator=(const CBlockHeader& header)
+    {
+        nVersion = header.nVersion;
+        hashPrevBlock = header.hashPrevBlock;
+        hashMerkleRoot = header.hashMerkleRoot;
+        nTime = header.nTime;
+        nBits = header.nBits;
+        nNonce = header.nNonce;
+        nAccumulatorCheckpoint = header.nAccumulatorCheckpoint;
+        CopyHashCache(header);
+        return *this;
+    }
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -67,6 +101,7 @@ public:
         nBits = 0;
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
+        nHashCacheState = HASH_CACHE_EMPTY;
     }
 
     bool IsNull() const
@@ -76,6 +111,12 @@ public:
 
     uint256 GetHash() const;
 
+    //! Store a hash computed elsewhere (e.g. by a batch) for the current field values
+    void SetCachedHash(const uint256& hash) const;
+
+    //! Take over the cached hash of another header, if it has a complete one
+    void CopyHashCache(const CBlockHeader& header);
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -136,6 +177,7 @@ public:
         block.nBits          = nBits;
         block.nNonce         = nNonce;
         block.nAccumulatorCheckpoint = nAccumulatorCheckpoint;
+        block.CopyHashCache(*this);
         return block;
     }
 
@@ -169,6 +211,21 @@ public:
     void print() const;
 };
 
+/** Number of CBlockHeader::GetHash() calls answered from the cached hash */
+extern std::atomic<uint64_t> nBlockHashCacheHits;
+
+/** Compute the XEVAN hash of n headers into out[0..n-1]. Large batches are
+ * queued to the ThreadXevanHash workers; without workers the batch is hashed inline.
+ */
+void XEVAN_Multi(const CBlockHeader* headers, size_t n, uint256* out);
+
+/** Run a worker thread for XEVAN_Multi */
+void ThreadXevanHash();
+
+/** Compute GetHash() for a batch of headers, routing pre-v4 headers through
+ * XEVAN_Multi and the rest through double-SHA256.
+ */
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes);
 
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
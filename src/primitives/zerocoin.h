@@ -12,6 +12,9 @@
 #include "key.h"
 #include "serialize.h"
 
+#include <map>
+#include <vector>
+
 //struct that is safe to store essential mint data, without holding any information that allows for actual spending (serial, randomness, private key)
 struct CMintMeta
 {
@@ -230,6 +233,33 @@ public:
     };
 };
 
+//pubcoin values minted in a single block, grouped by denomination. Mints that use invalid outpoints are kept
+//apart so that callers can choose whether to filter them out.
+class CBlockPubcoins
+{
+public:
+    std::map<libzerocoin::CoinDenomination, std::vector<CBigNum> > mapValid;
+    std::map<libzerocoin::CoinDenomination, std::vector<CBigNum> > mapInvalid;
+
+    CBlockPubcoins() { SetNull(); }
+
+    void SetNull()
+    {
+        mapValid.clear();
+        mapInvalid.clear();
+    }
+
+    bool IsEmpty() const { return mapValid.empty() && mapInvalid.empty(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(mapValid);
+        READWRITE(mapInvalid);
+    };
+};
+
 class CZerocoinSpendReceipt
 {
 private:
@@ -33,7 +33,8 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "compact block"};
 
 CMessageHeader::CMessageHeader()
 {
@@ -139,7 +140,7 @@ bool CInv::IsKnownType() const
 }
 
 bool CInv::IsMasterNodeType() const{
- 	return (type >= 6);
+ 	return (type >= MSG_SPORK && type <= MSG_DSTX);
 }
 
 const char* CInv::GetCommand() const
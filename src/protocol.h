@@ -172,7 +172,9 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Only requested in a getdata, answered with a "cmpctblock" for blocks near the tip
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -16,6 +16,7 @@
 #include "utilmoneystr.h"
 #include "accumulatormap.h"
 #include "accumulators.h"
+#include "zbitspendcache.h"
 
 #include <stdint.h>
 #include <univalue.h>
@@ -187,16 +188,22 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -246,10 +253,17 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "  \"transactionid\" : {       (json object)\n"
             "    \"size\" : n,             (numeric) transaction size in bytes\n"
             "    \"fee\" : n,              (numeric) transaction fee in BitMoney\n"
+            "    \"modifiedfee\" : n,      (numeric) transaction fee with fee deltas used for mining priority\n"
             "    \"time\" : n,             (numeric) local time transaction entered pool in seconds since 1 Jan 1970 GMT\n"
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -804,7 +818,12 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    ret.push_back(Pair("expired", mempool.GetExpiredCount()));
+    ret.push_back(Pair("evicted", mempool.GetEvictedCount()));
 
     return ret;
 }
@@ -820,6 +839,11 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"expired\": xxxxx             (numeric) Transactions expired from the mempool since startup\n"
+            "  \"evicted\": xxxxx             (numeric) Transactions evicted to keep the mempool below maxmempool since startup\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -828,6 +852,41 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcacheinfo\n"
+            "\nReturns counters for the in-memory validation caches.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"xevanhashes\": xxxxx          (numeric) XEVAN hashes computed since startup\n"
+            "  \"blockhashcachehits\": xxxxx   (numeric) Block hash lookups answered from the header hash cache\n"
+            "  \"zbitspendcache\": {           (json object) Verified zBIT spend proof cache\n"
+            "     \"size\": xxxxx              (numeric) Number of cached spends\n"
+            "     \"hits\": xxxxx              (numeric) Spends whose proof verification was skipped\n"
+            "     \"misses\": xxxxx            (numeric) Spends that had to be verified\n"
+            "  }\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getcacheinfo", "") + HelpExampleRpc("getcacheinfo", ""));
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("xevanhashes", (uint64_t)nXevanHashCount));
+    ret.push_back(Pair("blockhashcachehits", (uint64_t)nBlockHashCacheHits));
+
+    uint64_t nSize, nHits, nMisses;
+    GetZerocoinSpendCacheStats(nSize, nHits, nMisses);
+    UniValue spendCache(UniValue::VOBJ);
+    spendCache.push_back(Pair("size", nSize));
+    spendCache.push_back(Pair("hits", nHits));
+    spendCache.push_back(Pair("misses", nMisses));
+    ret.push_back(Pair("zbitspendcache", spendCache));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
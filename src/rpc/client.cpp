@@ -115,6 +115,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
         //{"startmasternode", 1},
         {"mnvoteraw", 1},
         {"mnvoteraw", 4},
+        {"rescanblockchain", 0},
+        {"rescanblockchain", 1},
         {"reservebalance", 0},
         {"reservebalance", 1},
         {"setstakesplitthreshold", 0},
@@ -308,6 +308,7 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getblock", &getblock, true, false, false},
         {"blockchain", "getblockhash", &getblockhash, true, false, false},
         {"blockchain", "getblockheader", &getblockheader, false, false, false},
+        {"blockchain", "getcacheinfo", &getcacheinfo, true, true, false},
         {"blockchain", "getchaintips", &getchaintips, true, false, false},
         {"blockchain", "getdifficulty", &getdifficulty, true, false, false},
         {"blockchain", "getfeeinfo", &getfeeinfo, true, false, false},
@@ -423,6 +424,7 @@ static const CRPCCommand vRPCCommands[] =
         {"wallet", "listunspent", &listunspent, false, false, true},
         {"wallet", "lockunspent", &lockunspent, true, false, true},
         {"wallet", "move", &movecmd, false, false, true},
+        {"wallet", "rescanblockchain", &rescanblockchain, false, false, true},
         {"wallet", "multisend", &multisend, false, false, true},
         {"wallet", "sendfrom", &sendfrom, false, false, true},
         {"wallet", "sendmany", &sendmany, false, false, true},
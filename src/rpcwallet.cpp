@@ -2129,6 +2129,21 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,         (numeric) the transaction fee configuration, set in BIT/kB\n"
+            "  \"coinselection\": {          (object) coin selection passes since startup\n"
+            "    \"selections\": n,          (numeric) number of passes\n"
+            "    \"exact\": n,               (numeric) passes that found a single coin of the target value\n"
+            "    \"bnb\": n,                 (numeric) passes where the exact match search found a subset\n"
+            "    \"bnb_exhausted\": n,       (numeric) passes where the exact match search ran out of tries or time\n"
+            "    \"approximate\": n,         (numeric) passes that used the stochastic subset search\n"
+            "    \"avg_ms\": x.xx,           (numeric) average time of a pass in milliseconds\n"
+            "    \"max_ms\": x.xx,           (numeric) longest pass in milliseconds\n"
+            "    \"last_ms\": x.xx,          (numeric) last pass in milliseconds\n"
+            "    \"last_candidates\": n      (numeric) spendable coins the last pass looked at\n"
+            "  },\n"
+            "  \"scanning\": {               (object) the rescan in progress, false if there is none\n"
+            "    \"duration\": xxxx,         (numeric) seconds since the rescan started\n"
+            "    \"progress\": x.xxxx        (numeric) scanned part of the blocks, from 0 to 1\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -2145,9 +2160,86 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
     obj.push_back(Pair("paytxfee",      ValueFromAmount(payTxFee.GetFeePerK())));
+
+    CCoinSelectionStats stats = pwalletMain->GetCoinSelectionStats();
+    UniValue selection(UniValue::VOBJ);
+    selection.push_back(Pair("selections", (uint64_t)stats.nSelections));
+    selection.push_back(Pair("exact", (uint64_t)stats.nExact));
+    selection.push_back(Pair("bnb", (uint64_t)stats.nBnB));
+    selection.push_back(Pair("bnb_exhausted", (uint64_t)stats.nBnBExhausted));
+    selection.push_back(Pair("approximate", (uint64_t)stats.nApproximate));
+    selection.push_back(Pair("avg_ms", stats.nSelections ? stats.nTotalMicros * 0.001 / stats.nSelections : 0.0));
+    selection.push_back(Pair("max_ms", stats.nMaxMicros * 0.001));
+    selection.push_back(Pair("last_ms", stats.nLastMicros * 0.001));
+    selection.push_back(Pair("last_candidates", (uint64_t)stats.nLastCandidates));
+    obj.push_back(Pair("coinselection", selection));
+
+    if (pwalletMain->IsScanning()) {
+        UniValue scanning(UniValue::VOBJ);
+        scanning.push_back(Pair("duration", pwalletMain->ScanningDuration() / 1000));
+        scanning.push_back(Pair("progress", pwalletMain->ScanningProgress()));
+        obj.push_back(Pair("scanning", scanning));
+    } else {
+        obj.push_back(Pair("scanning", false));
+    }
     return obj;
 }
 
+UniValue rescanblockchain(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "rescanblockchain ( start_height stop_height )\n"
+            "\nRescan the local blockchain for wallet related transactions.\n"
+
+            "\nArguments:\n"
+            "1. start_height    (numeric, optional, default=0) block height where the rescan should start\n"
+            "2. stop_height     (numeric, optional) the last block height that should be scanned, the tip if omitted\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"start_height\": n,     (numeric) the block height where the rescan started\n"
+            "  \"stop_height\": n,      (numeric) the last block height that was scanned\n"
+            "  \"transactions\": n      (numeric) number of transactions added to or updated in the wallet\n"
+            "}\n"
+
+            "\nNote: This call can take minutes to complete.\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("rescanblockchain", "100000 120000") + HelpExampleRpc("rescanblockchain", "100000, 120000"));
+
+    CBlockIndex* pindexStart = NULL;
+    CBlockIndex* pindexStop = NULL;
+    {
+        LOCK(cs_main);
+        pindexStart = chainActive.Genesis();
+        if (params.size() > 0 && !params[0].isNull()) {
+            pindexStart = chainActive[params[0].get_int()];
+            if (!pindexStart)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start_height");
+        }
+        pindexStop = chainActive.Tip();
+        if (params.size() > 1 && !params[1].isNull()) {
+            pindexStop = chainActive[params[1].get_int()];
+            if (!pindexStop)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid stop_height");
+            if (pindexStop->nHeight < pindexStart->nHeight)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "stop_height must be greater than start_height");
+        }
+    }
+
+    int nTransactions = pwalletMain->ScanForWalletTransactions(pindexStart, true, pindexStop);
+    if (nTransactions < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Wait for the rescan to finish and try again.");
+    pwalletMain->ReacceptWalletTransactions();
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("start_height", pindexStart->nHeight));
+    result.push_back(Pair("stop_height", pindexStop->nHeight));
+    result.push_back(Pair("transactions", nTransactions));
+    return result;
+}
+
 // ppcoin: reserve balance from being staked for network protection
 UniValue reservebalance(const UniValue& params, bool fHelp)
 {
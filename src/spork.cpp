@@ -25,6 +25,7 @@ CSporkManager sporkManager;
 
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
+CCriticalSection cs_mapSporksActive;
 
 // BitMoney: on startup load spork values from previous session if they exist in the sporkDB
 void LoadSporksFromDB()
@@ -43,7 +44,10 @@ void LoadSporksFromDB()
 
         // add spork to memory
         mapSporks[spork.GetHash()] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporksActive);
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -74,12 +78,15 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         if (strSpork == "Unknown") return;
 
         uint256 hash = spork.GetHash();
-        if (mapSporksActive.count(spork.nSporkID)) {
-            if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
-                if (fDebug) LogPrintf("%s : seen %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
-                return;
-            } else {
-                if (fDebug) LogPrintf("%s : got updated spork %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
+        {
+            LOCK(cs_mapSporksActive);
+            if (mapSporksActive.count(spork.nSporkID)) {
+                if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
+                    if (fDebug) LogPrintf("%s : seen %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
+                    return;
+                } else {
+                    if (fDebug) LogPrintf("%s : got updated spork %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
+                }
             }
         }
 
@@ -100,16 +107,24 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         }
 
         mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporksActive);
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         // BitMoney: add to spork database.
         pSporkDB->WriteSpork(spork.nSporkID, spork);
     }
     if (strCommand == "getsporks") {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
+        std::map<int, CSporkMessage> mapSporksCopy;
+        {
+            LOCK(cs_mapSporksActive);
+            mapSporksCopy = mapSporksActive;
+        }
+        std::map<int, CSporkMessage>::iterator it = mapSporksCopy.begin();
 
-        while (it != mapSporksActive.end()) {
+        while (it != mapSporksCopy.end()) {
             pfrom->PushMessage("spork", it->second);
             it++;
         }
@@ -121,10 +136,18 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 int64_t GetSporkValue(int nSporkID)
 {
     int64_t r = -1;
+    bool fReceived = false;
 
-    if (mapSporksActive.count(nSporkID)) {
-        r = mapSporksActive[nSporkID].nValue;
-    } else {
+    {
+        LOCK(cs_mapSporksActive);
+        std::map<int, CSporkMessage>::iterator it = mapSporksActive.find(nSporkID);
+        if (it != mapSporksActive.end()) {
+            r = it->second.nValue;
+            fReceived = true;
+        }
+    }
+
+    if (!fReceived) {
         if (nSporkID == SPORK_2_SWIFTTX) r = SPORK_2_SWIFTTX_DEFAULT;
         if (nSporkID == SPORK_3_SWIFTTX_BLOCK_FILTERING) r = SPORK_3_SWIFTTX_BLOCK_FILTERING_DEFAULT;
         if (nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
@@ -402,7 +425,10 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
     if (Sign(msg)) {
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
-        mapSporksActive[nSporkID] = msg;
+        {
+            LOCK(cs_mapSporksActive);
+            mapSporksActive[nSporkID] = msg;
+        }
         return true;
     }
 
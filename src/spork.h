@@ -74,6 +74,8 @@ class CSporkManager;
 
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
+//! Guards mapSporksActive, which the spork message lane writes while any thread reads it
+extern CCriticalSection cs_mapSporksActive;
 extern CSporkManager sporkManager;
 
 void LoadSporksFromDB();
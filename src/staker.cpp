@@ -0,0 +1,251 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "staker.h"
+
+#include "chain.h"
+#include "init.h"
+#include "kernel.h"
+#include "main.h"
+#include "pow.h"
+#include "timedata.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilmoneystr.h"
+#include "wallet.h"
+
+#include <boost/thread.hpp>
+
+CStakeCandidate::CStakeCandidate(std::unique_ptr<CStakeInput> inputIn, bool fzbitIn) : input(std::move(inputIn)),
+                                                                                       fzbit(fzbitIn),
+                                                                                       nTxTime(0),
+                                                                                       nRequiredDepth(0),
+                                                                                       pindexFrom(NULL),
+                                                                                       nTimeBlockFrom(0),
+                                                                                       fKernel(false),
+                                                                                       ssKernel(SER_GETHASH, 0)
+{
+    nValue = input->GetValue();
+}
+
+CStaker::CStaker(CWallet* pwalletIn) : pwallet(pwalletIn),
+                                       fDirty(true),
+                                       nTimeLoaded(0),
+                                       hashSearchTip(0),
+                                       pindexSearchTip(NULL),
+                                       nSearchedUntil(0),
+                                       nSearchStart(0),
+                                       nStakeableBalance(0)
+{
+    connTransactionChanged = pwallet->NotifyTransactionChanged.connect(
+        [this](CWallet*, const uint256&, ChangeType) { fDirty = true; });
+}
+
+void CStaker::LoadKernel(CStakeCandidate& candidate)
+{
+    if (!candidate.pindexFrom) {
+        CBlockIndex* pindex = candidate.input->GetIndexFrom();
+        if (!pindex || pindex->nHeight < 1)
+            return;
+        candidate.pindexFrom = pindex;
+        candidate.nTimeBlockFrom = pindex->GetBlockTime();
+    }
+
+    // the modifier is only known a selection interval after the block, which is well within the min age
+    if (GetAdjustedTime() - candidate.nTimeBlockFrom < nStakeMinAge)
+        return;
+
+    uint64_t nStakeModifier = 0;
+    if (!candidate.input->GetModifier(nStakeModifier))
+        return;
+
+    candidate.ssKernel = GetStakeKernelHasher(candidate.input->GetUniqueness(), nStakeModifier, candidate.nTimeBlockFrom);
+    candidate.fKernel = true;
+}
+
+void CStaker::LoadCandidates()
+{
+    fDirty = false;
+    nTimeLoaded = GetTime();
+    listCandidates.clear();
+
+    if (GetBoolArg("-bitstake", true)) {
+        // maturity and age change with every block, so they are checked on each search instead
+        vector<COutput> vCoins;
+        pwallet->AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+        for (const COutput& out : vCoins) {
+            //if zerocoinspend, then use the block time
+            int64_t nTxTime = out.tx->GetTxTime();
+            if (out.tx->IsZerocoinSpend()) {
+                if (!out.tx->IsInMainChain())
+                    continue;
+                nTxTime = mapBlockIndex.at(out.tx->hashBlock)->GetBlockTime();
+            }
+
+            std::unique_ptr<CBitStake> input(new CBitStake());
+            input->SetInput((CTransaction) *out.tx, out.i);
+            listCandidates.emplace_back(std::move(input), false);
+
+            CStakeCandidate& candidate = listCandidates.back();
+            candidate.nTxTime = nTxTime;
+            candidate.nRequiredDepth = out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10;
+            LoadKernel(candidate);
+        }
+    }
+
+    LoadzbitCandidates();
+}
+
+void CStaker::LoadzbitCandidates()
+{
+    // the block a zBIT stakes from moves with the tip, so these are reloaded on every block
+    std::list<CStakeCandidate>::iterator it = listCandidates.begin();
+    while (it != listCandidates.end()) {
+        if (it->fzbit)
+            it = listCandidates.erase(it);
+        else
+            ++it;
+    }
+
+    std::list<std::unique_ptr<CStakeInput> > listInputs;
+    pwallet->SelectzbitStakeCoins(listInputs);
+    for (std::unique_ptr<CStakeInput>& input : listInputs) {
+        listCandidates.emplace_back(std::move(input), true);
+        LoadKernel(listCandidates.back());
+    }
+}
+
+void CStaker::SetTip(const CBlockIndex* pindexTip)
+{
+    // inputs and modifiers may be gone after a reorg
+    if (pindexSearchTip != NULL && !chainActive.Contains(pindexSearchTip))
+        fDirty = true;
+
+    if (fDirty || GetTime() - nTimeLoaded > pwallet->nStakeSetUpdateTime) {
+        LoadCandidates();
+    } else {
+        for (CStakeCandidate& candidate : listCandidates) {
+            if (!candidate.fzbit && !candidate.fKernel)
+                LoadKernel(candidate);
+        }
+        LoadzbitCandidates();
+    }
+
+    CAmount nBalance = pwallet->GetBalance();
+    if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance)) {
+        error("%s : invalid reserve balance amount", __func__);
+        nBalance = 0;
+    }
+    nStakeableBalance = nBalance > 0 && nBalance <= nReserveBalance ? -1 : nBalance - nReserveBalance;
+
+    if (pindexSearchTip != pindexTip) {
+        // give a new block some time to propagate before staking on top of it
+        nSearchStart = GetAdjustedTime() - pindexTip->GetBlockTime() < 60 ? GetAdjustedTime() + 10 : 0;
+    }
+    hashSearchTip = pindexTip->GetBlockHash();
+    pindexSearchTip = pindexTip;
+    nSearchedUntil = 0;
+}
+
+bool CStaker::FindKernel(CStakeHit& hit)
+{
+    if (pwallet->IsLocked() || ShutdownRequested())
+        return false;
+
+    const CBlockIndex* pindexPrev = NULL;
+    unsigned int nBits = 0;
+    int64_t nMedianTimePast = 0;
+    {
+        LOCK2(cs_main, pwallet->cs_wallet);
+        pindexPrev = chainActive.Tip();
+        if (pindexPrev == NULL)
+            return false;
+
+        if (fDirty || pindexPrev->GetBlockHash() != hashSearchTip)
+            SetTip(pindexPrev);
+
+        CBlockHeader header;
+        header.nTime = GetAdjustedTime();
+        nBits = GetNextWorkRequired(pindexPrev, &header);
+        nMedianTimePast = pindexPrev->GetMedianTimePast();
+    }
+
+    if (nStakeableBalance < 0 || listCandidates.empty())
+        return false;
+
+    // only hash the time slots that are new since the last search on this tip
+    int64_t nNow = GetAdjustedTime();
+    if (nNow < nSearchStart)
+        return false;
+    unsigned int nFrom = std::max(nSearchedUntil + 1, (unsigned int)nNow + 1);
+    unsigned int nTo = nNow + STAKE_HASH_DRIFT;
+    if (nFrom > nTo)
+        return false;
+
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    bool fFound = false;
+    CAmount nAmountSelected = 0;
+    for (CStakeCandidate& candidate : listCandidates) {
+        boost::this_thread::interruption_point();
+
+        if (!candidate.fzbit) {
+            //make sure not to outrun target amount
+            if (nAmountSelected + candidate.nValue > nStakeableBalance)
+                continue;
+
+            //check for min age
+            if (nNow - candidate.nTxTime < nStakeMinAge)
+                continue;
+
+            //check that it is matured
+            if (!candidate.pindexFrom || pindexPrev->nHeight - candidate.pindexFrom->nHeight + 1 < candidate.nRequiredDepth)
+                continue;
+
+            nAmountSelected += candidate.nValue;
+        }
+
+        if (!candidate.fKernel)
+            continue;
+
+        // latest time slot first, like Stake()
+        for (unsigned int nTime = nTo; nTime >= nFrom; nTime--) {
+            if (nTime <= nMedianTimePast || candidate.nTimeBlockFrom + nStakeMinAge > nTime)
+                break;
+
+            uint256 hashProofOfStake = 0;
+            if (CheckStake(candidate.ssKernel, candidate.nValue, bnTargetPerCoinDay, nTime, hashProofOfStake)) {
+                hit.input = candidate.input.get();
+                hit.nTime = nTime;
+                hit.nBits = nBits;
+                hit.hashPrevBlock = pindexPrev->GetBlockHash();
+                fFound = true;
+                break;
+            }
+        }
+
+        if (fFound)
+            break;
+    }
+
+    nSearchedUntil = nTo;
+    nLastCoinStakeSearchInterval = nTo - nFrom + 1;
+    mapHashedBlocks.clear();
+    mapHashedBlocks[pindexPrev->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+
+    if (fFound)
+        LogPrintf("%s : kernel found\n", __func__);
+
+    return fFound;
+}
+
+void CStaker::WaitForNextSlot()
+{
+    {
+        WaitableLock lock(csBestBlock);
+        cvBlockChange.wait_for(lock, std::chrono::milliseconds(1000 - GetTimeMillis() % 1000));
+    }
+    boost::this_thread::interruption_point();
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_STAKER_H
+#define BITMONEY_STAKER_H
+
+#include "amount.h"
+#include "hash.h"
+#include "main.h"
+#include "stakeinput.h"
+#include "uint256.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+
+#include <boost/signals2/connection.hpp>
+
+class CBlockIndex;
+class CWallet;
+
+/**
+ * A stakeable input with the parts of its kernel hash that do not change
+ * between stake attempts.
+ */
+class CStakeCandidate
+{
+public:
+    std::unique_ptr<CStakeInput> input;
+    CAmount nValue;
+    bool fzbit;
+
+    //! BIT only: minimum age is counted from this time
+    int64_t nTxTime;
+    //! BIT only: confirmations needed before the input may stake
+    int nRequiredDepth;
+
+    //! Block the kernel is based on, NULL when unknown
+    const CBlockIndex* pindexFrom;
+    unsigned int nTimeBlockFrom;
+
+    //! Set once the stake modifier of pindexFrom is known, see GetStakeKernelHasher()
+    bool fKernel;
+    CHashWriter ssKernel;
+
+    CStakeCandidate(std::unique_ptr<CStakeInput> inputIn, bool fzbitIn);
+};
+
+/** A kernel that met the stake target, ready to go into a block */
+class CStakeHit
+{
+public:
+    CStakeInput* input;
+    unsigned int nTime;
+    unsigned int nBits;
+    uint256 hashPrevBlock;
+
+    CStakeHit() : input(NULL), nTime(0), nBits(0), hashPrevBlock(0) {}
+};
+
+/**
+ * Proof-of-stake kernel search for one wallet.
+ *
+ * Keeps the wallet's stakeable inputs and their kernel data between attempts,
+ * reloading them only when the wallet or the chain they are based on changes.
+ * Each call to FindKernel() hashes only the time slots that were not searched
+ * yet on the current tip, so waking up once per second costs one hash per input.
+ */
+class CStaker
+{
+private:
+    CWallet* pwallet;
+    std::list<CStakeCandidate> listCandidates;
+
+    //! Set by wallet notifications, the inputs are reloaded on the next search
+    std::atomic<bool> fDirty;
+    boost::signals2::scoped_connection connTransactionChanged;
+    int64_t nTimeLoaded;
+
+    //! Tip the time slots were searched on and the last slot searched
+    uint256 hashSearchTip;
+    const CBlockIndex* pindexSearchTip;
+    unsigned int nSearchedUntil;
+    int64_t nSearchStart;
+    CAmount nStakeableBalance;
+
+    void LoadCandidates();
+    void LoadzbitCandidates();
+    void LoadKernel(CStakeCandidate& candidate);
+    void SetTip(const CBlockIndex* pindexTip);
+
+public:
+    explicit CStaker(CWallet* pwalletIn);
+
+    /** Search the new time slots of the current tip, returns true with the kernel on a hit */
+    bool FindKernel(CStakeHit& hit);
+
+    /** Wait for the next time slot or a new tip */
+    void WaitForNextSlot();
+
+    /** Number of inputs being staked */
+    size_t Size() const { return listCandidates.size(); }
+};
+
+#endif // BITMONEY_STAKER_H
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <fstream>
 // #include <curses.h>
+#include <algorithm>
 #include <exception>
 #include <cstdlib>
 #include <sys/time.h>
@@ -369,6 +370,65 @@ Testb_MintAndSpend()
 	return false;
 }
 
+#define TESTS_VERIFY_ITERATIONS     10
+
+// Verifies a spend TESTS_VERIFY_ITERATIONS times and prints the throughput
+bool
+Testb_VerifyRate(const string& strName, ZerocoinParams* params, CDataStream ss, const Accumulator& acc)
+{
+	CoinSpend spend(params, params, ss);
+
+	bool ret = true;
+	timer.start();
+	for (uint32_t i = 0; i < TESTS_VERIFY_ITERATIONS; i++) {
+		ret &= spend.Verify(acc);
+	}
+	timer.stop();
+
+	cout << "\tVERIFY " << strName << ": " << timer.duration()/TESTS_VERIFY_ITERATIONS << " ms per spend\t" <<
+	        (TESTS_VERIFY_ITERATIONS * 1000.0) / std::max(timer.duration(), 1) << " verifies/s" << endl;
+
+	return ret;
+}
+
+bool
+Testb_VerifyThroughput()
+{
+	try {
+		if (ggCoins[0] == NULL) {
+			return false;
+		}
+
+		Accumulator acc(&gg_Params->accumulatorParams,CoinDenomination::ZQ_ONE);
+		AccumulatorWitness wAcc(gg_Params, acc, ggCoins[0]->getPublicCoin());
+		for (uint32_t i = 0; i < TESTS_COINS_TO_ACCUMULATE; i++) {
+			acc += ggCoins[i]->getPublicCoin();
+			wAcc += ggCoins[i]->getPublicCoin();
+		}
+
+		CoinSpend spend(gg_Params, gg_Params, *(ggCoins[0]), acc, 0, wAcc, 0, SpendType::SPEND);
+		CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+		ss << spend;
+
+		// The same parameters without the comb tables and Montgomery contexts take the plain pow_mod path
+		ZerocoinParams paramsNoTables = *gg_Params;
+		for (IntegerGroupParams* group : {&paramsNoTables.coinCommitmentGroup, &paramsNoTables.serialNumberSoKCommitmentGroup,
+		        &paramsNoTables.accumulatorParams.accumulatorPoKCommitmentGroup, &paramsNoTables.accumulatorParams.accumulatorQRNCommitmentGroup}) {
+			group->gComb.reset();
+			group->hComb.reset();
+			group->mont.reset();
+		}
+		paramsNoTables.accumulatorParams.accumulatorMont.reset();
+
+		bool ret = Testb_VerifyRate("PLAIN POW_MOD", &paramsNoTables, ss, acc);
+		ret &= Testb_VerifyRate("WITH TABLES", gg_Params, ss, acc);
+		return ret;
+	} catch (runtime_error &e) {
+		cout << e.what() << endl;
+		return false;
+	}
+}
+
 void
 Testb_RunAllTests()
 {
@@ -388,6 +448,7 @@ Testb_RunAllTests()
 	gLogTestResult("coins can be minted", Testb_MintCoin);
 	gLogTestResult("the accumulator works", Testb_Accumulator);
 	gLogTestResult("a minted coin can be spent", Testb_MintAndSpend);
+	gLogTestResult("a spend verifies with and without the comb tables", Testb_VerifyThroughput);
 
 	// Summarize test results
 	if (ggSuccessfulTests < ggNumTests) {
@@ -0,0 +1,94 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+// A block of a coinbase and three transactions spending it
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].scriptSig = CScript() << OP_11;
+    txCoinbase.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txCoinbase.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txCoinbase.vout[i].nValue = 33000LL;
+    }
+    block.vtx.push_back(txCoinbase);
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11;
+        tx.vin[0].prevout.hash = txCoinbase.GetHash();
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 11000LL;
+        block.vtx.push_back(tx);
+    }
+    block.nVersion = 4;
+    block.hashPrevBlock = uint256(1);
+    block.nBits = 0x207fffff;
+    block.nTime = 1500000000;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_roundtrip_test)
+{
+    CBlock block = BuildBlockTestCase();
+
+    // The receiver has the second transaction of the block in its mempool
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeaderAndShortTxIDs(block);
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    // The third transaction was rejected from the mempool earlier
+    std::vector<CTransaction> vExtraTxn(1, block.vtx[3]);
+    CPartialBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vExtraTxn), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+    CBlock blockOut;
+    std::vector<CTransaction> vMissing;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vMissing), READ_STATUS_INVALID);
+    vMissing.push_back(block.vtx[2]);
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vMissing), READ_STATUS_FAILED);
+    vMissing[0] = block.vtx[1];
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vMissing), READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_invalid_test)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A compact block without any transaction
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    CBlock block = BuildBlockTestCase();
+    cmpctblock.header = block.GetBlockHeader();
+    CPartialBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, std::vector<CTransaction>()), READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
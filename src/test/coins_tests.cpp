@@ -3,7 +3,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "memusage.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -41,7 +43,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             map_[it->first] = it->second.coins;
@@ -49,15 +51,39 @@ public:
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                it++;
         }
-        mapCoins.clear();
+        if (fErase)
+            mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t dirty = 0;
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.DynamicMemoryUsage();
+            if (it->second.flags & CCoinsCacheEntry::DIRTY)
+                dirty += it->second.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+        BOOST_CHECK_EQUAL(DirtyMemoryUsage(), dirty);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +109,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +142,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,6 +163,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -143,6 +174,13 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
+            } else if (stack.size() > 0 && insecure_rand() % 3 == 0) {
+                // Write out the changes but keep the entries, then drop some of them.
+                stack.back()->Sync();
+                BOOST_CHECK_EQUAL(stack.back()->DirtyMemoryUsage(), 0);
+                stack.back()->Trim(stack.back()->DynamicMemoryUsage() / 2);
+                stack.back()->SelfTest();
+                synced_a_cache = true;
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
                 CCoinsView* tip = &base;
@@ -151,7 +189,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +211,105 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_a_cache);
+}
+
+// Spend and restore single outputs of transactions with many outputs, through two
+// caches on top of a database in each layout, and check that both databases end up
+// with the same coins, also after converting between the layouts.
+BOOST_AUTO_TEST_CASE(coins_db_layout_test)
+{
+    CCoinsViewDB dbByTx(1 << 20, true);
+    CCoinsViewDB dbByOutpoint(1 << 20, true);
+    BOOST_CHECK(dbByTx.SetLayout(false));
+    BOOST_CHECK(dbByOutpoint.SetLayout(true));
+    BOOST_CHECK(!dbByTx.IsByOutpoint());
+    BOOST_CHECK(dbByOutpoint.IsByOutpoint());
+
+    std::map<uint256, CCoins> result;
+    std::vector<uint256> txids;
+    txids.resize(200);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = GetRandHash();
+    }
+
+    CCoinsViewDB* dbs[] = {&dbByTx, &dbByOutpoint};
+    for (unsigned int round = 0; round < 20; round++) {
+        // The same modifications are applied on top of both databases
+        std::vector<uint32_t> vRand(110000);
+        for (unsigned int i = 0; i < vRand.size(); i++) {
+            vRand[i] = insecure_rand();
+        }
+        for (unsigned int d = 0; d < 2; d++) {
+            unsigned int r = 0;
+            CCoinsViewCacheTest base(dbs[d]);
+            CCoinsViewCacheTest tip(&base);
+            for (unsigned int i = 0; i < 500; i++) {
+                uint256 txid = txids[vRand[r++] % txids.size()];
+                CCoinsModifier entry = tip.ModifyCoins(txid);
+                if (entry->IsPruned()) {
+                    // Create the transaction, with up to 100 outputs
+                    entry->nVersion = 1;
+                    entry->nHeight = vRand[r++] % 1000;
+                    entry->fCoinStake = vRand[r++] % 2;
+                    entry->vout.resize(1 + vRand[r++] % 100);
+                    for (unsigned int n = 0; n < entry->vout.size(); n++) {
+                        entry->vout[n].nValue = 1 + vRand[r++] % 1000;
+                        entry->vout[n].scriptPubKey.assign(1 + (vRand[r++] & 0x3F), 0);
+                    }
+                } else if (vRand[r++] % 4 == 0) {
+                    // Restore a spent output
+                    unsigned int n = vRand[r++] % (entry->vout.size() + 2);
+                    if (n >= entry->vout.size())
+                        entry->vout.resize(n + 1);
+                    if (entry->vout[n].IsNull()) {
+                        entry->vout[n].nValue = 1 + vRand[r++] % 1000;
+                        entry->vout[n].scriptPubKey.assign(1 + (vRand[r++] & 0x3F), 0);
+                    }
+                } else {
+                    entry->Spend(vRand[r++] % entry->vout.size());
+                }
+                entry->Cleanup();
+                if (d == 0)
+                    result[txid] = *entry;
+                if (vRand[r++] % 50 == 0) {
+                    tip.Sync();
+                    tip.Trim(tip.DynamicMemoryUsage() / 2);
+                }
+                if (vRand[r++] % 100 == 0)
+                    base.Sync();
+            }
+            tip.SelfTest();
+            base.SelfTest();
+            BOOST_CHECK(tip.Flush());
+            BOOST_CHECK(base.Flush());
+        }
+
+        for (unsigned int d = 0; d < 2; d++) {
+            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+                CCoins coins;
+                bool fFound = dbs[d]->GetCoins(it->first, coins);
+                BOOST_CHECK_EQUAL(fFound, !it->second.IsPruned());
+                BOOST_CHECK_EQUAL(dbs[d]->HaveCoins(it->first), !it->second.IsPruned());
+                BOOST_CHECK(coins == it->second);
+            }
+        }
+    }
+
+    // Convert the databases to the other layout and back
+    for (unsigned int i = 0; i < 2; i++) {
+        BOOST_CHECK(dbByTx.SetLayout(!dbByTx.IsByOutpoint()));
+        BOOST_CHECK(dbByOutpoint.SetLayout(!dbByOutpoint.IsByOutpoint()));
+        for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+            CCoins coinsByTx, coinsByOutpoint;
+            BOOST_CHECK_EQUAL(dbByTx.GetCoins(it->first, coinsByTx), !it->second.IsPruned());
+            BOOST_CHECK_EQUAL(dbByOutpoint.GetCoins(it->first, coinsByOutpoint), !it->second.IsPruned());
+            BOOST_CHECK(coinsByTx == it->second);
+            BOOST_CHECK(coinsByOutpoint == it->second);
+        }
+    }
+    BOOST_CHECK(!dbByTx.IsByOutpoint());
+    BOOST_CHECK(dbByOutpoint.IsByOutpoint());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "primitives/block.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +47,84 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(xevan_multi)
+{
+    // Big enough to take the threaded path, mixing legacy and v4+ headers
+    std::vector<CBlockHeader> vHeaders(XEVAN_MULTI_MIN_PARALLEL * 2 + 3);
+    for (unsigned int i = 0; i < vHeaders.size(); i++) {
+        vHeaders[i].nVersion = (i % 5 == 0) ? 4 : 3;
+        vHeaders[i].nTime = 1500000000 + i;
+        vHeaders[i].nBits = 0x1e0ffff0;
+        vHeaders[i].nNonce = i * 7919;
+    }
+
+    std::vector<uint256> vHashes;
+    GetBlockHeaderHashes(vHeaders, vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHashes[i] == vHeaders[i].GetHash());
+
+    std::vector<uint256> vXevan(vHeaders.size());
+    XEVAN_Multi(&vHeaders[0], vHeaders.size(), &vXevan[0]);
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vXevan[i] == XEVAN(BEGIN(vHeaders[i].nVersion), END(vHeaders[i].nNonce)));
+}
+
+BOOST_AUTO_TEST_CASE(block_header_hash_cache)
+{
+    CBlockHeader header;
+    header.nVersion = 3;
+    header.nTime = 1500000000;
+    header.nBits = 0x1e0ffff0;
+
+    uint64_t nXevanBefore = nXevanHashCount;
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK_EQUAL(nXevanHashCount - nXevanBefore, 1U);
+
+    // Mutating any header field must invalidate the cached hash
+    header.nNonce++;
+    CBlockHeader fresh;
+    fresh.nVersion = header.nVersion;
+    fresh.nTime = header.nTime;
+    fresh.nBits = header.nBits;
+    fresh.nNonce = header.nNonce;
+    BOOST_CHECK(header.GetHash() != hash);
+    BOOST_CHECK(header.GetHash() == fresh.GetHash());
+
+    // Copies carry the cache along
+    CBlock block(header);
+    BOOST_CHECK(block.GetHash() == fresh.GetHash());
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == fresh.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1, 2, 3, 4, 5, 6, 7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    static const unsigned char t2[2] = {16, 17};
+    hasher.Write(t2, 2);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x4bc1b3f0968dd39cull);
+    static const unsigned char t3[9] = {18, 19, 20, 21, 22, 23, 24, 25, 26};
+    hasher.Write(t3, 9);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x2f2e6163076bcfadull);
+    static const unsigned char t4[5] = {27, 28, 29, 30, 31};
+    hasher.Write(t4, 5);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceull);
+    hasher.Write(0x2726252423222120ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x0e3ea96b5304a7d0ull);
+    hasher.Write(0x2F2E2D2C2B2A2928ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xe612a3cb9ecba951ull);
+
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
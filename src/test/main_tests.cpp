@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "kernel.h"
 #include "main.h"
 
 #include <boost/test/unit_test.hpp>
@@ -48,4 +49,26 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(stake_kernel_hasher_test)
+{
+    CDataStream ssUniqueID(SER_NETWORK, 0);
+    ssUniqueID << (unsigned int)1 << uint256("0x7f3ae1c2d4b5e6f708192a3b4c5d6e7f8091a2b3c4d5e6f708192a3b4c5d6e7f");
+    uint64_t nStakeModifier = 0x0123456789abcdefULL;
+    unsigned int nTimeBlockFrom = 1530000000;
+
+    uint256 bnTarget;
+    bnTarget.SetCompact(0x1e0fffff);
+
+    // a precomputed kernel hasher must give the same proof hash as the full kernel for every time slot
+    CHashWriter ssKernel = GetStakeKernelHasher(ssUniqueID, nStakeModifier, nTimeBlockFrom);
+    for (unsigned int nTimeTx = nTimeBlockFrom + 3600; nTimeTx < nTimeBlockFrom + 3600 + STAKE_HASH_DRIFT; nTimeTx++) {
+        uint256 hashStream, hashKernel;
+        unsigned int nTime = nTimeTx;
+        bool fStream = CheckStake(ssUniqueID, 1000 * COIN, nStakeModifier, bnTarget, nTimeBlockFrom, nTime, hashStream);
+        bool fKernel = CheckStake(ssKernel, 1000 * COIN, bnTarget, nTimeTx, hashKernel);
+        BOOST_CHECK(hashStream == hashKernel);
+        BOOST_CHECK(fStream == fKernel);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "timedata.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define MASTERNODES_CHAIN_LENGTH 200
+#define MASTERNODES_LIST_SIZE 30
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+static CMasternode CreateMasternode(unsigned int n)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(n + 1, n % 2));
+    mn.sigTime = GetAdjustedTime() - 24 * 60 * 60;
+    mn.lastPing.vin = mn.vin;
+    mn.lastPing.sigTime = GetAdjustedTime();
+    mn.cacheInputAge = 1000;
+    mn.cacheInputAgeBlock = MASTERNODES_CHAIN_LENGTH - 1;
+    mn.unitTest = true;
+    return mn;
+}
+
+// the ranking as it was done before the scores were cached: one CalculateScore call per Masternode, sorted high to low
+static std::vector<COutPoint> GetExpectedRanking(const std::vector<CMasternode>& vMasternodes, int64_t nBlockHeight)
+{
+    std::vector<std::pair<uint256, COutPoint> > vScores;
+    BOOST_FOREACH (CMasternode mn, vMasternodes)
+        vScores.push_back(std::make_pair(mn.CalculateScore(1, nBlockHeight), mn.vin.prevout));
+    sort(vScores.begin(), vScores.end(), std::greater<std::pair<uint256, COutPoint> >());
+
+    std::vector<COutPoint> vRanking;
+    for (unsigned int i = 0; i < vScores.size(); i++)
+        vRanking.push_back(vScores[i].second);
+    return vRanking;
+}
+
+static void CheckRanking(CMasternodeMan& manager, const std::vector<CMasternode>& vMasternodes, int64_t nBlockHeight)
+{
+    std::vector<COutPoint> vRanking = GetExpectedRanking(vMasternodes, nBlockHeight);
+    for (unsigned int i = 0; i < vRanking.size(); i++) {
+        BOOST_CHECK_EQUAL(manager.GetMasternodeRank(CTxIn(vRanking[i]), nBlockHeight), (int)i + 1);
+        CMasternode* pmn = manager.GetMasternodeByRank(i + 1, nBlockHeight);
+        BOOST_CHECK(pmn != NULL && pmn->vin.prevout == vRanking[i]);
+    }
+    BOOST_CHECK(manager.GetMasternodeByRank(vRanking.size() + 1, nBlockHeight) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_rank_test)
+{
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+
+    std::vector<uint256> vHashes(MASTERNODES_CHAIN_LENGTH);
+    std::vector<CBlockIndex> vBlocks(MASTERNODES_CHAIN_LENGTH);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = i;
+        vBlocks[i].nHeight = i;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].BuildSkip();
+    }
+    chainActive.SetTip(&vBlocks.back());
+
+    CMasternodeMan manager;
+    std::vector<CMasternode> vMasternodes;
+    for (unsigned int i = 0; i < MASTERNODES_LIST_SIZE; i++) {
+        CMasternode mn = CreateMasternode(i);
+        BOOST_CHECK(manager.Add(mn));
+        vMasternodes.push_back(mn);
+    }
+    BOOST_CHECK_EQUAL(manager.CountEnabled(), MASTERNODES_LIST_SIZE);
+
+    // the cached scores order by the full score, the same as the per-call path
+    for (int64_t nBlockHeight = 100; nBlockHeight <= MASTERNODES_CHAIN_LENGTH; nBlockHeight += 25)
+        CheckRanking(manager, vMasternodes, nBlockHeight);
+
+    // the payment queue picks the highest per-call score among the tenth of the list unpaid for the longest
+    int nBlockHeight = MASTERNODES_CHAIN_LENGTH - 10;
+    std::vector<std::pair<int64_t, COutPoint> > vLastPaid;
+    BOOST_FOREACH (CMasternode mn, vMasternodes)
+        vLastPaid.push_back(std::make_pair(mn.SecondsSincePayment(), mn.vin.prevout));
+    sort(vLastPaid.begin(), vLastPaid.end(), std::greater<std::pair<int64_t, COutPoint> >());
+
+    uint256 nHigh = 0;
+    COutPoint outpointBest;
+    for (unsigned int i = 0; i < MASTERNODES_LIST_SIZE / 10; i++) {
+        CMasternode mn = *manager.Find(CTxIn(vLastPaid[i].second));
+        uint256 n = mn.CalculateScore(1, nBlockHeight - 100);
+        if (n > nHigh) {
+            nHigh = n;
+            outpointBest = mn.vin.prevout;
+        }
+    }
+
+    int nCount = 0;
+    CMasternode* pmnPayee = manager.GetNextMasternodeInQueueForPayment(nBlockHeight, true, nCount);
+    BOOST_CHECK_EQUAL(nCount, MASTERNODES_LIST_SIZE);
+    BOOST_CHECK(pmnPayee != NULL && pmnPayee->vin.prevout == outpointBest);
+
+    // a Masternode added after the scores were cached is inserted at its place in the ranking
+    for (unsigned int i = MASTERNODES_LIST_SIZE; i < MASTERNODES_LIST_SIZE + 5; i++) {
+        CMasternode mn = CreateMasternode(i);
+        BOOST_CHECK(manager.Add(mn));
+        vMasternodes.push_back(mn);
+        CheckRanking(manager, vMasternodes, MASTERNODES_CHAIN_LENGTH);
+    }
+
+    chainActive.SetTip(pindexOldTip);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
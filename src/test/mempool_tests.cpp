@@ -99,4 +99,166 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolPackageStatsTest)
+{
+    // Chain parent -> child -> grandchild, each paying a different fee
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 22000LL;
+
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild.GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+
+    // An unrelated transaction with a fee rate between the parent's and its package's
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 11000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 20000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 3000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 5000LL, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = testPool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = testPool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = testPool.mapTx.find(txGrandChild.GetHash());
+    uint64_t nParentSize = itParent->GetTxSize();
+    uint64_t nChainSize = nParentSize + itChild->GetTxSize() + itGrandChild->GetTxSize();
+
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nChainSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 24000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nChainSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 24000LL);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+
+    // Block assembly order: the parent+child package beats txOther, which
+    // beats the parent on its own
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = testPool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(it->GetTx().GetHash() == txChild.GetHash());
+    BOOST_CHECK((++it)->GetTx().GetHash() == txGrandChild.GetHash());
+    BOOST_CHECK((++it)->GetTx().GetHash() == txOther.GetHash());
+    BOOST_CHECK((++it)->GetTx().GetHash() == txParent.GetHash());
+
+    // Eviction order: the parent is protected by its descendants
+    CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator dit = testPool.mapTx.get<descendant_score>().begin();
+    BOOST_CHECK(dit->GetTx().GetHash() == txGrandChild.GetHash());
+
+    // Prioritising the grandchild updates the package fees of the whole chain
+    testPool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0.0, 2000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModifiedFee(), 5000LL);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 26000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 26000LL);
+
+    // The parent being mined leaves the rest of the chain with smaller packages
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    std::list<CTransaction> conflicts;
+    testPool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(testPool.size(), 3);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nChainSize - nParentSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 25000LL);
+    BOOST_CHECK(testPool.GetMemPoolParents(itChild).empty());
+
+    // Putting the parent back, as after a reorg, links it up again
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    std::vector<uint256> vHashUpdate;
+    vHashUpdate.push_back(txParent.GetHash());
+    testPool.UpdateTransactionsFromBlock(vHashUpdate);
+    itParent = testPool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 26000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 26000LL);
+
+    // Removing the child removes the grandchild and updates the parent
+    std::list<CTransaction> removed;
+    testPool.remove(txChild, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nParentSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 1000LL);
+    BOOST_CHECK(testPool.GetMemPoolChildren(itParent).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // A low fee parent with a high fee child, and an unrelated mid fee transaction
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000LL, 10, 0.0, 1));
+
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_1;
+    tx2.vin[0].prevout.hash = tx1.GetHash();
+    tx2.vin[0].prevout.n = 0;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 50000LL, 20, 0.0, 1));
+
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].scriptSig = CScript() << OP_3;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 5000LL, 30, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Nothing is removed while the pool fits
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.DynamicMemoryUsage()), 0);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    // The parent is protected by its child, so tx3 goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetEvictedCount(), 1);
+
+    // The rolling minimum fee is above the evicted transaction's fee rate
+    CFeeRate feeTx3(5000LL, ::GetSerializeSize(tx3, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), feeTx3.GetFeePerK() + 1000);
+
+    // Expiring the parent takes the child with it
+    BOOST_CHECK_EQUAL(pool.Expire(15), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.GetExpiredCount(), 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
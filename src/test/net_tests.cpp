@@ -0,0 +1,117 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+#include "net.h"
+#include "protocol.h"
+#include "serialize.h"
+#include "streams.h"
+
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(shared_message_test)
+{
+    std::vector<unsigned char> vPayload(1000, 0x5a);
+    CSerializeDataRef msg = MakeSharedMessage("block", vPayload);
+
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+
+    uint256 hash = Hash(ss.begin(), ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    std::vector<unsigned char> vRead;
+    ss >> vRead;
+    BOOST_CHECK(vRead == vPayload);
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_cache_test)
+{
+    uint256 hash1 = uint256(1), hash2 = uint256(2), hash3 = uint256(3);
+    CSerializeDataRef msg1 = MakeSharedMessage("block", std::vector<unsigned char>(1000));
+    CSerializeDataRef msg2 = MakeSharedMessage("block", std::vector<unsigned char>(1000));
+    CSerializeDataRef msg3 = MakeSharedMessage("block", std::vector<unsigned char>(1000));
+
+    // Room for two of the messages
+    CSharedMessageCache cache(2 * msg1->size() + 100);
+    cache.Insert(hash1, msg1);
+    cache.Insert(hash2, msg2);
+    BOOST_CHECK_EQUAL(cache.Count(), 2);
+    BOOST_CHECK_EQUAL(cache.Size(), msg1->size() + msg2->size());
+    BOOST_CHECK(cache.Get(hash1) == msg1);
+
+    // hash1 was used last, hash2 goes
+    cache.Insert(hash3, msg3);
+    BOOST_CHECK_EQUAL(cache.Count(), 2);
+    BOOST_CHECK(cache.Get(hash1) == msg1);
+    BOOST_CHECK(!cache.Get(hash2));
+    BOOST_CHECK(cache.Get(hash3) == msg3);
+
+    // A message larger than the cache is not kept
+    CSharedMessageCache small(100);
+    small.Insert(hash1, msg1);
+    BOOST_CHECK_EQUAL(small.Count(), 0);
+    BOOST_CHECK_EQUAL(small.Size(), 0);
+}
+
+#ifndef WIN32
+// Messages of the node's own and shared buffers arrive on the socket in the order they were pushed
+BOOST_AUTO_TEST_CASE(shared_message_send_test)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    std::vector<char> vExpected;
+    {
+        CAddress addr(CService("250.1.1.1", 8333));
+        CNode node(sv[0], addr, "", true);
+
+        CSerializeDataRef msgShared = MakeSharedMessage("block", std::vector<unsigned char>(5000, 0x11));
+        uint64_t nonce = 0x0102030405060708ULL;
+        node.PushSharedMessage(msgShared);
+        node.PushMessage("ping", nonce);
+        node.PushSharedMessage(msgShared);
+
+        CSerializeDataRef msgPing = MakeSharedMessage("ping", nonce);
+        vExpected.insert(vExpected.end(), msgShared->begin(), msgShared->end());
+        vExpected.insert(vExpected.end(), msgPing->begin(), msgPing->end());
+        vExpected.insert(vExpected.end(), msgShared->begin(), msgShared->end());
+
+        {
+            LOCK(node.cs_vSend);
+            SocketSendData(&node);
+            BOOST_CHECK(node.vSendMsg.empty());
+            BOOST_CHECK_EQUAL(node.nSendSize, 0);
+            BOOST_CHECK_EQUAL(node.nSendBytes, vExpected.size());
+        }
+        node.CloseSocketDisconnect();
+    }
+
+    std::vector<char> vReceived;
+    char buf[4096];
+    ssize_t nBytes;
+    while ((nBytes = recv(sv[1], buf, sizeof(buf), 0)) > 0)
+        vReceived.insert(vReceived.end(), buf, buf + nBytes);
+    close(sv[1]);
+
+    BOOST_CHECK(vReceived == vExpected);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "walletscan.h"
 
+#include "random.h"
+#include "txmempool.h"
+
+#include <list>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -21,6 +26,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -305,4 +312,166 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+// An exact subset among many coins is found without change, and the passes are counted
+BOOST_AUTO_TEST_CASE(coin_selection_bnb_tests)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+        for (int j = 0; j < 200; j++)
+            add_coin((1 + insecure_rand() % 100) * CENT);
+
+        CAmount nTarget = 0;
+        for (int j = 0; j < 5; j++)
+            nTarget += vCoins[insecure_rand() % 40 + 40 * j].Value();
+
+        CCoinSelectionStats statsBefore = wallet.GetCoinSelectionStats();
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, nTarget);
+        CCoinSelectionStats statsAfter = wallet.GetCoinSelectionStats();
+        BOOST_CHECK_EQUAL(statsAfter.nSelections, statsBefore.nSelections + 1);
+        BOOST_CHECK_EQUAL(statsAfter.nExact + statsAfter.nBnB, statsBefore.nExact + statsBefore.nBnB + 1);
+        BOOST_CHECK_EQUAL(statsAfter.nLastCandidates, vCoins.size());
+    }
+
+    // Whole cents can't add up to a target with an extra satoshi: the search ends without a
+    // subset, and the stochastic approximation picks the coins instead
+    empty_wallet();
+    for (int j = 0; j < 20; j++)
+        add_coin((2 * j + 1) * CENT);
+    CCoinSelectionStats statsBefore = wallet.GetCoinSelectionStats();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(20 * CENT + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GT(nValueRet, 20 * CENT + 1);
+    CCoinSelectionStats statsAfter = wallet.GetCoinSelectionStats();
+    BOOST_CHECK_EQUAL(statsAfter.nApproximate, statsBefore.nApproximate + 1);
+    BOOST_CHECK_EQUAL(statsAfter.nBnBExhausted, statsBefore.nBnBExhausted);
+    empty_wallet();
+}
+
+static bool has_output(const vector<COutput>& vAvailable, const uint256& hash, unsigned int n)
+{
+    BOOST_FOREACH(const COutput& output, vAvailable)
+        if (output.tx->GetHash() == hash && output.i == (int)n)
+            return true;
+    return false;
+}
+
+// The balances and available coins follow mempool changes that come without a
+// wallet event, and a full rebuild of the coin index gives the same results.
+BOOST_AUTO_TEST_CASE(coin_index_tests)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    CAmount nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    vector<COutput> vAvailable;
+
+    // A payment to us enters the mempool
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(2);
+    txFund.vout[0].nValue = 5 * COIN;
+    txFund.vout[0].scriptPubKey = scriptMine;
+    txFund.vout[1].nValue = 7 * COIN;
+    txFund.vout[1].scriptPubKey = scriptMine;
+    CTransaction fund(txFund);
+    mempool.addUnchecked(fund.GetHash(), CTxMemPoolEntry(fund, 0, 0, 0.0, 1));
+    pwalletMain->SyncTransaction(fund, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 12 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(has_output(vAvailable, fund.GetHash(), 0));
+    BOOST_CHECK(has_output(vAvailable, fund.GetHash(), 1));
+
+    // One of its outputs is spent in the mempool
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(fund.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN;
+    txSpend.vout[0].scriptPubKey = scriptOther;
+    CTransaction spend(txSpend);
+    mempool.addUnchecked(spend.GetHash(), CTxMemPoolEntry(spend, 0, 0, 0.0, 1));
+    pwalletMain->SyncTransaction(spend, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 7 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(!has_output(vAvailable, fund.GetHash(), 0));
+    BOOST_CHECK(has_output(vAvailable, fund.GetHash(), 1));
+
+    // The spend drops out of the mempool, the output is ours to spend again
+    list<CTransaction> removed;
+    mempool.remove(spend, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 12 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(has_output(vAvailable, fund.GetHash(), 0));
+
+    // A rebuild agrees
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 12 * COIN);
+
+    // The payment drops out as well
+    mempool.remove(fund, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(!has_output(vAvailable, fund.GetHash(), 0));
+    BOOST_CHECK(!has_output(vAvailable, fund.GetHash(), 1));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_scan_filter_tests)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(1);
+    txFund.vout[0].nValue = 1 * COIN;
+    txFund.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CWalletTx wtxFund(pwalletMain, txFund);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(pwalletMain->AddToWallet(wtxFund));
+    }
+
+    CWalletScanFilter filter;
+    pwalletMain->GetScanFilter(filter);
+
+    // Outputs to our key, in any of the forms the wallet recognizes
+    BOOST_CHECK(filter.MatchScript(GetScriptForDestination(key.GetPubKey().GetID())));
+    BOOST_CHECK(filter.MatchScript(CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG));
+    vector<CPubKey> vKeys;
+    vKeys.push_back(keyOther.GetPubKey());
+    vKeys.push_back(key.GetPubKey());
+    BOOST_CHECK(filter.MatchScript(GetScriptForMultisig(1, vKeys)));
+    BOOST_CHECK(!filter.MatchScript(GetScriptForDestination(keyOther.GetPubKey().GetID())));
+    BOOST_CHECK(!filter.MatchScript(CScript() << OP_RETURN));
+
+    // A transaction paying someone else matches if it spends a wallet transaction
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 1 * COIN;
+    txSpend.vout[0].scriptPubKey = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK(!filter.Match(txSpend));
+    txSpend.vin[0].prevout = COutPoint(wtxFund.GetHash(), 0);
+    BOOST_CHECK(filter.Match(txSpend));
+    BOOST_CHECK(filter.Match(txFund));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -17,6 +17,7 @@
 #include "wallet.h"
 #include "zbitwallet.h"
 #include "zbitchain.h"
+#include "zbitspendcache.h"
 
 using namespace libzerocoin;
 
@@ -88,6 +89,54 @@ BOOST_AUTO_TEST_CASE(bignum_basic_tests)
     BOOST_CHECK_MESSAGE(bn2 == bn, "CBigNum.setvch() or CBigNum.getvch() does not work correctly");
 }
 
+BOOST_AUTO_TEST_CASE(bignum_inplace_tests)
+{
+    CBigNum m, a, b;
+    m.SetHex(strHexModulus);
+    a.SetHex(str_a);
+    b.SetHex(str_b);
+
+    CBigNum c = a;
+    c.mul_mod_inplace(b, m);
+    BOOST_CHECK_MESSAGE(c == a.mul_mod(b, m), "CBigNum.mul_mod_inplace() does not match CBigNum.mul_mod()");
+
+    CBigNum d;
+    a.pow_mod_into(d, c, m);
+    BOOST_CHECK_MESSAGE(d == a.pow_mod(c, m), "CBigNum.pow_mod_into() does not match CBigNum.pow_mod()");
+    c.pow_mod_into(c, a, m);
+    BOOST_CHECK_MESSAGE(c == a.mul_mod(b, m).pow_mod(a, m), "CBigNum.pow_mod_into() does not work in place");
+
+    CBigNumMont mont(m);
+    BOOST_CHECK_MESSAGE(a.pow_mod(b, mont) == a.pow_mod(b, m), "CBigNum.pow_mod() with a Montgomery context does not match");
+
+    CBigNum e = std::move(d);
+    BOOST_CHECK_MESSAGE(e == a.pow_mod(a.mul_mod(b, m), m) && !d, "CBigNum move constructor does not work correctly");
+    d = std::move(e);
+    BOOST_CHECK_MESSAGE(d == a.pow_mod(a.mul_mod(b, m), m), "CBigNum move assignment does not work correctly");
+}
+
+BOOST_AUTO_TEST_CASE(multiexp_tests)
+{
+    libzerocoin::ZerocoinParams* params = Params().Zerocoin_Params(false);
+    const libzerocoin::IntegerGroupParams& group = params->accumulatorParams.accumulatorPoKCommitmentGroup;
+    libzerocoin::FixedBaseComb comb(group.g, group.modulus, 600);
+
+    for (int i = 0; i < 10; i++) {
+        CBigNum e1 = CBigNum::randBignum(CBigNum(2).pow(64 * i + 1));
+        CBigNum e2 = CBigNum(0) - CBigNum::randBignum(group.groupOrder);
+        CBigNum base = CBigNum::randBignum(group.modulus);
+
+        CBigNum expected = group.g.pow_mod(e1, group.modulus);
+        BOOST_CHECK_MESSAGE(comb.pow_mod(e1) == expected, "comb exponentiation does not match pow_mod");
+        BOOST_CHECK_MESSAGE(comb.pow_mod(e2) == group.g.pow_mod(e2, group.modulus), "comb exponentiation with negative exponent does not match pow_mod");
+
+        expected = expected.mul_mod(base.pow_mod(e2, group.modulus), group.modulus);
+        BOOST_CHECK_MESSAGE(libzerocoin::MultiExp({{group.g, e1}, {base, e2}}, group.modulus) == expected, "multi-exponentiation does not match pow_mod");
+        BOOST_CHECK_MESSAGE(group.pow_gh(e1, e2, group.modulus) == group.g.pow_mod(e1, group.modulus).mul_mod(group.h.pow_mod(e2, group.modulus), group.modulus),
+                            "pow_gh does not match pow_mod");
+    }
+}
+
 //ZQ_ONE mints
 std::string rawTx1 = "0100000001983d5fd91685bb726c0ebc3676f89101b16e663fd896fea53e19972b95054c49000000006a473044022010fbec3e78f9c46e58193d481caff715ceb984df44671d30a2c0bde95c54055f0220446a97d9340da690eaf2658e5b2bf6a0add06f1ae3f1b40f37614c7079ce450d012103cb666bd0f32b71cbf4f32e95fa58e05cd83869ac101435fcb8acee99123ccd1dffffffff0200e1f5050000000086c10280004c80c3a01f94e71662f2ae8bfcd88dfc5b5e717136facd6538829db0c7f01e5fd793cccae7aa1958564518e0223d6d9ce15b1e38e757583546e3b9a3f85bd14408120cd5192a901bb52152e8759fdd194df230d78477706d0e412a66398f330be38a23540d12ab147e9fb19224913f3fe552ae6a587fb30a68743e52577150ff73042c0f0d8f000000001976a914d6042025bd1fff4da5da5c432d85d82b3f26a01688ac00000000";
 std::string rawTxpub1 = "473ff507157523e74680ab37f586aae52e53f3f912492b19f7e14ab120d54238ae30b338f39662a410e6d707784d730f24d19dd9f75e85221b51b902a19d50c120844d15bf8a3b9e346355857e7381e5be19c6d3d22e01845565819aae7cacc93d75f1ef0c7b09d823865cdfa3671715e5bfc8dd8fc8baef26216e7941fa0c3";
@@ -146,6 +195,43 @@ BOOST_AUTO_TEST_CASE(checkzerocoinmint_test)
     BOOST_CHECK(fFoundMint);
 }
 
+BOOST_AUTO_TEST_CASE(block_pubcoins_test)
+{
+    CBlock block;
+    for (auto& raw : vecRawMints) {
+        CTransaction tx;
+        BOOST_CHECK(DecodeHexTx(tx, raw.first));
+        block.vtx.emplace_back(tx);
+    }
+
+    std::list<PublicCoin> listPubcoins;
+    BOOST_CHECK(BlockToPubcoinList(block, listPubcoins, true));
+
+    CBlockPubcoins pubcoins;
+    BOOST_CHECK(BlockToPubcoins(block, pubcoins));
+    BOOST_CHECK(pubcoins.mapInvalid.empty());
+
+    //the index holds the same pubcoins as the block, grouped by denomination
+    size_t nIndexed = 0;
+    for (auto& it : pubcoins.mapValid) {
+        for (const CBigNum& bnValue : it.second) {
+            bool fFound = false;
+            for (const PublicCoin& pubcoin : listPubcoins)
+                fFound |= pubcoin.getValue() == bnValue && pubcoin.getDenomination() == it.first;
+            BOOST_CHECK(fFound);
+            ++nIndexed;
+        }
+    }
+    BOOST_CHECK_EQUAL(nIndexed, listPubcoins.size());
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << pubcoins;
+    CBlockPubcoins pubcoins2;
+    ss >> pubcoins2;
+    BOOST_CHECK(pubcoins2.mapValid == pubcoins.mapValid);
+    BOOST_CHECK(pubcoins2.mapInvalid.empty());
+}
+
 bool CheckZerocoinSpendNoDB(const CTransaction tx, string& strError)
 {
     //max needed non-mint outputs should be 2 - one for redemption address and a possible 2nd for change
@@ -334,6 +420,21 @@ BOOST_AUTO_TEST_CASE(checkzerocoinspend_test)
     CoinSpend spend1(Params().Zerocoin_Params(true), Params().Zerocoin_Params(false), serializedCoinSpend);
     BOOST_CHECK_MESSAGE(spend1.Verify(accumulator), "Failed deserialized check of CoinSpend");
 
+    // The deferred check used for parallel verification gives the same answer
+    std::shared_ptr<const CoinSpend> pspend = std::make_shared<const CoinSpend>(spend1);
+    CZerocoinSpendCheck check(pspend, std::make_shared<const Accumulator>(accumulator));
+    BOOST_CHECK_MESSAGE(check(), "CZerocoinSpendCheck failed on a valid spend");
+    CZerocoinSpendCheck checkWrongDenom(pspend, std::make_shared<const Accumulator>(Params().Zerocoin_Params(false), CoinDenomination::ZQ_FIVE));
+    BOOST_CHECK_MESSAGE(!checkWrongDenom(), "CZerocoinSpendCheck passed with an accumulator of the wrong denomination");
+
+    // A successful check with a cache key lands in the verified spend cache
+    uint256 hashCacheKey = GetZerocoinSpendCacheKey(spend1, accumulator.getValue(), false);
+    BOOST_CHECK(hashCacheKey != GetZerocoinSpendCacheKey(spend1, accumulator.getValue(), true));
+    BOOST_CHECK(!IsZerocoinSpendCached(hashCacheKey));
+    CZerocoinSpendCheck checkCached(pspend, std::make_shared<const Accumulator>(accumulator), hashCacheKey);
+    BOOST_CHECK(checkCached());
+    BOOST_CHECK(IsZerocoinSpendCached(hashCacheKey));
+
     CScript script;
     CTxOut txOut(1 * COIN, script);
 
@@ -495,6 +596,78 @@ BOOST_AUTO_TEST_CASE(checksum_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(checksum_index_tests)
+{
+    cout << "Running checksum_index_tests\n";
+
+    //a chain above the zerocoin start height whose checkpoint changes every 10 blocks
+    int nHeightStart = (Params().Zerocoin_StartHeight() + 9) / 10 * 10;
+    std::vector<CBlockIndex> vIndex(45);
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = nHeightStart + i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : nullptr;
+        vIndex[i].nAccumulatorCheckpoint = uint256(1 + i / 10);
+    }
+
+    CAccumulatorChecksumIndex index;
+    for (auto& block : vIndex)
+        index.SetTip(&block);
+
+    for (unsigned int i = 0; i < vIndex.size(); i += 10) {
+        uint32_t nChecksum = ParseChecksum(vIndex[i].nAccumulatorCheckpoint, CoinDenomination::ZQ_FIVE_THOUSAND);
+        BOOST_CHECK_MESSAGE(index.GetHeight(nChecksum, CoinDenomination::ZQ_FIVE_THOUSAND) == vIndex[i].nHeight, "checksum height not found");
+    }
+
+    //disconnecting back below the last checkpoint forgets it, a jump rebuilds the index
+    uint32_t nChecksumLast = ParseChecksum(vIndex[40].nAccumulatorCheckpoint, CoinDenomination::ZQ_FIVE_THOUSAND);
+    for (int i = 44; i >= 39; i--)
+        index.SetTip(&vIndex[i]);
+    BOOST_CHECK(index.GetHeight(nChecksumLast, CoinDenomination::ZQ_FIVE_THOUSAND) == 0);
+    index.SetTip(&vIndex[44]);
+    BOOST_CHECK(index.GetHeight(nChecksumLast, CoinDenomination::ZQ_FIVE_THOUSAND) == vIndex[40].nHeight);
+    index.SetTip(&vIndex[5]);
+    BOOST_CHECK(index.GetHeight(nChecksumLast, CoinDenomination::ZQ_FIVE_THOUSAND) == 0);
+    BOOST_CHECK(index.Size() == zerocoinDenomList.size());
+}
+
+BOOST_AUTO_TEST_CASE(witness_data_serialization)
+{
+    CoinWitnessData data;
+    BOOST_CHECK(data.IsNull());
+    BOOST_CHECK(!IsAccumulatorWitnessInChain(data));
+
+    data.denom = libzerocoin::CoinDenomination::ZQ_FIFTY;
+    data.bnPubcoin = CBigNum(123456789);
+    data.nHeightMintAdded = 1050013;
+    data.nHeightAccStart = 1050010;
+    data.nHeightNext = 1050040;
+    data.nMintsAdded = 12;
+    data.nCheckpointsAdded = 3;
+    data.fDoubleCounted = true;
+    data.hashLastBlock = uint256("a3219ef1abcdef00101029f3aaaaaeeeffffffffbbbbbbbb11111111eeeeeeee");
+    data.bnWitness = CBigNum(987654321);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << data;
+    CoinWitnessData data2;
+    ss >> data2;
+
+    BOOST_CHECK(!data2.IsNull());
+    BOOST_CHECK(data2.denom == data.denom);
+    BOOST_CHECK(data2.bnPubcoin == data.bnPubcoin);
+    BOOST_CHECK_EQUAL(data2.nHeightMintAdded, data.nHeightMintAdded);
+    BOOST_CHECK_EQUAL(data2.nHeightAccStart, data.nHeightAccStart);
+    BOOST_CHECK_EQUAL(data2.nHeightNext, data.nHeightNext);
+    BOOST_CHECK_EQUAL(data2.nMintsAdded, data.nMintsAdded);
+    BOOST_CHECK_EQUAL(data2.nCheckpointsAdded, data.nCheckpointsAdded);
+    BOOST_CHECK(data2.fDoubleCounted);
+    BOOST_CHECK(data2.hashLastBlock == data.hashLastBlock);
+    BOOST_CHECK(data2.bnWitness == data.bnWitness);
+
+    //a witness whose last block is unknown was reorged away and has to be rolled back
+    BOOST_CHECK(!IsAccumulatorWitnessInChain(data2));
+}
+
 BOOST_AUTO_TEST_CASE(test_checkpoints)
 {
     BOOST_CHECK_MESSAGE(AccumulatorCheckpoints::LoadCheckpoints("main"), "failed to load checkpoints");
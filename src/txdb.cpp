@@ -10,6 +10,7 @@
 #include "pow.h"
 #include "uint256.h"
 #include "accumulators.h"
+#include "ui_interface.h"
 
 #include <stdint.h>
 
@@ -18,6 +19,119 @@
 using namespace std;
 using namespace libzerocoin;
 
+namespace
+{
+/** Key of a coins record in the per outpoint layout: 'C' + txid + VARINT(n) */
+class CCoinsOutputKey
+{
+public:
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutputKey() : txid(0), n(0) {}
+    CCoinsOutputKey(const uint256& txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        char chType = 'C';
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Value of a coins record in the per outpoint layout
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode), with nHeight * 4 + (fCoinStake ? 2 : 0) + (fCoinBase ? 1 : 0)
+ * - the CTxOut (via CTxOutCompressor)
+ */
+class CCoinsOutputRecord
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    int nVersion;
+    CTxOut txout;
+
+    CCoinsOutputRecord() : fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
+    CCoinsOutputRecord(const CCoins& coins, unsigned int nPos) : fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake),
+                                                                nHeight(coins.nHeight), nVersion(coins.nVersion), txout(coins.vout[nPos]) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(this->nVersion));
+        unsigned int nCode = nHeight * 4 + (fCoinStake ? 2 : 0) + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            fCoinBase = nCode & 1;
+            fCoinStake = (nCode & 2) != 0;
+            nHeight = nCode / 4;
+        }
+        CTxOutCompressor txoutCompressor(txout);
+        READWRITE(txoutCompressor);
+    }
+
+    //! add this output to the coins of its transaction
+    void AddTo(CCoins& coins, unsigned int nPos) const
+    {
+        coins.fCoinBase = fCoinBase;
+        coins.fCoinStake = fCoinStake;
+        coins.nHeight = nHeight;
+        coins.nVersion = nVersion;
+        if (coins.vout.size() <= nPos)
+            coins.vout.resize(nPos + 1);
+        coins.vout[nPos] = txout;
+    }
+};
+
+/** Whether the cursor points at a record of the given type, and if so the txid it belongs to */
+bool static CursorCoinsRecord(leveldb::Iterator* pcursor, char chType, uint256& txid)
+{
+    if (!pcursor->Valid())
+        return false;
+    leveldb::Slice slKey = pcursor->key();
+    if (slKey.size() < 1 + sizeof(uint256) || slKey[0] != chType)
+        return false;
+    memcpy(txid.begin(), slKey.data() + 1, sizeof(uint256));
+    return true;
+}
+
+/**
+ * Read the per outpoint records of the transaction the cursor points at, leaving the
+ * cursor at the first record past them. Returns the serialized size of the records.
+ */
+size_t static ReadCoinsOutputs(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins)
+{
+    size_t nSize = 0;
+    coins.Clear();
+    uint256 txidRecord;
+    while (CursorCoinsRecord(pcursor, 'C', txidRecord) && txidRecord == txid) {
+        leveldb::Slice slKey = pcursor->key();
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutputKey key;
+        CCoinsOutputRecord record;
+        ssKey >> key;
+        ssValue >> record;
+        record.AddTo(coins, key.n);
+        nSize += slKey.size() + slValue.size();
+        pcursor->Next();
+    }
+    return nSize;
+}
+}
+
 void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
 {
     if (coins.IsPruned())
@@ -26,6 +140,38 @@ void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCo
         batch.Write(make_pair('c', hash), coins);
 }
 
+void static BatchWriteCoinsOutput(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins, unsigned int nPos)
+{
+    if (nPos < coins.vout.size() && !coins.vout[nPos].IsNull())
+        batch.Write(CCoinsOutputKey(hash, nPos), CCoinsOutputRecord(coins, nPos));
+    else
+        batch.Erase(CCoinsOutputKey(hash, nPos));
+}
+
+/** Write the outputs of a cache entry that differ from the database, returns how many were written */
+size_t static BatchWriteCoinsOutputs(CLevelDBBatch& batch, const uint256& hash, const CCoinsCacheEntry& entry)
+{
+    size_t nWritten = 0;
+    const CCoins& coins = entry.coins;
+    if (entry.flags & CCoinsCacheEntry::FRESH) {
+        // The database has no records for this transaction
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                BatchWriteCoinsOutput(batch, hash, coins, i);
+                nWritten++;
+            }
+        }
+        return nWritten;
+    }
+    for (unsigned int i = 0; i < entry.changed.End(); i++) {
+        if (entry.changed.IsSet(i)) {
+            BatchWriteCoinsOutput(batch, hash, coins, i);
+            nWritten++;
+        }
+    }
+    return nWritten;
+}
+
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
     batch.Write('B', hash);
@@ -33,16 +179,38 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
 {
+    char chLayout;
+    fByOutpoint = db.Read('L', chLayout) && chLayout == '1';
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    if (!fByOutpoint)
+        return db.Read(make_pair('c', txid), coins);
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinsOutputKey(txid, 0);
+    pcursor->Seek(ssKeySet.str());
+    try {
+        ReadCoinsOutputs(pcursor.get(), txid, coins);
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return !coins.vout.empty();
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    if (!fByOutpoint)
+        return db.Exists(make_pair('c', txid));
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinsOutputKey(txid, 0);
+    pcursor->Seek(ssKeySet.str());
+    uint256 txidRecord;
+    return CursorCoinsRecord(pcursor.get(), 'C', txidRecord) && txidRecord == txid;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -53,27 +221,109 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
 {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
+    size_t outputs = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            if (fByOutpoint)
+                outputs += BatchWriteCoinsOutputs(batch, it->first, it->second);
+            else
+                BatchWriteCoins(batch, it->first, it->second.coins);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            it++;
+        }
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    if (fByOutpoint)
+        LogPrint("coindb", "Committing %u changed outputs of %u changed transactions (out of %u) to coin database...\n", (unsigned int)outputs, (unsigned int)changed, (unsigned int)count);
+    else
+        LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::SetLayout(bool fByOutpointIn)
+{
+    char chLayout;
+    if (db.Read('L', chLayout) && (chLayout == '1') == fByOutpointIn) {
+        fByOutpoint = fByOutpointIn;
+        return true;
+    }
+
+    // Until every record is converted the layout is unknown, so that a restart resumes
+    // the conversion whichever layout is requested then.
+    if (!db.Erase('L', true))
+        return false;
+
+    char chFrom = fByOutpointIn ? 'c' : 'C';
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::string(1, chFrom));
+
+    uint256 txid;
+    if (CursorCoinsRecord(pcursor.get(), chFrom, txid)) {
+        LogPrintf("Converting the chainstate to one record per %s...\n", fByOutpointIn ? "outpoint" : "transaction");
+        uiInterface.ShowProgress(_("Converting chainstate database..."), 0);
+    }
+
+    size_t nTransactions = 0;
+    while (CursorCoinsRecord(pcursor.get(), chFrom, txid)) {
+        CLevelDBBatch batch;
+        size_t nBatch = 0;
+        try {
+            while (nBatch < COINS_LAYOUT_CONVERT_BATCH && CursorCoinsRecord(pcursor.get(), chFrom, txid)) {
+                boost::this_thread::interruption_point();
+                CCoins coins;
+                if (fByOutpointIn) {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                    ssValue >> coins;
+                    batch.Erase(make_pair('c', txid));
+                    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                        if (!coins.vout[i].IsNull())
+                            batch.Write(CCoinsOutputKey(txid, i), CCoinsOutputRecord(coins, i));
+                    }
+                    pcursor->Next();
+                } else {
+                    ReadCoinsOutputs(pcursor.get(), txid, coins);
+                    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                        if (!coins.vout[i].IsNull())
+                            batch.Erase(CCoinsOutputKey(txid, i));
+                    }
+                    batch.Write(make_pair('c', txid), coins);
+                }
+                nBatch++;
+            }
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (!db.WriteBatch(batch))
+            return false;
+        nTransactions += nBatch;
+        // txids are uniformly distributed, the first key byte tells how far along we are
+        uiInterface.ShowProgress(_("Converting chainstate database..."), std::min(99, (int)*txid.begin() * 100 / 256));
+    }
+
+    if (nTransactions > 0) {
+        LogPrintf("Converted the coins of %u transactions\n", (unsigned int)nTransactions);
+        uiInterface.ShowProgress("", 100);
+    }
+    if (!db.Write('L', fByOutpointIn ? '1' : '0', true))
+        return false;
+    fByOutpoint = fByOutpointIn;
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -117,57 +367,78 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+void static HashCoinsStats(CHashWriter& ss, CCoinsStats& stats, const uint256& txhash, const CCoins& coins)
+{
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i + 1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
 
+    // Both layouts hash the coins of each transaction the same way, so the result
+    // does not depend on the layout
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+    stats.nTotalAmount = 0;
+    if (fByOutpoint) {
+        pcursor->Seek(std::string(1, 'C'));
+        uint256 txhash;
+        while (CursorCoinsRecord(pcursor.get(), 'C', txhash)) {
+            boost::this_thread::interruption_point();
+            try {
                 CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                stats.nSerializedSize += ReadCoinsOutputs(pcursor.get(), txhash, coins);
+                HashCoinsStats(ss, stats, txhash, coins);
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+    } else {
+        pcursor->SeekToFirst();
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType == 'c') {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                    CCoins coins;
+                    ssValue >> coins;
+                    uint256 txhash;
+                    ssKey >> txhash;
+                    HashCoinsStats(ss, stats, txhash, coins);
+                    stats.nSerializedSize += 32 + slValue.size();
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                pcursor->Next();
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
-            pcursor->Next();
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -216,74 +487,110 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
+    // The hash each entry is keyed under was computed when it was written, so
+    // it is trusted unless -rehashblockindex asks for it to be recomputed.
+    bool fRehash = GetBoolArg("-rehashblockindex", DEFAULT_REHASH_BLOCK_INDEX);
+
     // Load mapBlockIndex
     uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<uint256> vHashes;
+    std::vector<uint256> vKeyHashes;
+    bool fDone = false;
+    while (!fDone) {
+        // Read a batch of entries first so that legacy XEVAN headers can be hashed together
+        vDiskIndex.clear();
+        vHeaders.clear();
+        vKeyHashes.clear();
+        while (vDiskIndex.size() < BLOCK_INDEX_LOAD_BATCH) {
+            boost::this_thread::interruption_point();
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 'b') {
+                    fDone = true;
+                    break; // finished loading block index
+                }
+                uint256 hash;
+                ssKey >> hash;
+                vKeyHashes.push_back(hash);
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
                 CDiskBlockIndex diskindex;
                 ssValue >> diskindex;
+                vDiskIndex.push_back(diskindex);
+                if (fRehash)
+                    vHeaders.push_back(diskindex.GetBlockHeader());
+                pcursor->Next();
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
 
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        if (fRehash) {
+            GetBlockHeaderHashes(vHeaders, vHashes);
+            for (unsigned int i = 0; i < vHashes.size(); i++) {
+                if (vHashes[i] != vKeyHashes[i])
+                    return error("%s : block index entry %s hashes to %s", __func__, vKeyHashes[i].ToString(), vHashes[i].ToString());
+            }
+        }
 
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any checkpoints that exist before v2 zBIT. The accumulator is invalid for v1 and not used.
-                    if (pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+        for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vKeyHashes[i]);
+            pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //zerocoin
+            pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+            pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
+            pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+            pindexNew->nStakeTime = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+            if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
+                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
+                    return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            }
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
-                }
+            //populate accumulator checksum map in memory
+            if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
+                //Don't load any checkpoints that exist before v2 zBIT. The accumulator is invalid for v1 and not used.
+                if (pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
+                    LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+                nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
 
@@ -424,3 +731,18 @@ bool CZerocoinDB::EraseAccumulatorValue(const uint32_t& nChecksum)
     LogPrint("zero", "%s : checksum:%d\n", __func__, nChecksum);
     return Erase(make_pair('2', nChecksum));
 }
+
+bool CZerocoinDB::WriteBlockPubcoins(const uint256& hashBlock, const CBlockPubcoins& pubcoins)
+{
+    return Write(make_pair('b', hashBlock), pubcoins);
+}
+
+bool CZerocoinDB::ReadBlockPubcoins(const uint256& hashBlock, CBlockPubcoins& pubcoins)
+{
+    return Read(make_pair('b', hashBlock), pubcoins);
+}
+
+bool CZerocoinDB::EraseBlockPubcoins(const uint256& hashBlock)
+{
+    return Erase(make_pair('b', hashBlock));
+}
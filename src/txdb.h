@@ -25,12 +25,32 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Number of block index entries read before their hashes are computed as one batch
+static const size_t BLOCK_INDEX_LOAD_BATCH = 4096;
+//! -rehashblockindex default: recompute every block index hash on startup instead of trusting the DB key
+static const bool DEFAULT_REHASH_BLOCK_INDEX = false;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+//! -coinsbyoutpoint default: keep one chainstate record per transaction
+static const bool DEFAULT_COINS_BY_OUTPOINT = false;
+//! Number of transactions converted per database batch when the chainstate layout is changed
+static const size_t COINS_LAYOUT_CONVERT_BATCH = 10000;
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * The coins are stored in one of two layouts:
+ * - per transaction: 'c' + txid -> CCoins
+ * - per outpoint: 'C' + txid + VARINT(n) -> one unspent output, along with the
+ *   version, height and coinbase/coinstake flags of its transaction
+ * In the per outpoint layout, BatchWrite only writes or erases the outputs the cache
+ * marked as changed, so spending one output of a large transaction no longer rewrites
+ * all of its remaining outputs.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    bool fByOutpoint;
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
@@ -38,8 +58,18 @@ public:
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Whether the coins are stored with one record per outpoint
+    bool IsByOutpoint() const { return fByOutpoint; }
+
+    /**
+     * Convert the stored coins to the requested layout, if they are not in it already.
+     * Every batch converts whole transactions, an interrupted conversion is completed
+     * the next time this is called, for whichever layout is requested then.
+     */
+    bool SetLayout(bool fByOutpointIn);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -94,6 +124,9 @@ public:
     bool WriteAccumulatorValue(const uint32_t& nChecksum, const CBigNum& bnValue);
     bool ReadAccumulatorValue(const uint32_t& nChecksum, CBigNum& bnValue);
     bool EraseAccumulatorValue(const uint32_t& nChecksum);
+    bool WriteBlockPubcoins(const uint256& hashBlock, const CBlockPubcoins& pubcoins);
+    bool ReadBlockPubcoins(const uint256& hashBlock, CBlockPubcoins& pubcoins);
+    bool EraseBlockPubcoins(const uint256& hashBlock);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70922; //70914
+static const int PROTOCOL_VERSION = 70924; //70914
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -39,5 +39,11 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "cmpctblock", "getblocktxn" and "blocktxn" messages and MSG_CMPCT_BLOCK getdata start with this version
+static const int COMPACT_BLOCKS_VERSION = 70923;
+
+//! "getheaders" is answered with "headers" instead of block invs starting with this version
+static const int HEADERS_FIRST_VERSION = 70924;
+
 
 #endif // BITCOIN_VERSION_H
@@ -24,6 +24,7 @@
 #include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "walletscan.h"
 #include "zbitchain.h"
 
 #include "denomination_functions.h"
@@ -64,14 +65,6 @@ CFeeRate CWallet::minTxFee = CFeeRate(10000);
  * @{
  */
 
-struct CompareValueOnly {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-        const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 std::string COutput::ToString() const
 {
     return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString(), i, nDepth, FormatMoney(tx->vout[i].nValue));
@@ -438,6 +431,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    coinIndex.MarkStale(outpoint.hash);
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -626,6 +620,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
+        coinIndex.MarkAllStale();
     }
 }
 
@@ -639,6 +634,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        coinIndex.MarkStale(hash);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -683,6 +679,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        coinIndex.MarkStale(hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -720,6 +717,30 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
     return false;
 }
 
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    // Keep the precomputed witnesses of unspent mints current so that spends don't need to walk the chain.
+    // The work is done by ThreadzbitWitnessUpdate so that block validation is not held up.
+    if (zbitWitnessStore)
+        zbitWitnessStore->RequestUpdate();
+}
+
+void ThreadzbitWitnessUpdate(CWallet* pwallet)
+{
+    RenameThread("BitMoney-witness");
+
+    while (true) {
+        pwallet->zbitWitnessStore->WaitForUpdateRequest();
+
+        std::vector<CMintMeta> vMints;
+        {
+            LOCK2(cs_main, pwallet->cs_wallet);
+            vMints = pwallet->zbitTracker->GetMints(true);
+        }
+        pwallet->zbitWitnessStore->Update(vMints);
+    }
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
@@ -730,8 +751,10 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // available of the outputs it spends. So force those to be
     // recomputed, also:
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash))
+        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            coinIndex.MarkStale(txin.prevout.hash);
+        }
     }
 }
 
@@ -741,8 +764,11 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        if (mapWallet.erase(hash)) {
             CWalletDB(strWalletFile).EraseTx(hash);
+            // The outputs it spent are unspent again
+            coinIndex.MarkAllStale();
+        }
     }
     return;
 }
@@ -1434,45 +1460,129 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+void CWallet::GetScanFilter(CWalletScanFilter& filter) const
+{
+    {
+        LOCK(cs_KeyStore);
+        std::set<CKeyID> setKeyIDs;
+        GetKeys(setKeyIDs);
+        BOOST_FOREACH (const CKeyID& keyID, setKeyIDs)
+            filter.AddKeyID(keyID);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            filter.AddScriptID(it->first);
+        BOOST_FOREACH (const CScript& script, setWatchOnly)
+            filter.AddScript(script);
+        BOOST_FOREACH (const CScript& script, setMultiSig)
+            filter.AddScript(script);
+    }
+    {
+        LOCK(cs_wallet);
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            filter.AddTxid(it->first);
+    }
+    filter.Finalize();
+}
+
 /**
- * Scan the block chain (starting in pindexStart) for transactions
- * from or to us. If fUpdate is true, found transactions that already
- * exist in the wallet will be updated.
+ * Scan the block chain (starting in pindexStart, up to and including pindexStop
+ * or the tip) for transactions from or to us. If fUpdate is true, found
+ * transactions that already exist in the wallet will be updated.
+ *
+ * Blocks are read and matched against the keys and transactions of the wallet
+ * by CWalletScanReader threads, cs_main and cs_wallet are only taken to add the
+ * matches to the wallet. Only one scan runs at a time, -1 is returned if another
+ * one is in progress.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, CBlockIndex* pindexStop)
 {
+    bool fExpected = false;
+    if (!fScanningWallet.compare_exchange_strong(fExpected, true)) {
+        LogPrintf("%s : a wallet rescan is already in progress\n", __func__);
+        return -1;
+    }
+    nScanStartTime = GetTimeMillis();
+    dScanProgress = 0;
+
     int ret = 0;
     int64_t nNow = GetTime();
     bool fCheckzbit = GetBoolArg("-zapwallettxes", false);
     if (fCheckzbit)
         zbitTracker->Init();
 
-    CBlockIndex* pindex = pindexStart;
+    std::vector<CBlockIndex*> vBlocks;
+    CWalletScanFilter filter;
     {
         LOCK2(cs_main, cs_wallet);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)) && pindex->nHeight <= Params().Zerocoin_StartHeight())
+        CBlockIndex* pindex = pindexStart;
+        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)) && pindex->nHeight <= Params().Zerocoin_StartHeight() && pindex != pindexStop)
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        set<uint256> setAddedToWallet;
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+        for (; pindex; pindex = chainActive.Next(pindex)) {
+            vBlocks.push_back(pindex);
+            if (pindex == pindexStop)
+                break;
+        }
+        GetScanFilter(filter);
+    }
+    if (vBlocks.empty()) {
+        fScanningWallet = false;
+        return ret;
+    }
+
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    double dProgressStart = Checkpoints::GuessVerificationProgress(vBlocks.front(), false);
+    double dProgressTip = Checkpoints::GuessVerificationProgress(vBlocks.back(), false);
+    set<uint256> setAddedToWallet;
+    // Transactions this scan added, the filter doesn't know their spends
+    set<uint256> setFound;
+    {
+        CWalletScanReader reader(vBlocks, filter, GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS));
+        CWalletScanBlock scanned;
+        while (reader.Next(scanned)) {
+            CBlockIndex* pindex = scanned.pindex;
+            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0) {
+                dScanProgress = (Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart);
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dScanProgress * 100))));
+            }
+            if (ShutdownRequested()) {
+                LogPrintf("Rescan interrupted by shutdown request at block %d\n", pindex->nHeight);
+                break;
+            }
+            if (!scanned.pblock)
+                continue;
+            const CBlock& block = *scanned.pblock;
+
+            vector<unsigned int> vMatches;
+            if (setFound.empty()) {
+                vMatches.swap(scanned.vMatches);
+            } else {
+                for (unsigned int i = 0, j = 0; i < block.vtx.size(); i++) {
+                    bool fMatch = j < scanned.vMatches.size() && scanned.vMatches[j] == i;
+                    if (fMatch)
+                        j++;
+                    for (unsigned int k = 0; !fMatch && !block.vtx[i].IsCoinBase() && k < block.vtx[i].vin.size(); k++)
+                        fMatch = setFound.count(block.vtx[i].vin[k].prevout.hash) > 0;
+                    if (fMatch)
+                        vMatches.push_back(i);
+                }
+            }
+
+            if (!vMatches.empty()) {
+                LOCK2(cs_main, cs_wallet);
+                BOOST_FOREACH (unsigned int i, vMatches) {
+                    if (AddToWalletIfInvolvingMe(block.vtx[i], &block, fUpdate)) {
+                        setFound.insert(block.vtx[i].GetHash());
+                        ret++;
+                    }
+                }
             }
 
             //If this is a zapwallettx, need to readd zBIT
             if (fCheckzbit && pindex->nHeight >= Params().Zerocoin_StartHeight()) {
+                LOCK2(cs_main, cs_wallet);
                 list<CZerocoinMint> listMints;
                 BlockToZerocoinMintList(block, listMints, true);
 
@@ -1517,14 +1627,16 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                 }
             }
 
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    LogPrintf("%s : scanned blocks %d to %d in %dms, %d transactions added or updated\n", __func__,
+        vBlocks.front()->nHeight, vBlocks.back()->nHeight, GetTimeMillis() - nScanStartTime, ret);
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    fScanningWallet = false;
     return ret;
 }
 
@@ -1624,6 +1736,166 @@ void CWallet::ResendWalletTransactions()
 /** @} */ // end of mapWallet
 
 
+CWalletTxBalance& CWalletTxBalance::operator+=(const CWalletTxBalance& b)
+{
+    nTrusted += b.nTrusted;
+    nUnconfirmed += b.nUnconfirmed;
+    nImmature += b.nImmature;
+    nWatchTrusted += b.nWatchTrusted;
+    nWatchUnconfirmed += b.nWatchUnconfirmed;
+    nWatchImmature += b.nWatchImmature;
+    nWatchLocked += b.nWatchLocked;
+    nDenominatedConfirmed += b.nDenominatedConfirmed;
+    nDenominatedUnconfirmed += b.nDenominatedUnconfirmed;
+    return *this;
+}
+
+CWalletTxBalance& CWalletTxBalance::operator-=(const CWalletTxBalance& b)
+{
+    nTrusted -= b.nTrusted;
+    nUnconfirmed -= b.nUnconfirmed;
+    nImmature -= b.nImmature;
+    nWatchTrusted -= b.nWatchTrusted;
+    nWatchUnconfirmed -= b.nWatchUnconfirmed;
+    nWatchImmature -= b.nWatchImmature;
+    nWatchLocked -= b.nWatchLocked;
+    nDenominatedConfirmed -= b.nDenominatedConfirmed;
+    nDenominatedUnconfirmed -= b.nDenominatedUnconfirmed;
+    return *this;
+}
+
+void CWalletCoinIndex::RemoveEntry(EntryMap::iterator it)
+{
+    const uint256& hash = it->first;
+    const Entry& entry = it->second;
+    totals -= entry.balance;
+    for (unsigned int i = 0; i < entry.vCoins.size(); i++)
+        setCoinsByValue.erase(std::make_pair(entry.vCoins[i].second, COutPoint(hash, entry.vCoins[i].first)));
+    if (entry.fVolatile)
+        setVolatile.erase(hash);
+    if (entry.nMatureHeight >= 0) {
+        std::pair<std::multimap<int, uint256>::iterator, std::multimap<int, uint256>::iterator> range = mapMaturity.equal_range(entry.nMatureHeight);
+        for (std::multimap<int, uint256>::iterator mi = range.first; mi != range.second; ++mi) {
+            if (mi->second == hash) {
+                mapMaturity.erase(mi);
+                break;
+            }
+        }
+    }
+    mapEntries.erase(it);
+}
+
+void CWalletCoinIndex::MarkParentsStale(const CWallet& wallet, const CWalletTx& wtx)
+{
+    if (wtx.IsCoinBase() || wtx.IsZerocoinSpend())
+        return;
+    BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+        if (wallet.mapWallet.count(txin.prevout.hash))
+            setStale.insert(txin.prevout.hash);
+    }
+}
+
+void CWalletCoinIndex::UpdateEntry(const CWallet& wallet, const uint256& hash)
+{
+    bool fExisted = false;
+    int nDepthBefore = 0;
+    EntryMap::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end()) {
+        fExisted = true;
+        nDepthBefore = it->second.nDepth;
+        RemoveEntry(it);
+    }
+
+    std::map<uint256, CWalletTx>::const_iterator mi = wallet.mapWallet.find(hash);
+    if (mi == wallet.mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+
+    // Same terms as the mapWallet walks these balances used to do
+    Entry entry;
+    entry.nDepth = wtx.GetDepthInMainChain(false);
+    bool fFinal = IsFinalTx(wtx);
+    bool fTrusted = wtx.IsTrusted();
+    bool fUnconfirmed = !fFinal || (!fTrusted && wtx.GetDepthInMainChain() == 0);
+    CWalletTxBalance& balance = entry.balance;
+    if (fTrusted) {
+        balance.nTrusted = wtx.GetAvailableCredit();
+        balance.nWatchTrusted = wtx.GetAvailableWatchOnlyCredit();
+    }
+    if (fUnconfirmed) {
+        balance.nUnconfirmed = wtx.GetAvailableCredit();
+        balance.nWatchUnconfirmed = wtx.GetAvailableWatchOnlyCredit();
+    }
+    balance.nImmature = wtx.GetImmatureCredit();
+    balance.nWatchImmature = wtx.GetImmatureWatchOnlyCredit();
+    if (fTrusted && wtx.GetDepthInMainChain() > 0)
+        balance.nWatchLocked = wtx.GetLockedWatchOnlyCredit();
+    balance.nDenominatedConfirmed = wtx.GetDenominatedCredit(false);
+    balance.nDenominatedUnconfirmed = wtx.GetDenominatedCredit(true);
+
+    entry.fVolatile = entry.nDepth <= 0 || !fFinal;
+    if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && entry.nDepth > 0)
+        entry.nMatureHeight = chainActive.Height() - entry.nDepth + 1 + Params().COINBASE_MATURITY();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (wallet.IsMine(wtx.vout[i]) != ISMINE_NO && !wallet.IsSpent(hash, i))
+            entry.vCoins.push_back(std::make_pair(i, wtx.vout[i].nValue));
+    }
+
+    // Whether a spend counts depends on whether it is in the chain or the mempool
+    if (fExisted && (nDepthBefore >= 0) != (entry.nDepth >= 0))
+        MarkParentsStale(wallet, wtx);
+
+    if (entry.IsEmpty())
+        return;
+
+    totals += entry.balance;
+    for (unsigned int i = 0; i < entry.vCoins.size(); i++)
+        setCoinsByValue.insert(std::make_pair(entry.vCoins[i].second, COutPoint(hash, entry.vCoins[i].first)));
+    if (entry.fVolatile)
+        setVolatile.insert(hash);
+    if (entry.nMatureHeight >= 0)
+        mapMaturity.insert(std::make_pair(entry.nMatureHeight, hash));
+    mapEntries.insert(std::make_pair(hash, entry));
+}
+
+void CWalletCoinIndex::Refresh(const CWallet& wallet)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(wallet.cs_wallet);
+
+    int nNewHeight = chainActive.Height();
+    if (fRebuild) {
+        mapEntries.clear();
+        setVolatile.clear();
+        mapMaturity.clear();
+        setCoinsByValue.clear();
+        totals = CWalletTxBalance();
+        for (std::map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+            UpdateEntry(wallet, it->first);
+        setStale.clear();
+        nHeight = nNewHeight;
+        fRebuild = false;
+        LogPrint("wallet", "%s : indexed %u of %u wallet transactions\n", __func__, mapEntries.size(), wallet.mapWallet.size());
+        return;
+    }
+
+    // Coinbases and coinstakes that matured, or became immature again after a reorg
+    if (nNewHeight != nHeight) {
+        std::multimap<int, uint256>::const_iterator mi = mapMaturity.upper_bound(std::min(nHeight, nNewHeight));
+        std::multimap<int, uint256>::const_iterator end = mapMaturity.upper_bound(std::max(nHeight, nNewHeight));
+        for (; mi != end; ++mi)
+            setStale.insert(mi->second);
+        nHeight = nNewHeight;
+    }
+    setStale.insert(setVolatile.begin(), setVolatile.end());
+
+    while (!setStale.empty()) {
+        uint256 hash = *setStale.begin();
+        setStale.erase(setStale.begin());
+        UpdateEntry(wallet, hash);
+    }
+}
+
 /** @defgroup Actions
  *
  * @{
@@ -1631,18 +1903,9 @@ void CWallet::ResendWalletTransactions()
 
 CAmount CWallet::GetBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nTrusted;
 }
 
 std::map<libzerocoin::CoinDenomination, int> mapMintMaturity;
@@ -1832,183 +2095,187 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return unconfirmed ? coinIndex.GetTotals().nDenominatedUnconfirmed : coinIndex.GetTotals().nDenominatedConfirmed;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nWatchTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nWatchUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nWatchImmature;
 }
 
 CAmount CWallet::GetLockedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    coinIndex.Refresh(*this);
+    return coinIndex.GetTotals().nWatchLocked;
 }
 
-/**
- * populate vCoins with vector of available COutputs.
- */
-void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl* coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, bool fUseIX, int nWatchonlyConfig) const
+/** Transaction level checks of AvailableCoins, nDepth is set when they pass */
+bool CWallet::IsAvailableCoinsTx(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fUseIX, int& nDepth) const
 {
-    vCoins.clear();
+    if (!CheckFinalTx(*pcoin))
+        return false;
 
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return false;
 
-            if (!CheckFinalTx(*pcoin))
-                continue;
+    if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+        return false;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+    nDepth = pcoin->GetDepthInMainChain(false);
+    // do not use IX for inputs that have less then 6 blockchain confirmations
+    if (fUseIX && nDepth < 6)
+        return false;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepth == 0 && !pcoin->InMempool())
+        return false;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
-                continue;
+    return true;
+}
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
+/** Output level checks of AvailableCoins, adds output i of pcoin to vCoins when they pass */
+void CWallet::AddAvailableCoin(vector<COutput>& vCoins, const CWalletTx* pcoin, unsigned int i, int nDepth, const CCoinControl* coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, int nWatchonlyConfig) const
+{
+    const uint256& wtxid = pcoin->GetHash();
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOT10000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == GetMstrNodCollateral(chainActive.Height())*COIN);
-                } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = pcoin->vout[i].nValue != GetMstrNodCollateral(chainActive.Height())*COIN; // do not use Hot MN funds
-                } else if (nCoinType == ONLY_10000) {
-                    found = pcoin->vout[i].nValue == GetMstrNodCollateral(chainActive.Height())*COIN;
-                } else {
-                    found = true;
-                }
-                if (!found) continue;
+    bool found = false;
+    if (nCoinType == ONLY_DENOMINATED) {
+        found = IsDenominatedAmount(pcoin->vout[i].nValue);
+    } else if (nCoinType == ONLY_NOT10000IFMN) {
+        found = !(fMasterNode && pcoin->vout[i].nValue == GetMstrNodCollateral(chainActive.Height())*COIN);
+    } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
+        if (IsCollateralAmount(pcoin->vout[i].nValue)) return; // do not use collateral amounts
+        found = !IsDenominatedAmount(pcoin->vout[i].nValue);
+        if (found && fMasterNode) found = pcoin->vout[i].nValue != GetMstrNodCollateral(chainActive.Height())*COIN; // do not use Hot MN funds
+    } else if (nCoinType == ONLY_10000) {
+        found = pcoin->vout[i].nValue == GetMstrNodCollateral(chainActive.Height())*COIN;
+    } else {
+        found = true;
+    }
+    if (!found) return;
 
-                if (nCoinType == STAKABLE_COINS) {
-                    if (pcoin->vout[i].IsZerocoinMint())
-                        continue;
-                }
+    if (nCoinType == STAKABLE_COINS) {
+        if (pcoin->vout[i].IsZerocoinMint())
+            return;
+    }
 
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (IsSpent(wtxid, i))
-                    continue;
-                if (mine == ISMINE_NO)
-                    continue;
+    isminetype mine = IsMine(pcoin->vout[i]);
+    if (IsSpent(wtxid, i))
+        return;
+    if (mine == ISMINE_NO)
+        return;
 
-                if ((mine == ISMINE_MULTISIG || mine == ISMINE_SPENDABLE) && nWatchonlyConfig == 2)
-                    continue;
+    if ((mine == ISMINE_MULTISIG || mine == ISMINE_SPENDABLE) && nWatchonlyConfig == 2)
+        return;
 
-                if (mine == ISMINE_WATCH_ONLY && nWatchonlyConfig == 1)
-                    continue;
+    if (mine == ISMINE_WATCH_ONLY && nWatchonlyConfig == 1)
+        return;
 
-                if (IsLockedCoin((*it).first, i) && nCoinType != ONLY_10000)
-                    continue;
-                if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
-                    continue;
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
-                    continue;
+    if (IsLockedCoin(wtxid, i) && nCoinType != ONLY_10000)
+        return;
+    if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
+        return;
+    if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(wtxid, i))
+        return;
+
+    bool fIsSpendable = false;
+    if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
+        fIsSpendable = true;
+    if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
+        fIsSpendable = true;
+
+    vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
+}
+
+/**
+ * populate vCoins with vector of available COutputs.
+ * Only the outputs in the coin index are looked at, in mapWallet order. For the
+ * single value coin types, the candidates are taken from its value ordering.
+ */
+void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl* coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, bool fUseIX, int nWatchonlyConfig) const
+{
+    vCoins.clear();
 
-                bool fIsSpendable = false;
-                if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
-                    fIsSpendable = true;
-                if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
-                    fIsSpendable = true;
+    {
+        LOCK2(cs_main, cs_wallet);
+        coinIndex.Refresh(*this);
+
+        if (nCoinType == ONLY_10000 || nCoinType == ONLY_DENOMINATED) {
+            std::vector<CAmount> vValues;
+            if (nCoinType == ONLY_10000)
+                vValues.push_back(GetMstrNodCollateral(chainActive.Height())*COIN);
+            else
+                vValues = obfuScationDenominations;
+
+            std::set<COutPoint> setCandidates;
+            const std::set<std::pair<CAmount, COutPoint> >& setByValue = coinIndex.GetCoinsByValue();
+            BOOST_FOREACH (CAmount nValue, vValues) {
+                std::set<std::pair<CAmount, COutPoint> >::const_iterator it = setByValue.lower_bound(std::make_pair(nValue, COutPoint(uint256(0), 0)));
+                for (; it != setByValue.end() && it->first == nValue; ++it)
+                    setCandidates.insert(it->second);
+            }
 
-                vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
+            const CWalletTx* pcoin = NULL;
+            int nDepth = 0;
+            bool fAvailable = false;
+            BOOST_FOREACH (const COutPoint& outpoint, setCandidates) {
+                if (!pcoin || pcoin->GetHash() != outpoint.hash) {
+                    pcoin = &mapWallet.find(outpoint.hash)->second;
+                    fAvailable = IsAvailableCoinsTx(pcoin, fOnlyConfirmed, fUseIX, nDepth);
+                }
+                if (fAvailable)
+                    AddAvailableCoin(vCoins, pcoin, outpoint.n, nDepth, coinControl, fIncludeZeroValue, nCoinType, nWatchonlyConfig);
             }
+            return;
+        }
+
+        const CWalletCoinIndex::EntryMap& mapEntries = coinIndex.GetEntries();
+        for (CWalletCoinIndex::EntryMap::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+            const CWalletCoinIndex::Entry& entry = it->second;
+            if (entry.vCoins.empty())
+                continue;
+
+            const CWalletTx* pcoin = &mapWallet.find(it->first)->second;
+            int nDepth = 0;
+            if (!IsAvailableCoinsTx(pcoin, fOnlyConfirmed, fUseIX, nDepth))
+                continue;
+
+            for (unsigned int i = 0; i < entry.vCoins.size(); i++)
+                AddAvailableCoin(vCoins, pcoin, entry.vCoins[i].first, nDepth, coinControl, fIncludeZeroValue, nCoinType, nWatchonlyConfig);
         }
     }
 }
@@ -2033,7 +2300,7 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int64_t nTimeDeadline, int iterations = 1000)
 {
     vector<char> vfIncluded;
 
@@ -2043,6 +2310,9 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     seed_insecure_rand();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
+        // Keep the best subset found so far once the time is up
+        if (nRep > 0 && GetTimeMicros() > nTimeDeadline)
+            break;
         vfIncluded.assign(vValue.size(), false);
         CAmount nTotal = 0;
         bool fReachedTarget = false;
@@ -2073,21 +2343,60 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
 }
 
 
-// TODO: find appropriate place for this sort function
-// move denoms down
-bool less_then_denom(const COutput& out1, const COutput& out2)
+/**
+ * Depth first search for a subset of vValue (sorted from large to small) that adds up to exactly
+ * nTargetValue, so no change output is needed. A branch is cut as soon as it overshoots the target
+ * or the coins left can no longer reach it. Gives up after COIN_SELECTION_BNB_TRIES steps or at
+ * nTimeDeadline; fComplete is set when it failed because there is no such subset.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTargetValue, vector<char>& vfBest, int64_t nTimeDeadline, bool& fComplete)
 {
-    const CWalletTx* pcoin1 = out1.tx;
-    const CWalletTx* pcoin2 = out2.tx;
+    fComplete = true;
 
-    bool found1 = false;
-    bool found2 = false;
-    BOOST_FOREACH (CAmount d, obfuScationDenominations) // loop through predefined denoms
-    {
-        if (pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if (pcoin2->vout[out2.i].nValue == d) found2 = true;
+    // vRemaining[i]: the sum of vValue[i] and all smaller coins
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (size_t i = vValue.size(); i-- > 0;)
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    fComplete = false;
+    vector<char> vfIncluded(vValue.size(), false);
+    CAmount nTotal = 0;
+    size_t i = 0;
+    for (int nTries = 0; nTries < COIN_SELECTION_BNB_TRIES; nTries++) {
+        if ((nTries & 0xff) == 0 && nTries > 0 && GetTimeMicros() > nTimeDeadline)
+            break;
+
+        if (nTotal == nTargetValue) {
+            vfBest.assign(vValue.size(), false);
+            std::copy(vfIncluded.begin(), vfIncluded.begin() + i, vfBest.begin());
+            return true;
+        }
+
+        if (nTotal > nTargetValue || nTotal + vRemaining[i] < nTargetValue) {
+            // Back up to the last included coin and try the branch without it
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0) {
+                fComplete = true;
+                return false;
+            }
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
+        } else if (i > 0 && !vfIncluded[i - 1] && vValue[i - 1].first == vValue[i].first) {
+            // Including this coin would repeat the subsets already tried with the equal one before it
+            vfIncluded[i] = false;
+            i++;
+        } else {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            i++;
+        }
     }
-    return (!found1 && found2);
+    return false;
 }
 
 bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount)
@@ -2129,6 +2438,12 @@ bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInp
     }
 
     //zBIT
+    return SelectzbitStakeCoins(listInputs);
+}
+
+bool CWallet::SelectzbitStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs)
+{
+    LOCK(cs_main);
     if (GetBoolArg("-zbitstake", true) && chainActive.Height() > Params().Zerocoin_Block_V2_Start() && !IsSporkActive(SPORK_16_ZEROCOIN_MAINTENANCE_MODE)) {
         //Only update zBIT set once per update interval
         bool fUpdate = false;
@@ -2205,11 +2520,64 @@ bool CWallet::MintableCoins()
     return false;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+struct CompareSelectionCoin {
+    bool operator()(const CSelectionCoin& a, const CSelectionCoin& b) const
+    {
+        if (a.nValue != b.nValue)
+            return a.nValue > b.nValue;
+        return !a.fDenominated && b.fDenominated;
+    }
+};
+
+//! First coin in a CCoinSelectionCandidates ordering with a value below nValue
+struct CompareSelectionCoinBelow {
+    bool operator()(const CSelectionCoin& coin, const CAmount& nValue) const
+    {
+        return coin.nValue >= nValue;
+    }
+};
+
+void CCoinSelectionCandidates::Fill(const CWallet& wallet, vector<COutput>& vAvailableIn)
+{
+    vAvailable.swap(vAvailableIn);
+    vCoins.clear();
+    vCoins.reserve(vAvailable.size());
+    BOOST_FOREACH (const COutput& output, vAvailable) {
+        if (!output.fSpendable)
+            continue;
+        CSelectionCoin coin;
+        coin.nValue = output.tx->vout[output.i].nValue;
+        coin.tx = output.tx;
+        coin.i = output.i;
+        coin.nDepth = output.nDepth;
+        coin.fFromMe = output.tx->IsFromMe(ISMINE_ALL);
+        coin.fDenominated = wallet.IsDenominatedAmount(coin.nValue);
+        vCoins.push_back(coin);
+    }
+
+    // Random order among coins of equal value
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    stable_sort(vCoins.begin(), vCoins.end(), CompareSelectionCoin());
+    fFilled = true;
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    CCoinSelectionCandidates candidates;
+    vector<COutput> vAvailable(vCoins);
+    candidates.Fill(*this, vAvailable);
+    return SelectCoinsMinConf(nTargetValue, nConfMine, nConfTheirs, candidates, setCoinsRet, nValueRet);
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const CCoinSelectionCandidates& candidates, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
+    int64_t nTimeStart = GetTimeMicros();
+    std::string strMethod = "none";
+    bool fSelected = false;
+
     // List of values less than target
     pair<CAmount, pair<const CWalletTx*, unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<CAmount>::max();
@@ -2217,50 +2585,51 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
+    // The coins below target + CENT start here, the larger ones come before
+    const vector<CSelectionCoin>& vCoins = candidates.vCoins;
+    vector<CSelectionCoin>::const_iterator itLower = std::lower_bound(vCoins.begin(), vCoins.end(), nTargetValue + CENT, CompareSelectionCoinBelow());
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
-    for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
+    for (unsigned int tryDenom = 0; tryDenom < 2 && !fSelected; tryDenom++) {
         if (fDebug) LogPrint("selectcoins", "tryDenom: %d\n", tryDenom);
         vValue.clear();
         nTotalLower = 0;
-        BOOST_FOREACH (const COutput& output, vCoins) {
-            if (!output.fSpendable)
-                continue;
 
-            const CWalletTx* pcoin = output.tx;
-
-            //            if (fDebug) LogPrint("selectcoins", "value %s confirms %d\n", FormatMoney(pcoin->vout[output.i].nValue), output.nDepth);
-            if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+        // The smallest of the larger coins: walk up from the boundary
+        for (vector<CSelectionCoin>::const_iterator it = itLower; it != vCoins.begin() && !coinLowestLarger.second.first;) {
+            --it;
+            if (it->nDepth < (it->fFromMe ? nConfMine : nConfTheirs))
                 continue;
+            if (tryDenom == 0 && it->fDenominated) continue; // we don't want denom values on first run
+            coinLowestLarger = make_pair(it->nValue, make_pair(it->tx, it->i));
+        }
 
-            int i = output.i;
-            CAmount n = pcoin->vout[i].nValue;
-            if (tryDenom == 0 && IsDenominatedAmount(n)) continue; // we don't want denom values on first run
-
-            pair<CAmount, pair<const CWalletTx*, unsigned int> > coin = make_pair(n, make_pair(pcoin, i));
+        for (vector<CSelectionCoin>::const_iterator it = itLower; it != vCoins.end(); ++it) {
+            if (it->nDepth < (it->fFromMe ? nConfMine : nConfTheirs))
+                continue;
+            if (tryDenom == 0 && it->fDenominated) continue; // we don't want denom values on first run
 
-            if (n == nTargetValue) {
-                setCoinsRet.insert(coin.second);
-                nValueRet += coin.first;
-                return true;
-            } else if (n < nTargetValue + CENT) {
-                vValue.push_back(coin);
-                nTotalLower += n;
-            } else if (n < coinLowestLarger.first) {
-                coinLowestLarger = coin;
+            if (it->nValue == nTargetValue) {
+                setCoinsRet.insert(make_pair(it->tx, it->i));
+                nValueRet += it->nValue;
+                strMethod = "exact";
+                fSelected = true;
+                break;
             }
+            vValue.push_back(make_pair(it->nValue, make_pair(it->tx, it->i)));
+            nTotalLower += it->nValue;
         }
+        if (fSelected)
+            break;
 
         if (nTotalLower == nTargetValue) {
             for (unsigned int i = 0; i < vValue.size(); ++i) {
                 setCoinsRet.insert(vValue[i].second);
                 nValueRet += vValue[i].first;
             }
-            return true;
+            strMethod = "all";
+            fSelected = true;
+            break;
         }
 
         if (nTotalLower < nTargetValue) {
@@ -2271,53 +2640,91 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
                     continue;
                 else
                     // we looked at everything possible and didn't find anything, no luck
-                    return false;
+                    break;
             }
             setCoinsRet.insert(coinLowestLarger.second);
             nValueRet += coinLowestLarger.first;
-            return true;
+            strMethod = "larger";
+            fSelected = true;
+            break;
         }
 
         // nTotalLower > nTargetValue
-        break;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    CAmount nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        // vValue is sorted from large to small already
+        vector<char> vfBest;
+        CAmount nBest;
+
+        // Look for an exact match first, then solve subset sum by stochastic approximation
+        bool fBnBComplete;
+        if (SelectCoinsBnB(vValue, nTargetValue, vfBest, nTimeStart + COIN_SELECTION_BNB_BUDGET, fBnBComplete)) {
+            nBest = nTargetValue;
+            strMethod = "bnb";
+        } else {
+            if (!fBnBComplete) {
+                LOCK(cs_wallet);
+                selectionStats.nBnBExhausted++;
+            }
+            int64_t nTimeDeadline = GetTimeMicros() + COIN_SELECTION_APPROXIMATE_BUDGET;
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nTimeDeadline, 1000);
+            if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+                ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nTimeDeadline, 1000);
+            strMethod = "approximate";
+        }
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest)) {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    } else {
-        string s = "CWallet::SelectCoinsMinConf best subset: ";
-        for (unsigned int i = 0; i < vValue.size(); i++) {
-            if (vfBest[i]) {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-                s += FormatMoney(vValue[i].first) + " ";
+        // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+        //                                   or the next bigger coin is closer), return the bigger coin
+        if (coinLowestLarger.second.first &&
+            ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest)) {
+            setCoinsRet.insert(coinLowestLarger.second);
+            nValueRet += coinLowestLarger.first;
+        } else {
+            string s = "CWallet::SelectCoinsMinConf best subset: ";
+            for (unsigned int i = 0; i < vValue.size(); i++) {
+                if (vfBest[i]) {
+                    setCoinsRet.insert(vValue[i].second);
+                    nValueRet += vValue[i].first;
+                    if (fDebug) s += FormatMoney(vValue[i].first) + " ";
+                }
             }
+            LogPrint("selectcoins", "%s - total %s\n", s, FormatMoney(nBest));
         }
-        LogPrintf("%s - total %s\n", s, FormatMoney(nBest));
+        fSelected = true;
     }
 
-    return true;
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+    {
+        LOCK(cs_wallet);
+        selectionStats.nSelections++;
+        if (strMethod == "exact")
+            selectionStats.nExact++;
+        else if (strMethod == "bnb")
+            selectionStats.nBnB++;
+        else if (strMethod == "approximate")
+            selectionStats.nApproximate++;
+        selectionStats.nTotalMicros += nTime;
+        selectionStats.nMaxMicros = std::max(selectionStats.nMaxMicros, nTime);
+        selectionStats.nLastMicros = nTime;
+        selectionStats.nLastCandidates = vCoins.size();
+    }
+    LogPrint("selectcoins", "%s : target %s, %u candidates, %u below target, selected %u coins by %s in %.2fms\n", __func__,
+        FormatMoney(nTargetValue), vCoins.size(), vValue.size(), setCoinsRet.size(), strMethod, nTime * 0.001);
+
+    return fSelected;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX, CCoinSelectionCandidates* pcandidates) const
 {
     // Note: this function should never be used for "always free" tx types like dstx
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, false, coin_type, useIX);
+    // The caller may pass the candidates of an earlier call with the same arguments
+    CCoinSelectionCandidates candidatesLocal;
+    CCoinSelectionCandidates& candidates = pcandidates ? *pcandidates : candidatesLocal;
+    if (!candidates.fFilled) {
+        vector<COutput> vAvailable;
+        AvailableCoins(vAvailable, true, coinControl, false, coin_type, useIX);
+        candidates.Fill(*this, vAvailable);
+    }
+    const vector<COutput>& vCoins = candidates.vAvailable;
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected()) {
@@ -2358,9 +2765,9 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (SelectCoinsMinConf(nTargetValue, 1, 6, candidates, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, 1, 1, candidates, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, candidates, setCoinsRet, nValueRet)));
 }
 
 struct CompareByPriority {
@@ -2736,6 +3143,8 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
         {
             nFeeRet = 0;
             if (nFeePay > 0) nFeeRet = nFeePay;
+            // The wallet can't change while we hold the locks, collect and sort its coins once for every fee we try
+            CCoinSelectionCandidates candidates;
             while (true) {
                 txNew.vin.clear();
                 txNew.vout.clear();
@@ -2778,7 +3187,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 set<pair<const CWalletTx*, unsigned int> > setCoins;
                 CAmount nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX)) {
+                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX, &candidates)) {
                     if (coin_type == ALL_COINS) {
                         strFailReason = _("Insufficient funds.");
                     } else if (coin_type == ONLY_NOT10000IFMN) {
@@ -2946,17 +3355,6 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWa
 // ppcoin: create coin stake transaction
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime)
 {
-    // The following split & combine thresholds are important to security
-    // Should not be adjusted if you don't understand the consequences
-    //int64_t nCombineThreshold = 0;
-    txNew.vin.clear();
-    txNew.vout.clear();
-
-    // Mark coin stake transaction
-    CScript scriptEmpty;
-    scriptEmpty.clear();
-    txNew.vout.push_back(CTxOut(0, scriptEmpty));
-
     // Choose coins to use
     CAmount nBalance = GetBalance();
 
@@ -2977,11 +3375,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
         MilliSleep(10000);
 
-    CAmount nCredit;
-    CScript scriptPubKeyKernel;
-    bool fKernelFound = false;
     for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
-        nCredit = 0;
         // Make sure the wallet is unlocked and shutdown hasn't been requested
         if (IsLocked() || ShutdownRequested())
             return false;
@@ -3000,73 +3394,80 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
         //iterates each utxo inside of CheckStakeKernelHash()
         if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
-            LOCK(cs_main);
             //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
+            {
+                LOCK(cs_main);
+                if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+                    LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+                    continue;
+                }
             }
 
             // Found a kernel
             LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
+            if (CreateCoinStake(stakeInput.get(), txNew))
+                return true;
+        }
+    }
 
-            // Calculate reward
-            CAmount nReward;
-            nReward = GetBlockValue(chainActive.Height() + 1);
-            nCredit += nReward;
+    return false;
+}
 
-            // Create the output transaction(s)
-            vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
-
-            CAmount nMinFee = 0;
-            if (!stakeInput->Iszbit()) {
-                // Set output amount
-                if (txNew.vout.size() == 3) {
-                    txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
-                    txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
-                } else
-                    txNew.vout[1].nValue = nCredit - nMinFee;
-            }
+bool CWallet::CreateCoinStake(CStakeInput* stakeInput, CMutableTransaction& txNew)
+{
+    LOCK(cs_main);
 
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
+    txNew.vin.clear();
+    txNew.vout.clear();
 
-            //Masternode payment
-            FillBlockPayee(txNew, nMinFee, true, stakeInput->Iszbit());
+    // Mark coin stake transaction
+    CScript scriptEmpty;
+    scriptEmpty.clear();
+    txNew.vout.push_back(CTxOut(0, scriptEmpty));
 
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                continue;
-            }
-            txNew.vin.emplace_back(in);
+    CAmount nCredit = stakeInput->GetValue();
+
+    // Calculate reward
+    CAmount nReward;
+    nReward = GetBlockValue(chainActive.Height() + 1);
+    nCredit += nReward;
+
+    // Create the output transaction(s)
+    vector<CTxOut> vout;
+    if (!stakeInput->CreateTxOuts(this, vout, nCredit))
+        return error("%s : failed to get scriptPubKey", __func__);
+    txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+
+    CAmount nMinFee = 0;
+    if (!stakeInput->Iszbit()) {
+        // Set output amount
+        if (txNew.vout.size() == 3) {
+            txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
+            txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
+        } else
+            txNew.vout[1].nValue = nCredit - nMinFee;
+    }
 
-            //Mark mints as spent
-            if (stakeInput->Iszbit()) {
-                CzbitStake* z = (CzbitStake*)stakeInput.get();
-                if (!z->MarkSpent(this, txNew.GetHash()))
-                    return error("%s: failed to mark mint as used\n", __func__);
-            }
+    // Limit size
+    unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+        return error("CreateCoinStake : exceeded coinstake size limit");
 
-            fKernelFound = true;
-            break;
-        }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+    //Masternode payment
+    FillBlockPayee(txNew, nMinFee, true, stakeInput->Iszbit());
+
+    uint256 hashTxOut = txNew.GetHash();
+    CTxIn in;
+    if (!stakeInput->CreateTxIn(this, in, hashTxOut))
+        return error("%s : failed to create TxIn", __func__);
+    txNew.vin.emplace_back(in);
+
+    //Mark mints as spent
+    if (stakeInput->Iszbit()) {
+        CzbitStake* z = (CzbitStake*)stakeInput;
+        if (!z->MarkSpent(this, txNew.GetHash()))
+            return error("%s: failed to mark mint as used\n", __func__);
     }
-    if (!fKernelFound)
-        return false;
 
     // Sign for BIT
     int nIn = 0;
@@ -3778,18 +4179,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    coinIndex.MarkStale(output.hash);
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    coinIndex.MarkStale(output.hash);
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    coinIndex.MarkAllStale();
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -4605,7 +5009,9 @@ bool CWallet::MintToTxIn(CZerocoinMint zerocoinSelected, int nSecurityLevel, con
     libzerocoin::AccumulatorWitness witness(paramsAccumulator, accumulator, pubCoinSelected);
     string strFailReason = "";
     int nMintsAdded = 0;
-    if (!GenerateAccumulatorWitness(pubCoinSelected, accumulator, witness, nSecurityLevel, nMintsAdded, strFailReason, pindexCheckpoint)) {
+    CoinWitnessData witnessData;
+    bool fPrecomputed = zbitWitnessStore && zbitWitnessStore->Get(GetPubCoinHash(pubCoinSelected.getValue()), witnessData);
+    if (!GenerateAccumulatorWitness(pubCoinSelected, accumulator, witness, nSecurityLevel, nMintsAdded, strFailReason, pindexCheckpoint, fPrecomputed ? &witnessData : nullptr)) {
         receipt.SetStatus(_("Try to spend with a higher security level to include more coins"), zbit_FAILED_ACCUMULATOR_INITIALIZATION);
         return error("%s : %s", __func__, receipt.GetStatusMessage());
     }
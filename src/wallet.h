@@ -25,8 +25,10 @@
 #include "walletdb.h"
 #include "zbitwallet.h"
 #include "zbittracker.h"
+#include "zbitwitness.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -58,6 +60,12 @@ static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWa
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //! -custombackupthreshold default
 static const int DEFAULT_CUSTOMBACKUPTHRESHOLD = 1;
+//! Steps the exact match search of coin selection may take before falling back
+static const int COIN_SELECTION_BNB_TRIES = 100000;
+//! Time (microseconds) the exact match search of coin selection may take before falling back
+static const int64_t COIN_SELECTION_BNB_BUDGET = 100 * 1000;
+//! Time (microseconds) the stochastic subset search of coin selection may take
+static const int64_t COIN_SELECTION_APPROXIMATE_BUDGET = 500 * 1000;
 
 // Zerocoin denomination which creates exactly one of each denominations:
 // 6666 = 1*5000 + 1*1000 + 1*500 + 1*100 + 1*50 + 1*10 + 1*5 + 1
@@ -65,7 +73,9 @@ static const int ZQ_6666 = 6666;
 
 class CAccountingEntry;
 class CCoinControl;
+class CCoinSelectionCandidates;
 class COutput;
+class CWalletScanFilter;
 class CReserveKey;
 class CScript;
 class CWalletTx;
@@ -158,6 +168,100 @@ public:
     StringMap destdata;
 };
 
+/** What one wallet transaction adds to each of the wallet balances */
+struct CWalletTxBalance {
+    CAmount nTrusted;                //!< GetBalance
+    CAmount nUnconfirmed;            //!< GetUnconfirmedBalance
+    CAmount nImmature;               //!< GetImmatureBalance
+    CAmount nWatchTrusted;           //!< GetWatchOnlyBalance
+    CAmount nWatchUnconfirmed;       //!< GetUnconfirmedWatchOnlyBalance
+    CAmount nWatchImmature;          //!< GetImmatureWatchOnlyBalance
+    CAmount nWatchLocked;            //!< GetLockedWatchOnlyBalance
+    CAmount nDenominatedConfirmed;   //!< GetDenominatedBalance(false)
+    CAmount nDenominatedUnconfirmed; //!< GetDenominatedBalance(true)
+
+    CWalletTxBalance() : nTrusted(0), nUnconfirmed(0), nImmature(0), nWatchTrusted(0), nWatchUnconfirmed(0), nWatchImmature(0),
+                         nWatchLocked(0), nDenominatedConfirmed(0), nDenominatedUnconfirmed(0) {}
+
+    CWalletTxBalance& operator+=(const CWalletTxBalance& b);
+    CWalletTxBalance& operator-=(const CWalletTxBalance& b);
+};
+
+/** How long coin selection takes and how it finds its coins, see getwalletinfo */
+struct CCoinSelectionStats {
+    uint64_t nSelections;     //!< SelectCoinsMinConf passes
+    uint64_t nExact;          //!< passes that found a coin of exactly the target value
+    uint64_t nBnB;            //!< passes where the exact match search found a subset
+    uint64_t nBnBExhausted;   //!< passes where it ran out of tries or time
+    uint64_t nApproximate;    //!< passes that fell back to the stochastic subset search
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    int64_t nLastMicros;
+    size_t nLastCandidates;
+
+    CCoinSelectionStats() : nSelections(0), nExact(0), nBnB(0), nBnBExhausted(0), nApproximate(0), nTotalMicros(0), nMaxMicros(0), nLastMicros(0), nLastCandidates(0) {}
+};
+
+/**
+ * The wallet transactions that have unspent outputs of ours or add to a balance, with what they add
+ * to each balance and the totals over all of them. The balance queries and AvailableCoins work from
+ * this index instead of walking every transaction in mapWallet.
+ *
+ * Entries are recomputed from the CWalletTx when the transaction is added or updated, when one of
+ * its outputs is spent, and when a coinbase or coinstake crosses its maturity height. Transactions
+ * that are only in the mempool, or not final yet, can change state without a wallet event (mempool
+ * eviction, SwiftTX locks), so they are recomputed on every query. All access is under cs_wallet,
+ * Refresh() also needs cs_main.
+ */
+class CWalletCoinIndex
+{
+public:
+    struct Entry {
+        CWalletTxBalance balance;
+        int nDepth;                           //!< GetDepthInMainChain(false) when computed
+        bool fVolatile;                       //!< only in the mempool or not final: recompute on every query
+        int nMatureHeight;                    //!< coinbase/coinstake in the chain: chain height from which it is mature, else -1
+        std::vector<std::pair<unsigned int, CAmount> > vCoins; //!< our unspent outputs and their values
+
+        Entry() : nDepth(0), fVolatile(false), nMatureHeight(-1) {}
+
+        bool IsEmpty() const { return !fVolatile && nMatureHeight < 0 && vCoins.empty(); }
+    };
+    typedef std::map<uint256, Entry> EntryMap;
+
+private:
+    EntryMap mapEntries;
+    std::set<uint256> setStale;
+    std::set<uint256> setVolatile;
+    std::multimap<int, uint256> mapMaturity;
+    //! our unspent outputs ordered by value
+    std::set<std::pair<CAmount, COutPoint> > setCoinsByValue;
+    CWalletTxBalance totals;
+    //! chain height at the last Refresh()
+    int nHeight;
+    bool fRebuild;
+
+    void RemoveEntry(EntryMap::iterator it);
+    void UpdateEntry(const CWallet& wallet, const uint256& hash);
+    void MarkParentsStale(const CWallet& wallet, const CWalletTx& wtx);
+
+public:
+    CWalletCoinIndex() : nHeight(-1), fRebuild(true) {}
+
+    //! Recompute the entry of a transaction on the next Refresh()
+    void MarkStale(const uint256& hash) { setStale.insert(hash); }
+    //! Recompute every entry on the next Refresh()
+    void MarkAllStale() { fRebuild = true; }
+
+    //! Bring the entries and totals up to date with the wallet and the chain
+    void Refresh(const CWallet& wallet);
+
+    const CWalletTxBalance& GetTotals() const { return totals; }
+    const EntryMap& GetEntries() const { return mapEntries; }
+    const std::set<std::pair<CAmount, COutPoint> >& GetCoinsByValue() const { return setCoinsByValue; }
+    size_t Size() const { return mapEntries.size(); }
+};
+
 /**
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -165,7 +269,7 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true) const;
+    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true, CCoinSelectionCandidates* pcandidates = NULL) const;
     //it was public bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
 
     CWalletDB* pwalletdbEncryption;
@@ -179,6 +283,11 @@ private:
     int64_t nNextResend;
     int64_t nLastResend;
 
+    //! State of a running ScanForWalletTransactions, readable without the wallet lock
+    std::atomic<bool> fScanningWallet;
+    std::atomic<int64_t> nScanStartTime;
+    std::atomic<double> dScanProgress;
+
     /**
      * Used to keep track of spent outpoints, and
      * detect and report conflicts (double-spends or
@@ -191,9 +300,17 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    //! Balances and unspent outputs of mapWallet, see CWalletCoinIndex
+    mutable CWalletCoinIndex coinIndex;
+    mutable CCoinSelectionStats selectionStats;
+
+    bool IsAvailableCoinsTx(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fUseIX, int& nDepth) const;
+    void AddAvailableCoin(std::vector<COutput>& vCoins, const CWalletTx* pcoin, unsigned int i, int nDepth, const CCoinControl* coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, int nWatchonlyConfig) const;
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
+    bool SelectzbitStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs);
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -244,6 +361,7 @@ public:
     std::string strWalletFile;
     bool fBackupMints;
     std::unique_ptr<CzbitTracker> zbitTracker;
+    std::unique_ptr<CzbitWitnessStore> zbitWitnessStore;
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
@@ -300,6 +418,9 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fScanningWallet = false;
+        nScanStartTime = 0;
+        dScanProgress = 0;
         fWalletUnlockAnonymizeOnly = false;
         fBackupMints = false;
 
@@ -332,6 +453,7 @@ public:
     {
         zwalletMain = zwallet;
         zbitTracker = std::unique_ptr<CzbitTracker>(new CzbitTracker(strWalletFile));
+        zbitWitnessStore = std::unique_ptr<CzbitWitnessStore>(new CzbitWitnessStore(strWalletFile));
     }
 
     CzbitWallet* getZWallet() { return zwalletMain; }
@@ -386,7 +508,13 @@ public:
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false, int nWatchonlyConfig = 1) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const CCoinSelectionCandidates& candidates, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    CCoinSelectionStats GetCoinSelectionStats() const
+    {
+        LOCK(cs_wallet);
+        return selectionStats;
+    }
 
     /// Get 1000DASH output and keys which can be used for the Masternode
     bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash = "", std::string strOutputIndex = "");
@@ -465,9 +593,14 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void UpdatedBlockTip(const CBlockIndex* pindex);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, CBlockIndex* pindexStop = NULL);
+    void GetScanFilter(CWalletScanFilter& filter) const;
+    bool IsScanning() const { return fScanningWallet; }
+    int64_t ScanningDuration() const { return fScanningWallet ? GetTimeMillis() - nScanStartTime : 0; }
+    double ScanningProgress() const { return fScanningWallet ? (double)dScanProgress : 0; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     CAmount GetBalance() const;
@@ -506,6 +639,7 @@ public:
     bool CreateCollateralTransaction(CMutableTransaction& txCollateral, std::string& strReason);
     bool ConvertList(std::vector<CTxIn> vCoins, std::vector<int64_t>& vecAmounts);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime);
+    bool CreateCoinStake(CStakeInput* stakeInput, CMutableTransaction& txNew);
     bool MultiSend();
     void AutoCombineDust();
     void AutoZeromint();
@@ -678,6 +812,9 @@ public:
     boost::signals2::signal<void (const bool& fSuccess, const std::string& filename)> NotifyWalletBacked;
 };
 
+/** Keep the zbit witness store of a wallet current after UpdatedBlockTip requests */
+void ThreadzbitWitnessUpdate(CWallet* pwallet);
+
 
 /** A key allocated from the key pool. */
 class CReserveKey
@@ -1085,6 +1222,35 @@ public:
     std::string ToString() const;
 };
 
+/** A spendable output as coin selection looks at it */
+struct CSelectionCoin {
+    CAmount nValue;
+    const CWalletTx* tx;
+    unsigned int i;
+    int nDepth;
+    bool fFromMe;
+    bool fDenominated;
+};
+
+/**
+ * The outputs AvailableCoins returned for one transaction, with the spendable ones sorted by
+ * value from large to small (non-denominated first, otherwise in random order among equal
+ * values). Each SelectCoinsMinConf pass finds the coins around its target by binary search,
+ * and the fee loop of CreateTransaction reuses them instead of collecting and sorting the
+ * wallet's coins again for every fee it tries.
+ */
+class CCoinSelectionCandidates
+{
+public:
+    std::vector<COutput> vAvailable;
+    std::vector<CSelectionCoin> vCoins;
+    bool fFilled;
+
+    CCoinSelectionCandidates() : fFilled(false) {}
+
+    void Fill(const CWallet& wallet, std::vector<COutput>& vAvailableIn);
+};
+
 
 /** Private key that includes an expiration date in case it never gets used. */
 class CWalletKey
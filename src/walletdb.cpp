@@ -6,6 +6,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "walletdb.h"
+#include "accumulators.h"
 
 #include "base58.h"
 #include "protocol.h"
@@ -1380,6 +1381,61 @@ std::map<uint256, std::vector<pair<uint256, uint32_t> > > CWalletDB::MapMintPool
     return mapPool;
 }
 
+bool CWalletDB::WriteWitnessData(const uint256& hashPubcoin, const CoinWitnessData& data)
+{
+    return Write(make_pair(string("zwitness"), hashPubcoin), data);
+}
+
+bool CWalletDB::EraseWitnessData(const uint256& hashPubcoin)
+{
+    return Erase(make_pair(string("zwitness"), hashPubcoin));
+}
+
+//! map with hashPubcoin as the key, paired with the precomputed witness of that mint
+std::map<uint256, CoinWitnessData> CWalletDB::MapWitnessData()
+{
+    std::map<uint256, CoinWitnessData> mapWitness;
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        throw runtime_error(std::string(__func__)+" : cannot create DB cursor");
+    unsigned int fFlags = DB_SET_RANGE;
+    for (;;)
+    {
+        // Read next record
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("zwitness"), uint256(0));
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            throw runtime_error(std::string(__func__)+" : error scanning DB");
+        }
+
+        // Unserialize
+        string strType;
+        ssKey >> strType;
+        if (strType != "zwitness")
+            break;
+
+        uint256 hashPubcoin;
+        ssKey >> hashPubcoin;
+
+        CoinWitnessData data;
+        ssValue >> data;
+
+        mapWitness.insert(make_pair(hashPubcoin, data));
+    }
+
+    pcursor->close();
+
+    return mapWitness;
+}
+
 std::list<CDeterministicMint> CWalletDB::ListDeterministicMints()
 {
     std::list<CDeterministicMint> listMints;
@@ -31,6 +31,7 @@ class CScript;
 class CWallet;
 class CWalletTx;
 class CDeterministicMint;
+class CoinWitnessData;
 class CZerocoinMint;
 class CZerocoinSpend;
 class uint160;
@@ -185,6 +186,9 @@ public:
     bool ReadzbitCount(uint32_t& nCount);
     std::map<uint256, std::vector<pair<uint256, uint32_t> > > MapMintPool();
     bool WriteMintPoolPair(const uint256& hashMasterSeed, const uint256& hashPubcoin, const uint32_t& nCount);
+    bool WriteWitnessData(const uint256& hashPubcoin, const CoinWitnessData& data);
+    bool EraseWitnessData(const uint256& hashPubcoin);
+    std::map<uint256, CoinWitnessData> MapWitnessData();
 
 
 private:
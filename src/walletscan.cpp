@@ -0,0 +1,148 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletscan.h"
+
+#include "main.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool CWalletScanFilter::HaveID(const uint160& id) const
+{
+    return std::binary_search(vIDs.begin(), vIDs.end(), id);
+}
+
+void CWalletScanFilter::Finalize()
+{
+    std::sort(vIDs.begin(), vIDs.end());
+    vIDs.erase(std::unique(vIDs.begin(), vIDs.end()), vIDs.end());
+}
+
+bool CWalletScanFilter::MatchScript(const CScript& scriptPubKey) const
+{
+    if (setScripts.count(scriptPubKey))
+        return true;
+
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType) {
+    case TX_ZEROCOINMINT:
+    case TX_PUBKEY:
+        return HaveID(CPubKey(vSolutions[0]).GetID());
+    case TX_PUBKEYHASH:
+    case TX_SCRIPTHASH:
+        return HaveID(uint160(vSolutions[0]));
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++) {
+            if (HaveID(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::Match(const CTransaction& tx) const
+{
+    // transactions already in the wallet, so that an fUpdate rescan refreshes them
+    if (setTxids.count(tx.GetHash()))
+        return true;
+    BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+        if (MatchScript(txout.scriptPubKey))
+            return true;
+    }
+    if (!tx.IsCoinBase() && !setTxids.empty()) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (setTxids.count(txin.prevout.hash))
+                return true;
+        }
+    }
+    return false;
+}
+
+CWalletScanReader::CWalletScanReader(const std::vector<CBlockIndex*>& vBlocksIn, const CWalletScanFilter& filterIn, int nThreads)
+    : vBlocks(vBlocksIn), filter(filterIn), nNextRead(0), nNextConsumed(0), fStop(false)
+{
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+    nWindow = nThreads * RESCAN_READAHEAD_PER_THREAD;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CWalletScanReader::ThreadRead, this));
+}
+
+CWalletScanReader::~CWalletScanReader()
+{
+    Stop();
+    threads.join_all();
+}
+
+void CWalletScanReader::Stop()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = true;
+    condRead.notify_all();
+    condConsumed.notify_all();
+}
+
+void CWalletScanReader::ThreadRead()
+{
+    RenameThread("bitmoney-rescan");
+    while (true) {
+        size_t nPos;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nNextRead < vBlocks.size() && nNextRead >= nNextConsumed + nWindow)
+                condConsumed.wait(lock);
+            if (fStop || nNextRead >= vBlocks.size())
+                return;
+            nPos = nNextRead++;
+        }
+
+        CWalletScanBlock scanned;
+        scanned.pindex = vBlocks[nPos];
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        if (ReadBlockFromDisk(*pblock, scanned.pindex)) {
+            for (unsigned int i = 0; i < pblock->vtx.size(); i++) {
+                if (filter.Match(pblock->vtx[i]))
+                    scanned.vMatches.push_back(i);
+            }
+            scanned.pblock = pblock;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapRead[nPos] = scanned;
+        if (nPos == nNextConsumed)
+            condRead.notify_all();
+    }
+}
+
+bool CWalletScanReader::Next(CWalletScanBlock& block)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nNextConsumed >= vBlocks.size())
+        return false;
+    std::map<size_t, CWalletScanBlock>::iterator it;
+    while (!fStop && (it = mapRead.find(nNextConsumed)) == mapRead.end())
+        condRead.wait(lock);
+    if (fStop)
+        return false;
+
+    block = it->second;
+    mapRead.erase(it);
+    nNextConsumed++;
+    condConsumed.notify_all();
+    return true;
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_WALLETSCAN_H
+#define BITMONEY_WALLETSCAN_H
+
+#include "primitives/block.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+class CBlockIndex;
+
+//! -rescanthreads default: threads reading blocks ahead of a wallet rescan (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads reading blocks ahead of a wallet rescan
+static const int MAX_RESCAN_THREADS = 8;
+//! Blocks a wallet rescan may read ahead of the one it is committing, per reading thread
+static const int RESCAN_READAHEAD_PER_THREAD = 16;
+
+/**
+ * What a wallet rescan looks for, taken from the keystore and mapWallet when the rescan starts so
+ * that blocks can be matched without the wallet lock. It matches every transaction the wallet's
+ * IsMine and IsFromMe would accept, and some more: multisig outputs with any key of ours, pay to
+ * script hash outputs to any script we know, and spends of any wallet transaction. The matches are
+ * checked with AddToWalletIfInvolvingMe under the lock.
+ */
+class CWalletScanFilter
+{
+private:
+    std::vector<uint160> vIDs;      //!< key and script IDs, sorted
+    std::set<CScript> setScripts;   //!< watch-only and multisig scripts
+    std::set<uint256> setTxids;     //!< wallet transactions
+
+    bool HaveID(const uint160& id) const;
+
+public:
+    void AddKeyID(const uint160& id) { vIDs.push_back(id); }
+    void AddScriptID(const uint160& id) { vIDs.push_back(id); }
+    void AddScript(const CScript& script) { setScripts.insert(script); }
+    void AddTxid(const uint256& txid) { setTxids.insert(txid); }
+    //! Call once everything is added, before matching
+    void Finalize();
+
+    bool MatchScript(const CScript& scriptPubKey) const;
+    bool Match(const CTransaction& tx) const;
+    size_t Size() const { return vIDs.size() + setScripts.size() + setTxids.size(); }
+};
+
+/** A block read for a wallet rescan, with the positions of the transactions the filter matched */
+struct CWalletScanBlock {
+    CBlockIndex* pindex;
+    boost::shared_ptr<CBlock> pblock; //!< NULL if the block could not be read
+    std::vector<unsigned int> vMatches;
+
+    CWalletScanBlock() : pindex(NULL) {}
+};
+
+/**
+ * Reads, deserializes and matches the blocks of a wallet rescan on worker threads, up to a window
+ * of blocks ahead of the one the rescan is committing. Next() hands them out in chain order.
+ */
+class CWalletScanReader
+{
+private:
+    const std::vector<CBlockIndex*>& vBlocks;
+    const CWalletScanFilter& filter;
+    size_t nWindow;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;     //!< a block was read
+    boost::condition_variable condConsumed; //!< the window moved
+    std::map<size_t, CWalletScanBlock> mapRead;
+    size_t nNextRead;                       //!< next block a worker picks up
+    size_t nNextConsumed;                   //!< next block Next() returns
+    bool fStop;
+    boost::thread_group threads;
+
+    void ThreadRead();
+
+public:
+    CWalletScanReader(const std::vector<CBlockIndex*>& vBlocksIn, const CWalletScanFilter& filterIn, int nThreads);
+    ~CWalletScanReader();
+
+    //! Wait for the next block in chain order, false when all blocks were returned
+    bool Next(CWalletScanBlock& block);
+    //! Stop the workers, Next() returns false from now on
+    void Stop();
+};
+
+#endif // BITMONEY_WALLETSCAN_H
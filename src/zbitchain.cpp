@@ -79,6 +79,90 @@ bool BlockToPubcoinList(const CBlock& block, std::list<libzerocoin::PublicCoin>&
     return true;
 }
 
+//sort the mints of a block by denomination, keeping the ones that BlockToPubcoinList would filter out separate
+bool BlockToPubcoins(const CBlock& block, CBlockPubcoins& pubcoins)
+{
+    pubcoins.SetNull();
+    for (const CTransaction& tx : block.vtx) {
+        if(!tx.IsZerocoinMint())
+            continue;
+
+        bool fValid = true;
+        for (const CTxIn& in : tx.vin) {
+            if (!ValidOutPoint(in.prevout, INT_MAX)) {
+                fValid = false;
+                break;
+            }
+        }
+
+        uint256 txHash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            //once an output uses an invalid outpoint, the rest of the transaction is filtered as well
+            if (fValid && !ValidOutPoint(COutPoint(txHash, i), INT_MAX))
+                fValid = false;
+
+            const CTxOut txOut = tx.vout[i];
+            if(!txOut.scriptPubKey.IsZerocoinMint())
+                continue;
+
+            CValidationState state;
+            libzerocoin::PublicCoin pubCoin(Params().Zerocoin_Params(false));
+            if(!TxOutToPublicCoin(txOut, pubCoin, state))
+                return false;
+
+            if (fValid)
+                pubcoins.mapValid[pubCoin.getDenomination()].emplace_back(pubCoin.getValue());
+            else
+                pubcoins.mapInvalid[pubCoin.getDenomination()].emplace_back(pubCoin.getValue());
+        }
+    }
+
+    return true;
+}
+
+//read the mints of a block from the zerocoinDB index, falling back to the block on disk for blocks that are not indexed yet
+bool GetBlockPubcoins(const CBlockIndex* pindex, CBlockPubcoins& pubcoins)
+{
+    if (zerocoinDB->ReadBlockPubcoins(pindex->GetBlockHash(), pubcoins))
+        return true;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("%s: failed to read block %d from disk", __func__, pindex->nHeight);
+
+    if (!BlockToPubcoins(block, pubcoins))
+        return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
+
+    if (!zerocoinDB->WriteBlockPubcoins(pindex->GetBlockHash(), pubcoins))
+        LogPrint("zero", "%s: failed to index pubcoins of block %d\n", __func__, pindex->nHeight);
+
+    return true;
+}
+
+//same result as BlockToPubcoinList, ordered by denomination. ZQ_ERROR returns the mints of every denomination.
+bool GetBlockPubcoinList(const CBlockIndex* pindex, std::list<libzerocoin::PublicCoin>& listPubcoins, bool fFilterInvalid, libzerocoin::CoinDenomination denom)
+{
+    CBlockPubcoins pubcoins;
+    if (!GetBlockPubcoins(pindex, pubcoins))
+        return false;
+
+    std::vector<const std::map<libzerocoin::CoinDenomination, std::vector<CBigNum> >*> vMaps = {&pubcoins.mapValid};
+    if (!fFilterInvalid)
+        vMaps.emplace_back(&pubcoins.mapInvalid);
+
+    for (auto pmap : vMaps) {
+        for (auto& it : *pmap) {
+            if (denom != libzerocoin::ZQ_ERROR && it.first != denom)
+                continue;
+
+            for (const CBigNum& bnValue : it.second)
+                listPubcoins.emplace_back(libzerocoin::PublicCoin(Params().Zerocoin_Params(false), bnValue, it.first));
+        }
+    }
+
+    return true;
+}
+
 //return a list of zerocoin mints contained in a specific block
 bool BlockToZerocoinMintList(const CBlock& block, std::list<CZerocoinMint>& vMints, bool fFilterInvalid)
 {
@@ -12,7 +12,9 @@
 #include <string>
 
 class CBlock;
+class CBlockIndex;
 class CBigNum;
+class CBlockPubcoins;
 struct CMintMeta;
 class CTransaction;
 class CTxIn;
@@ -23,8 +25,11 @@ class uint256;
 
 bool BlockToMintValueVector(const CBlock& block, const libzerocoin::CoinDenomination denom, std::vector<CBigNum>& vValues);
 bool BlockToPubcoinList(const CBlock& block, std::list<libzerocoin::PublicCoin>& listPubcoins, bool fFilterInvalid);
+bool BlockToPubcoins(const CBlock& block, CBlockPubcoins& pubcoins);
 bool BlockToZerocoinMintList(const CBlock& block, std::list<CZerocoinMint>& vMints, bool fFilterInvalid);
 void FindMints(std::vector<CMintMeta> vMintsToFind, std::vector<CMintMeta>& vMintsToUpdate, std::vector<CMintMeta>& vMissingMints);
+bool GetBlockPubcoins(const CBlockIndex* pindex, CBlockPubcoins& pubcoins);
+bool GetBlockPubcoinList(const CBlockIndex* pindex, std::list<libzerocoin::PublicCoin>& listPubcoins, bool fFilterInvalid, libzerocoin::CoinDenomination denom = libzerocoin::ZQ_ERROR);
 int GetZerocoinStartHeight();
 bool GetZerocoinMint(const CBigNum& bnPubcoin, uint256& txHash);
 bool IsPubcoinInBlockchain(const uint256& hashPubcoin, uint256& txid);
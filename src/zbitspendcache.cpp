@@ -0,0 +1,93 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zbitspendcache.h"
+
+#include "hash.h"
+#include "random.h"
+#include "util.h"
+
+#include <atomic>
+
+#include <boost/thread.hpp>
+
+namespace {
+
+/**
+ * Valid zerocoin spend cache, to avoid verifying the accumulator and serial
+ * number proofs of a spend twice (once when accepted into memory pool, and
+ * again when its block is checked)
+ */
+class CZerocoinSpendCache
+{
+private:
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_spendcache;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+
+public:
+    CZerocoinSpendCache() : nHits(0), nMisses(0) {}
+
+    bool Get(const uint256& key)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_spendcache);
+        if (setValid.count(key)) {
+            nHits++;
+            return true;
+        }
+        nMisses++;
+        return false;
+    }
+
+    void Set(const uint256& key)
+    {
+        // Each entry is a single hash, and a block holds at most a few hundred spends
+        int64_t nMaxCacheSize = GetArg("-maxzbitspendcachesize", DEFAULT_MAX_ZBIT_SPEND_CACHE_SIZE);
+        if (nMaxCacheSize <= 0) return;
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_spendcache);
+        while (static_cast<int64_t>(setValid.size()) >= nMaxCacheSize) {
+            // Evict a random entry, as CSignatureCache does
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+        setValid.insert(key);
+    }
+
+    void GetStats(uint64_t& nSize, uint64_t& nHitsOut, uint64_t& nMissesOut)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_spendcache);
+        nSize = setValid.size();
+        nHitsOut = nHits;
+        nMissesOut = nMisses;
+    }
+};
+
+CZerocoinSpendCache spendCache;
+}
+
+uint256 GetZerocoinSpendCacheKey(const libzerocoin::CoinSpend& spend, const CBigNum& bnAccumulatorValue, bool fAccumulatorV1Params)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << spend << bnAccumulatorValue << fAccumulatorV1Params;
+    return ss.GetHash();
+}
+
+bool IsZerocoinSpendCached(const uint256& key)
+{
+    return spendCache.Get(key);
+}
+
+void AddZerocoinSpendToCache(const uint256& key)
+{
+    spendCache.Set(key);
+}
+
+void GetZerocoinSpendCacheStats(uint64_t& nSize, uint64_t& nHits, uint64_t& nMisses)
+{
+    spendCache.GetStats(nSize, nHits, nMisses);
+}
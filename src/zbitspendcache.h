@@ -0,0 +1,24 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_ZBITSPENDCACHE_H
+#define BITMONEY_ZBITSPENDCACHE_H
+
+#include "libzerocoin/CoinSpend.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+static const unsigned int DEFAULT_MAX_ZBIT_SPEND_CACHE_SIZE = 20000;
+
+/** Key of a verified spend: the serialized spend (serial, checksum, txout hash and proofs)
+ * together with the accumulator value and params it was verified against */
+uint256 GetZerocoinSpendCacheKey(const libzerocoin::CoinSpend& spend, const CBigNum& bnAccumulatorValue, bool fAccumulatorV1Params);
+/** Whether a spend with this key already passed CoinSpend::Verify */
+bool IsZerocoinSpendCached(const uint256& key);
+/** Remember that the spend with this key passed CoinSpend::Verify */
+void AddZerocoinSpendToCache(const uint256& key);
+void GetZerocoinSpendCacheStats(uint64_t& nSize, uint64_t& nHits, uint64_t& nMisses);
+
+#endif //BITMONEY_ZBITSPENDCACHE_H
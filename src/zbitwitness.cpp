@@ -0,0 +1,162 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zbitwitness.h"
+#include "init.h"
+#include "main.h"
+#include "util.h"
+#include "walletdb.h"
+#include "zbitchain.h"
+
+using namespace std;
+
+CzbitWitnessStore::CzbitWitnessStore(std::string strWalletFile)
+{
+    this->strWalletFile = strWalletFile;
+    mapWitnesses.clear();
+    fInitialized = false;
+    fUpdateRequested = false;
+}
+
+void CzbitWitnessStore::Init()
+{
+    LOCK(cs_witnesses);
+    if (fInitialized)
+        return;
+
+    mapWitnesses = CWalletDB(strWalletFile).MapWitnessData();
+    LogPrint("zero", "%s: loaded %d precomputed witnesses\n", __func__, mapWitnesses.size());
+    fInitialized = true;
+}
+
+bool CzbitWitnessStore::Get(const uint256& hashPubcoin, CoinWitnessData& data) const
+{
+    LOCK(cs_witnesses);
+    auto it = mapWitnesses.find(hashPubcoin);
+    if (it == mapWitnesses.end())
+        return false;
+
+    data = it->second;
+    return true;
+}
+
+size_t CzbitWitnessStore::Size() const
+{
+    LOCK(cs_witnesses);
+    return mapWitnesses.size();
+}
+
+//The tracker only knows the pubcoin hash, the value itself is read from the mint transaction
+bool CzbitWitnessStore::GetPubcoin(const CMintMeta& meta, libzerocoin::PublicCoin& pubcoin)
+{
+    CTransaction tx;
+    uint256 hashBlock;
+    if (!GetTransaction(meta.txid, tx, hashBlock, true))
+        return error("%s: failed to read mint tx %s", __func__, meta.txid.GetHex());
+
+    for (const CTxOut& out : tx.vout) {
+        if (!out.scriptPubKey.IsZerocoinMint())
+            continue;
+
+        CValidationState state;
+        if (!TxOutToPublicCoin(out, pubcoin, state))
+            continue;
+
+        if (GetPubCoinHash(pubcoin.getValue()) == meta.hashPubcoin)
+            return true;
+    }
+
+    return error("%s: pubcoin %s not found in tx %s", __func__, meta.hashPubcoin.GetHex(), meta.txid.GetHex());
+}
+
+//Bring a single witness up to the deepest spendable checkpoint, releasing cs_main between batches of blocks
+bool CzbitWitnessStore::UpdateWitness(const CMintMeta& meta, CoinWitnessData& data)
+{
+    while (!ShutdownRequested()) {
+        LOCK(cs_main);
+        if (data.IsNull() || !IsAccumulatorWitnessInChain(data)) {
+            libzerocoin::PublicCoin pubcoin(Params().Zerocoin_Params(false));
+            if (!GetPubcoin(meta, pubcoin) || !InitAccumulatorWitness(pubcoin, data))
+                return false;
+        }
+
+        //same stop height that a spend at the current tip uses
+        int nChainHeight = chainActive.Height();
+        int nHeightStop = nChainHeight - (nChainHeight % 10) - 20;
+        if (data.nHeightNext >= nHeightStop)
+            return true;
+
+        int nHeightSpend;
+        if (!AdvanceAccumulatorWitness(data, std::min(nHeightStop, data.nHeightNext + WITNESS_STORE_UPDATE_BATCH), 100, nHeightSpend))
+            return false;
+
+        if (nHeightSpend < 0)
+            return true;
+    }
+
+    return false;
+}
+
+void CzbitWitnessStore::Update(const std::vector<CMintMeta>& vMints)
+{
+    Init();
+
+    CWalletDB walletdb(strWalletFile);
+    set<uint256> setUnspent;
+    for (const CMintMeta& meta : vMints) {
+        setUnspent.insert(meta.hashPubcoin);
+
+        CoinWitnessData data;
+        Get(meta.hashPubcoin, data);
+        int nHeightNextPrev = data.nHeightNext;
+        uint256 hashLastBlockPrev = data.hashLastBlock;
+        if (!UpdateWitness(meta, data)) {
+            LogPrint("zero", "%s: failed to update witness for pubcoin %s\n", __func__, meta.hashPubcoin.GetHex());
+            continue;
+        }
+
+        if (data.nHeightNext == nHeightNextPrev && data.hashLastBlock == hashLastBlockPrev)
+            continue;
+
+        {
+            LOCK(cs_witnesses);
+            mapWitnesses[meta.hashPubcoin] = data;
+        }
+        if (!walletdb.WriteWitnessData(meta.hashPubcoin, data))
+            LogPrintf("%s: failed to write witness for pubcoin %s\n", __func__, meta.hashPubcoin.GetHex());
+    }
+
+    //drop witnesses of mints that were spent or archived
+    vector<uint256> vErase;
+    {
+        LOCK(cs_witnesses);
+        for (auto it = mapWitnesses.begin(); it != mapWitnesses.end();) {
+            if (setUnspent.count(it->first)) {
+                ++it;
+                continue;
+            }
+            vErase.emplace_back(it->first);
+            mapWitnesses.erase(it++);
+        }
+    }
+    for (const uint256& hashPubcoin : vErase)
+        walletdb.EraseWitnessData(hashPubcoin);
+}
+
+void CzbitWitnessStore::RequestUpdate()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRequest);
+        fUpdateRequested = true;
+    }
+    condRequest.notify_one();
+}
+
+void CzbitWitnessStore::WaitForUpdateRequest()
+{
+    boost::unique_lock<boost::mutex> lock(mutexRequest);
+    while (!fUpdateRequested)
+        condRequest.wait(lock);
+    fUpdateRequested = false;
+}
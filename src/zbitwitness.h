@@ -0,0 +1,58 @@
+// Copyright (c) 2018 The BitMoney developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMONEY_zbitWITNESS_H
+#define BITMONEY_zbitWITNESS_H
+
+#include "accumulators.h"
+#include "primitives/zerocoin.h"
+#include "sync.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+
+//! Number of blocks added to a single witness before cs_main is released while catching up
+static const int WITNESS_STORE_UPDATE_BATCH = 500;
+
+/**
+ * Keeps the accumulator witness of each unspent mint in the wallet up to date as blocks connect, so that
+ * spends and zPoS stakes only have to add the last few blocks instead of walking the chain from the mint.
+ * Witnesses only cover blocks that are at least two checkpoints deep. If a reorg removes a block a witness
+ * has accumulated, the witness is rolled back to the checkpoint before its mint and recomputed.
+ */
+class CzbitWitnessStore
+{
+private:
+    bool fInitialized;
+    std::string strWalletFile;
+    std::map<uint256, CoinWitnessData> mapWitnesses; //hashPubcoin, witness
+    mutable CCriticalSection cs_witnesses;
+
+    //! Set by RequestUpdate() and cleared by the witness thread when it picks the request up
+    bool fUpdateRequested;
+    boost::mutex mutexRequest;
+    boost::condition_variable condRequest;
+
+    bool GetPubcoin(const CMintMeta& meta, libzerocoin::PublicCoin& pubcoin);
+    bool UpdateWitness(const CMintMeta& meta, CoinWitnessData& data);
+
+public:
+    CzbitWitnessStore(std::string strWalletFile);
+    void Init();
+    bool Get(const uint256& hashPubcoin, CoinWitnessData& data) const;
+    size_t Size() const;
+    void Update(const std::vector<CMintMeta>& vMints);
+
+    //! Ask the witness thread for an Update(); requests made while it is busy are coalesced
+    void RequestUpdate();
+    //! Block until an update was requested (interruptible)
+    void WaitForUpdateRequest();
+};
+
+#endif //BITMONEY_zbitWITNESS_H